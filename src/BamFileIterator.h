@@ -4,17 +4,236 @@
 #ifndef BAMFILEITERATOR_H
 #define BAMFILEITERATOR_H
 
+#include <functional>
 #include "BamIterator.h"
+#include "TemplateSpill.h"
 
 
 class BamFileIterator : public BamIterator {
 
     bool file_done;
 
+    // On a coordinate-sorted file, a template is retired once the sweep
+    // passes the positions of all the mates its segments name; until
+    // then it waits in 'retire', ordered by that position.
+    struct Retire {
+        uint64_t position;
+        int id;
+        unsigned int generation;
+        bool operator>(const Retire &other) const {
+            return position > other.position;
+        }
+    };
+
+    bool sorted;
+    uint64_t last_position;
+    vector<Retire> retire_at;           // by template id
+    priority_queue<Retire, vector<Retire>, greater<Retire> > retire;
+
+    // unmapped records without coordinate (tid -1) sort last
+    static uint64_t position(int32_t tid, int32_t pos) {
+        return ((uint64_t) (uint32_t) tid << 32) | (uint32_t) pos;
+    }
+
+    // position after which no other segment of the template of 'bam'
+    // can appear
+    static uint64_t retire_position(const bam1_t *bam) {
+        const uint64_t pos = position(bam->core.tid, bam->core.pos);
+        if (!(bam->core.flag & BAM_FPAIRED))
+            return pos;
+        if (bam->core.mtid < 0)         // mate anywhere; keep to the end
+            return ~(uint64_t) 0;
+        const uint64_t mpos = position(bam->core.mtid, bam->core.mpos);
+        return mpos > pos ? mpos : pos;
+    }
+
+    void schedule(int id, const bam1_t *bam) {
+        if (retire_at.size() <= (size_t) id) {
+            Retire none = { 0, id, ~0u };       // never scheduled
+            retire_at.resize(id + 1, none);
+        }
+        Retire &r = retire_at[id];
+        const unsigned int generation = templates.generation(id);
+        const uint64_t pos = retire_position(bam);
+        if (r.generation == generation && r.position >= pos)
+            return;
+        r.position = pos;
+        r.id = id;
+        r.generation = generation;
+        retire.push(r);
+    }
+
+    // report templates whose mates lie before the record at 'tid', 'pos'
+    void retire_templates(int32_t tid, int32_t pos) {
+        const uint64_t current = position(tid, pos);
+        if (current < last_position) {  // not sorted after all
+            sorted = false;
+            unsorted_run = run + 1;
+            retire = priority_queue<Retire, vector<Retire>,
+                                    greater<Retire> >();
+            return;
+        }
+        last_position = current;
+        while (!retire.empty() && retire.top().position < current) {
+            const Retire r = retire.top();
+            retire.pop();
+            const Retire &at = retire_at[r.id];
+            if (r.generation != templates.generation(r.id) ||
+                r.generation != at.generation || r.position != at.position)
+                continue;               // stale
+            evict(r.id);
+        }
+    }
+
+    // Over max_memory(), the templates of partitions of the qname hash
+    // move to 'spill', and later records of those partitions follow;
+    // once the file is read, the partitions are paired one at a time.
+    TemplateSpill spill;
+    uint32_t run;                       // runs of equal positions read
+    uint32_t unsorted_run;              // first run not retiring templates
+
+    bool divert(const char *trimmed_qname, const bam1_t *bam) {
+        if (!spill.spilled(0))          // nothing spilled
+            return false;
+        const int p =
+            TemplateSpill::partition(TemplateTable::hash_qname(trimmed_qname));
+        if (!spill.spilled(p))
+            return false;
+        if (!spill.write(p, TemplateSpill::ARRIVED, run, 0, bam))
+            failure = "could not write temporary file";
+        return true;
+    }
+
+    // spill templates until the records held fall to half of 'limit'
+    void spill_templates(size_t limit) {
+        const size_t held = pool.bytes();
+        const int n_unspilled = spill.n_unspilled();
+        if (0 == limit || held <= limit || 0 == n_unspilled)
+            return;
+
+        // partitions to spill, were templates spread evenly over them
+        int n = (int) ((double) n_unspilled * (held - limit / 2) / held) + 1;
+        if (n > n_unspilled)
+            n = n_unspilled;
+        const int first = TemplateSpill::N_PARTITION - n_unspilled;
+        for (int i = 0; i < n; ++i)
+            if (spill.spill(spill_prefix()) < 0) {
+                failure = "could not create temporary file";
+                return;
+            }
+
+        vector<int> ids = templates.ids(false);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            const int id = ids[i];
+            const int p = TemplateSpill::partition(templates.hash(id));
+            if (p < first || p >= first + n)
+                continue;
+            Template &t = templates[id];
+            const uint64_t retire_pos =
+                (size_t) id < retire_at.size() &&
+                retire_at[id].generation == templates.generation(id) ?
+                retire_at[id].position : ~(uint64_t) 0;
+            for (int state = Template::INPROGRESS; state <= Template::INVALID;
+                 ++state) {
+                const Template::Segments &segments =
+                    t.segments((Template::State) state);
+                for (size_t j = 0; j < segments.size(); ++j) {
+                    if (!spill.write(p, state, run, retire_pos, segments[j]))
+                        failure = "could not write temporary file";
+                    pool.release(segments[j]);
+                }
+            }
+            t.clear();
+            templates.erase(id);
+        }
+        pool.trim();
+    }
+
+    // pair the records of partition 'p' as they would have been paired
+    // in memory: a template is mated when a run ends that added to it,
+    // and retired when a record follows its retire position
+    struct Replay {
+        uint32_t run;                   // last run adding a valid segment
+        bool to_mate;
+        uint64_t retire;
+    };
+
+    int replay_template(const char *qname, vector<Replay> &replay) {
+        const int id = templates.find_or_add(qname);
+        if (replay.size() <= (size_t) id)
+            replay.resize(id + 1);
+        if (templates[id].empty()) {
+            Replay none = { 0, false, 0 };
+            replay[id] = none;
+        }
+        return id;
+    }
+
+    void pair_partition(int p, bamFile bfile) {
+        vector<Replay> replay;          // by template id
+        int state;
+        uint32_t r;
+        uint64_t retire_pos;
+        bam1_t *b;
+        int status;
+        while (0 < (status = spill.read(p, state, r, retire_pos, pool, b))) {
+            const char *qname = bam1_qname(b);
+            int id = replay_template(qname, replay);
+            if (TemplateSpill::ARRIVED != state) {
+                templates[id].restore(b, (Template::State) state);
+                replay[id].retire = retire_pos;
+                continue;
+            }
+            if (replay[id].to_mate && replay[id].run != r) {
+                templates[id].mate(complete, header->target_len);
+                replay[id].to_mate = false;
+                if (templates[id].empty()) {
+                    templates.erase(id);
+                    id = replay_template(qname, replay);
+                }
+            }
+            if (r < unsorted_run && !templates[id].empty() &&
+                replay[id].retire < position(b->core.tid, b->core.pos)) {
+                evict(id);
+                id = replay_template(qname, replay);
+            }
+            const uint64_t pos = retire_position(b);
+            if (replay[id].retire < pos)
+                replay[id].retire = pos;
+            if (templates[id].add_segment(b)) {
+                replay[id].to_mate = true;
+                replay[id].run = r;
+            }
+        }
+        spill.close(p);
+        if (status < 0) {
+            failure = "could not read temporary file";
+            return;
+        }
+
+        vector<int> ids = templates.ids();
+        for (size_t i = 0; i < ids.size(); ++i)
+            if (replay[ids[i]].to_mate)
+                templates[ids[i]].mate(complete, header->target_len);
+        BamIterator::finalize_inprogress(bfile);
+    }
+
+    bool pending() const {
+        return BamIterator::pending() || spill.pending();
+    }
+
+    void finalize_inprogress(bamFile bfile) {
+        if (!templates.empty())
+            BamIterator::finalize_inprogress(bfile);
+        int p;
+        while (!queued() && NULL == failure && (p = spill.next()) >= 0)
+            pair_partition(p, bfile);
+    }
+
     void iterate_inprogress(bamFile bfile) {
         if (iter_done | file_done)
             return;
-        if (NULL == bam) {    // first record 
+        if (NULL == bam) {    // first record
             bam = bam_init1();
             if (bam_read1(bfile, bam) < 0) {
                 iter_done = true;
@@ -24,7 +243,9 @@ class BamFileIterator : public BamIterator {
 
         bool done = false;
         do {
-            process(bam);
+            const int id = process(bam);
+            if (sorted && id >= 0)
+                schedule(id, bam);
             int tid = bam->core.tid;
             int pos = bam->core.pos;
             if (bam_read1(bfile, bam) < 0) {
@@ -33,9 +254,13 @@ class BamFileIterator : public BamIterator {
             } else {
                 if ((bam->core.tid != tid) || (bam->core.pos != pos)) {
                     mate_touched_templates();
-                    done = !complete.empty();
-                } 
-            } 
+                    if (sorted)
+                        retire_templates(bam->core.tid, bam->core.pos);
+                    spill_templates(max_memory());
+                    run += 1;
+                    done = queued() || NULL != failure;
+                }
+            }
         } while (!done);
     }
 
@@ -43,7 +268,13 @@ public:
 
     // constructor / destructor
     BamFileIterator(bamFile bfile, const bam_index_t *bindex) :
-        BamIterator(bfile, bindex), file_done(false) {}
+        BamIterator(bfile, bindex), file_done(false), last_position(0),
+        run(0)
+    {
+        // an index implies coordinate order
+        sorted = NULL != bindex || sorted_by(header, "coordinate");
+        unsorted_run = sorted ? ~0u : 0;
+    }
 
 };
 
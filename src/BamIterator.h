@@ -5,24 +5,25 @@
 #ifndef BAMITERATOR_H
 #define BAMITERATOR_H
 
-#include <set>
-#include <map>
 #include "Template.h"
+#include "TemplateTable.h"
+#include "BamPool.h"
 #include "bam_data.h"
 
 class BamIterator {
 
     BAM_DATA bam_data;
 
-    queue<list<const bam1_t *> > ambiguous;
-    queue<list<const bam1_t *> > unmated;
-    set<string> touched_templates;
+    queue<Template::Segments> ambiguous;
+    queue<Template::Segments> unmated;
+    vector<int> touched_templates;
+    vector<bool> touched;               // by template id
 
 protected:
 
-    typedef map<string, Template> Templates;
-    Templates templates;
-    queue<list<const bam1_t *> > complete;
+    TemplateTable templates;
+    BamPool pool;
+    queue<Template::Segments> complete;
 
     const bam_index_t *bindex;
     bam_header_t *header;
@@ -39,51 +40,130 @@ protected:
             Rf_error("[qname_suffix_start] report to maintainer('Rsamtools')");
         return bam_data->qnameSuffixStart;
     }
-        
+
+    // bytes of records held before templates are spilled; 0: no limit
+    size_t max_memory() const {
+        if (bam_data == NULL)
+            Rf_error("[max_memory] report to maintainer('Rsamtools')");
+        return (size_t) (bam_data->maxMateMemory * 1048576.);
+    }
+
+    // stem of temporary file names, in R's tempdir()
+    const char *spill_prefix() const {
+        if (bam_data == NULL || bam_data->spillPrefix == NULL)
+            Rf_error("[spill_prefix] report to maintainer('Rsamtools')");
+        return bam_data->spillPrefix;
+    }
+
+    // set on failure, stopping iteration; reported by the caller, so
+    // that errors do not unwind through this class
+    const char *failure;
+
 
     void mate_touched_templates() {
-        for (set<string>::iterator it=touched_templates.begin();
-             it != touched_templates.end(); ++it) {
-            templates[*it].mate(complete, header->target_len);
-            if (templates[*it].empty())
-                templates.erase(*it);
+        // qname order, as templates complete at the same position
+        templates.sort_by_qname(touched_templates);
+        for (size_t i = 0; i < touched_templates.size(); ++i) {
+            const int id = touched_templates[i];
+            touched[id] = false;
+            templates[id].mate(complete, header->target_len);
+            if (templates[id].empty())
+                templates.erase(id);
         }
         touched_templates.clear();
     }
 
-    // process
-    void process(const bam1_t *bam) {
+    // report a template as it stands; its mates cannot appear
+    void evict(Template &t) {
+        t.cleanup(ambiguous, unmated);
+    }
+
+    void evict(int id) {
+        evict(templates[id]);
+        templates.erase(id);
+    }
+
+    bool queued() const {
+        return !complete.empty() || !ambiguous.empty() || !unmated.empty();
+    }
+
+    bool filter(const bam1_t *bam) const {
         if (bam_data == NULL)
-            Rf_error("[process] report to maintainer('Rsamtools')");
-        if (!_filter1_BAM_DATA(bam, bam_data))
-            return;
+            Rf_error("[filter] report to maintainer('Rsamtools')");
+        return _filter1_BAM_DATA(bam, bam_data);
+    }
+
+    // process; returns the template of 'bam', or -1 if filtered
+    int process(const bam1_t *bam) {
+        if (!filter(bam))
+            return -1;
         const char *trimmed_qname =
             Template::qname_trim(bam1_qname(bam), qname_prefix_end(),
                                  qname_suffix_start());
-        if (templates[trimmed_qname].add_segment(bam))
-            touched_templates.insert(trimmed_qname);
+        if (divert(trimmed_qname, bam))
+            return -1;
+        const int id = templates.find_or_add(trimmed_qname);
+        if (templates[id].add_segment(bam, pool)) {
+            if (touched.size() <= (size_t) id)
+                touched.resize(id + 1, false);
+            if (!touched[id]) {
+                touched[id] = true;
+                touched_templates.push_back(id);
+            }
+        }
+        return id;
+    }
+
+    // true if 'bam' is kept elsewhere than in 'templates'
+    virtual bool divert(const char *trimmed_qname, const bam1_t *bam) {
+        return false;
+    }
+
+    // segments remain to be finalized
+    virtual bool pending() const {
+        return !templates.empty();
     }
 
     virtual void iterate_inprogress(bamFile bfile) = 0;
 
     virtual void finalize_inprogress(bamFile bfile) {
-        Templates::iterator it;
         // transfer Template::ambiguous to BamIterator::ambiguous
         // transfer Template::inprogress and Template::invalid to 
         // BamIterator::unmated
-        for (it = templates.begin(); it != templates.end(); ++it)
-            it->second.cleanup(ambiguous, unmated);
+        vector<int> ids = templates.ids();
+        for (size_t i = 0; i < ids.size(); ++i)
+            templates[ids[i]].cleanup(ambiguous, unmated);
         templates.clear();
     }
 
 public:
 
+    // the @HD line of 'header' declares sort order 'so'
+    static bool sorted_by(const bam_header_t *header, const char *so) {
+        const char *hd = header->text;
+        if (NULL == hd || strncmp(hd, "@HD", 3) != 0)
+            return false;
+        const char *end = strchr(hd, '\n');
+        const char *s = strstr(hd, "\tSO:");
+        if (NULL == s || (NULL != end && s > end))
+            return false;
+        const size_t len = strlen(so);
+        if (strncmp(s + 4, so, len) != 0)
+            return false;
+        const char c = s[4 + len];
+        return c == '\t' || c == '\n' || c == '\0';
+    }
+
     bool iter_done;
 
+    const char *failed() const {
+        return failure;
+    }
+
     // constructor / destructor
     BamIterator(bamFile bfile, const bam_index_t *bindex) :
         bindex(bindex), iter_done(false),
-        bam(NULL), bam_data(NULL)
+        bam(NULL), bam_data(NULL), failure(NULL)
     {
         bam_seek(bfile, 0, 0);
         header = bam_header_read(bfile);
@@ -99,14 +179,25 @@ public:
         this->bam_data = bd;
     }
 
+    // the records of the last yield return to the pool
+    void release(bam_mates_t *result) {
+        for (int i = 0; i < result->n; ++i)
+            pool.release(result->bams[i]);
+        result->n = 0;
+    }
+
     // yield
     void yield(bamFile bfile, bam_mates_t *result) {
-        if (complete.empty() && !iter_done)
+        if (!queued() && !iter_done && NULL == failure)
             iterate_inprogress(bfile);
-        if (complete.empty() && !templates.empty())
+        if (!queued() && pending() && NULL == failure)
             finalize_inprogress(bfile);
 
-        list<const bam1_t *> elts;
+        release(result);
+        if (NULL != failure)
+            return;
+
+        Template::Segments elts;
         MATE_STATUS mated = MATE_UNKNOWN;
         if (!complete.empty()) {
             elts = complete.front();
@@ -123,10 +214,8 @@ public:
         }
 
         bam_mates_realloc(result, elts.size(), mated);
-        for (int i = 0; !elts.empty(); ++i) {
-            result->bams[i] = elts.front();
-            elts.pop_front();
-        }
+        for (size_t i = 0; i < elts.size(); ++i)
+            result->bams[i] = elts[i];
     }
 
 };
@@ -0,0 +1,86 @@
+// BamPool.h:
+// Recycled bam1_t records, so that segments held by templates reuse
+// the allocations of records already returned to the caller.
+
+#ifndef BAMPOOL_H
+#define BAMPOOL_H
+
+#include <vector>
+#include <stdlib.h>
+#include "samtools/sam.h"
+
+class BamPool {
+
+    std::vector<bam1_t *> available;
+    size_t n_bytes;                     // held by records not released
+
+    static size_t size(const bam1_t *bam) {
+        return sizeof(bam1_t) + bam->m_data;
+    }
+
+    bam1_t *take() {
+        if (available.empty())
+            return bam_init1();
+        bam1_t *b = available.back();
+        available.pop_back();
+        return b;
+    }
+
+public:
+
+    BamPool() : n_bytes(0) {}
+
+    ~BamPool() {
+        trim();
+    }
+
+    // a copy of 'bam', owned by the caller until released
+    bam1_t *dup(const bam1_t *bam) {
+        bam1_t *b = bam_copy1(take(), bam);
+        n_bytes += size(b);
+        return b;
+    }
+
+    // a record with room for 'data_len' bytes of data, to be filled
+    bam1_t *get(int data_len) {
+        bam1_t *b = take();
+        if (b->m_data < data_len) {
+            b->m_data = data_len;
+            kroundup32(b->m_data);
+            b->data = (uint8_t *) realloc(b->data, b->m_data);
+        }
+        b->data_len = data_len;
+        n_bytes += size(b);
+        return b;
+    }
+
+    // the next record of 'fp', read in place; NULL at end-of-file
+    bam1_t *read(bamFile fp) {
+        bam1_t *b = take();
+        if (bam_read1(fp, b) < 0) {
+            available.push_back(b);
+            return NULL;
+        }
+        n_bytes += size(b);
+        return b;
+    }
+
+    void release(const bam1_t *bam) {
+        n_bytes -= size(bam);
+        available.push_back(const_cast<bam1_t *>(bam));
+    }
+
+    size_t bytes() const {
+        return n_bytes;
+    }
+
+    // free the records available for reuse
+    void trim() {
+        for (size_t i = 0; i < available.size(); ++i)
+            bam_destroy1(available[i]);
+        available.clear();
+    }
+
+};
+
+#endif
@@ -0,0 +1,59 @@
+// BamQnameIterator.h:
+// Iterator used when reading a complete bam file sorted by qname. The
+// segments of a template are adjacent, so each template is mated, all
+// its segments at once, and reported when the next qname is read; one
+// template is held at a time, in records read in place from the pool.
+
+#ifndef BAMQNAMEITERATOR_H
+#define BAMQNAMEITERATOR_H
+
+#include "BamIterator.h"
+
+class BamQnameIterator : public BamIterator {
+
+    Template group;
+    string group_qname;
+    bool touched;                       // valid segments added, not mated
+
+    void mate_group() {
+        if (touched)
+            group.mate(complete, header->target_len);
+        touched = false;
+    }
+
+    void iterate_inprogress(bamFile bfile) {
+        bam1_t *b;
+        while (NULL != (b = pool.read(bfile))) {
+            if (!filter(b)) {
+                pool.release(b);
+                continue;
+            }
+
+            const char *trimmed_qname =
+                Template::qname_trim(bam1_qname(b), qname_prefix_end(),
+                                     qname_suffix_start());
+            if (group_qname.compare(trimmed_qname) != 0) {
+                mate_group();
+                evict(group);
+                group_qname.assign(trimmed_qname);
+            }
+            if (group.add_segment(b))
+                touched = true;
+            if (queued())
+                return;
+        }
+        mate_group();
+        evict(group);
+        iter_done = true;
+    }
+
+public:
+
+    // constructor / destructor
+    BamQnameIterator(bamFile bfile, const bam_index_t *bindex) :
+        BamIterator(bfile, bindex), touched(false)
+    {}
+
+};
+
+#endif
@@ -28,17 +28,69 @@ class BamRangeIterator : public BamIterator {
         mate_touched_templates();
     }
 
+    // mate positions looked up per sweep of bam_fetch_regions()
+    enum { MATE_BATCHSIZE = 4096 };
+
+    // look up the mates of 'inprogress' segments outside the range: the
+    // positions of all templates are sorted, and read in coalesced
+    // sweeps; records are handed to their templates by trimmed qname
     void finalize_inprogress(bamFile bfile) {
         int64_t pos = bam_tell(bfile);
-        Templates::iterator it;
-        // mate 'inprogress' segments for all templates
-        for (it = templates.begin(); it != templates.end(); ++it)
-            it->second.mate_inprogress_segments(bfile, bindex, complete,
-                                                qname_prefix_end(),
-                                                qname_suffix_start(),
-                                                tid, beg, end,
-                                                header->target_len,
-                                                it->first);
+        vector<int> ids = templates.ids();
+        vector<size_t> n_inprogress;    // by template id, before lookup
+        vector<pair<int32_t, int32_t> > positions;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            const Template &t = templates[ids[i]];
+            t.mate_positions(tid, beg, end, header->target_len, positions);
+            if (n_inprogress.size() <= (size_t) ids[i])
+                n_inprogress.resize(ids[i] + 1);
+            n_inprogress[ids[i]] = t.segments(Template::INPROGRESS).size();
+        }
+        sort(positions.begin(), positions.end());
+        positions.erase(unique(positions.begin(), positions.end()),
+                        positions.end());
+
+        vector<bool> touched(n_inprogress.size(), false);
+        vector<int> mtid, mbeg, mend;
+        vector<bam_batch_t *> batch;
+        for (size_t i = 0; i < positions.size(); i += MATE_BATCHSIZE) {
+            const size_t n = min(positions.size() - i, (size_t) MATE_BATCHSIZE);
+            mtid.resize(n);
+            mbeg.resize(n);
+            mend.resize(n);
+            while (batch.size() < n)
+                batch.push_back(bam_batch_init());
+            for (size_t j = 0; j < n; ++j) {
+                mtid[j] = positions[i + j].first;
+                mbeg[j] = positions[i + j].second;
+                mend[j] = mbeg[j] + 1;
+            }
+            bam_fetch_regions(bfile, bindex, n, &mtid[0], &mbeg[0], &mend[0],
+                              &batch[0]);
+            for (size_t j = 0; j < n; ++j)
+                for (int k = 0; k < batch[j]->n; ++k) {
+                    bam1_t *mate = &batch[j]->rec[k];
+                    if (mate->core.pos != mbeg[j])  // overlaps, starts before
+                        continue;
+                    const char *trimmed_qname =
+                        Template::qname_trim(bam1_qname(mate),
+                                             qname_prefix_end(),
+                                             qname_suffix_start());
+                    const int id = templates.find(trimmed_qname);
+                    if (id < 0 || 0 == n_inprogress[id])
+                        continue;
+                    if (templates[id].add_mate(mate, n_inprogress[id],
+                                               templates.qname(id),
+                                               header->target_len, pool))
+                        touched[id] = true;
+                }
+        }
+        for (size_t i = 0; i < batch.size(); ++i)
+            bam_batch_destroy(batch[i]);
+
+        for (size_t i = 0; i < ids.size(); ++i)
+            if (touched[ids[i]])
+                templates[ids[i]].mate(complete, header->target_len);
 
         BamIterator::finalize_inprogress(bfile);
         bam_seek(bfile, pos, SEEK_SET);
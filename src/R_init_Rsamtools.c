@@ -1,5 +1,7 @@
 #include <R_ext/Rdynload.h>
 #include "zip_compression.h"
+#include "bgzf_cache.h"
+#include "bgzf_codec.h"
 #include "utilities.h"
 #include "bamfile.h"
 #include "bcffile.h"
@@ -16,22 +18,31 @@
 
 static const R_CallMethodDef callMethods[] = {
     /* zip_compression.c */
-    {".bgzip", (DL_FUNC) & bgzip, 2},
-    {".razip", (DL_FUNC) & razip, 2},
+    {".bgzip", (DL_FUNC) & bgzip, 4},
+    {".razip", (DL_FUNC) & razip, 4},
+    /* bgzf_cache.c */
+    {".bgzf_cache_size", (DL_FUNC) & bgzf_cache_size, 1},
+    {".bgzf_cache_info", (DL_FUNC) & bgzf_cache_info, 0},
+    {".bgzf_cache_reset", (DL_FUNC) & bgzf_cache_reset, 0},
+    /* bgzf_codec.c */
+    {".bgzf_codec_select", (DL_FUNC) & bgzf_codec_select, 1},
+    {".bgzf_codec_available", (DL_FUNC) & bgzf_codec_available, 0},
     /* utilities.c */
     {".p_pairing", (DL_FUNC) & p_pairing, 12},
     {".find_mate_within_groups", (DL_FUNC) & find_mate_within_groups, 6},
     /* bamfile.c */
     {".bamfile_init", (DL_FUNC) & bamfile_init, 0},
-    {".bamfile_open", (DL_FUNC) & bamfile_open, 3},
+    {".bamfile_open", (DL_FUNC) & bamfile_open, 4},
     {".bamfile_close", (DL_FUNC) & bamfile_close, 1},
     {".bamfile_isopen", (DL_FUNC) & bamfile_isopen, 1},
     {".bamfile_isincomplete", (DL_FUNC) & bamfile_isincomplete, 1},
     {".read_bamfile_header", (DL_FUNC) & read_bamfile_header, 2},
-    {".scan_bamfile", (DL_FUNC) & scan_bamfile, 13},
-    {".count_bamfile", (DL_FUNC) & count_bamfile, 6},
-    {".prefilter_bamfile", (DL_FUNC) & prefilter_bamfile, 11},
-    {".filter_bamfile", (DL_FUNC) & filter_bamfile, 8},
+    {".scan_bamfile", (DL_FUNC) & scan_bamfile, 15},
+    {".count_bamfile", (DL_FUNC) & count_bamfile, 7},
+    {".idxstats_bamfile", (DL_FUNC) & idxstats_bamfile, 1},
+    {".count_bamfile_approximate", (DL_FUNC) & count_bamfile_approximate, 2},
+    {".prefilter_bamfile", (DL_FUNC) & prefilter_bamfile, 13},
+    {".filter_bamfile", (DL_FUNC) & filter_bamfile, 9},
     /* as_bam.c */
     {".as_bam", (DL_FUNC) & as_bam, 3},
     /* io_sam.c */
@@ -42,7 +53,7 @@ static const R_CallMethodDef callMethods[] = {
     {".index_bam", (DL_FUNC) & index_bam, 1},
     /* bcffile.c */
     {".bcffile_init", (DL_FUNC) & bcffile_init, 0},
-    {".bcffile_open", (DL_FUNC) & bcffile_open, 3},
+    {".bcffile_open", (DL_FUNC) & bcffile_open, 4},
     {".bcffile_close", (DL_FUNC) & bcffile_close, 1},
     {".bcffile_isopen", (DL_FUNC) & bcffile_isopen, 1},
     {".bcffile_isvcf", (DL_FUNC) & bcffile_isvcf, 1},
@@ -60,7 +71,7 @@ static const R_CallMethodDef callMethods[] = {
     {".scan_fa", (DL_FUNC) & scan_fa, 6},
     /* tabixfile */
     {".tabixfile_init", (DL_FUNC) & tabixfile_init, 0},
-    {".tabixfile_open", (DL_FUNC) & tabixfile_open, 2},
+    {".tabixfile_open", (DL_FUNC) & tabixfile_open, 3},
     {".tabixfile_close", (DL_FUNC) & tabixfile_close, 1},
     {".tabixfile_isopen", (DL_FUNC) & tabixfile_isopen, 1},
     {".index_tabix", (DL_FUNC) & index_tabix, 8},
@@ -74,10 +85,10 @@ static const R_CallMethodDef callMethods[] = {
     {".bambuffer_init", (DL_FUNC) & bambuffer_init, 0},
     {".bambuffer", (DL_FUNC) & bambuffer, 1},
     {".bambuffer_length", (DL_FUNC) & bambuffer_length, 1},
-    {".bambuffer_parse", (DL_FUNC) & bambuffer_parse, 9},
+    {".bambuffer_parse", (DL_FUNC) & bambuffer_parse, 10},
     {".bambuffer_write", (DL_FUNC) & bambuffer_write, 3},
     /* pileup */
-    {".c_Pileup", (DL_FUNC) & c_Pileup, 14},
+    {".c_Pileup", (DL_FUNC) & c_Pileup, 15},
     {NULL, NULL, 0}
 };
 
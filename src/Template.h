@@ -1,27 +1,32 @@
 #ifndef TEMPLATE_H
 #define TEMPLATE_H
 
-#include <map>
 #include <queue>
 #include <string>
+#include <vector>
 #include <algorithm>
-#include <list>
 #include "samtools/sam.h"
 #include "scan_bam_data.h"
+#include "BamPool.h"
 
 using namespace std;
 
 class Template {
 
-    typedef list<const bam1_t *> Segments;
-    typedef Segments::iterator iterator;
-    typedef Segments::const_iterator const_iterator;
+public:
+
+    typedef vector<const bam1_t *> Segments;
+
+    // the list holding a segment
+    enum State { INPROGRESS = 0, AMBIGUOUS, INVALID };
+
+private:
 
     Segments inprogress, ambiguous, invalid;
 
     // check readgroup and trimmed_qname
-    bool is_template(const string trimmed_qname,
-                     const string m_trimmed_qname,
+    bool is_template(const string &trimmed_qname,
+                     const char *m_trimmed_qname,
                      const bam1_t *mate) const {
         bool test = false;
 
@@ -118,6 +123,13 @@ public:
         return inprogress.empty() && invalid.empty() && ambiguous.empty();
     }
 
+    // forget segments, keeping the capacity of the vectors
+    void clear() {
+        inprogress.clear();
+        ambiguous.clear();
+        invalid.clear();
+    }
+
     static const char *qname_trim(char *qname, const char prefix,
                                   const char suffix)
     {
@@ -144,8 +156,12 @@ public:
     }
 
     // Returns true if potential mate, false if invalid
-    bool add_segment(const bam1_t *bam1) {
-        bam1_t *bam = bam_dup1(bam1);
+    bool add_segment(const bam1_t *bam1, BamPool &pool) {
+        return add_segment(pool.dup(bam1));
+    }
+
+    // as above, for a record already owned by the template
+    bool add_segment(const bam1_t *bam) {
         if (!is_valid(bam)) {
             invalid.push_back(bam);
             return false;
@@ -154,25 +170,34 @@ public:
         return true;
     }
 
+    const Segments &segments(State state) const {
+        return state == INPROGRESS ? inprogress :
+            state == AMBIGUOUS ? ambiguous : invalid;
+    }
+
+    // return a segment taken from 'segments(state)' to that list
+    void restore(const bam1_t *bam, State state) {
+        switch (state) {
+        case INPROGRESS: inprogress.push_back(bam); break;
+        case AMBIGUOUS: ambiguous.push_back(bam); break;
+        case INVALID: invalid.push_back(bam); break;
+        }
+    }
+
     void mate(queue<Segments> &complete, const uint32_t *target_len) {
         const int unmated=-1, multiple=-2, processed=-3;
         vector<pair<int, const bam1_t *> >
             status(inprogress.size(), pair<int, const bam1_t *>(unmated, NULL));
-        Segments::iterator it0;
 
         // identify unambiguous and ambiguous mates
-        it0 = inprogress.begin();
         for (unsigned int i = 0; i < inprogress.size(); ++i) {
-            status[i].second = *it0;
-            Segments::iterator it1 = it0;
+            status[i].second = inprogress[i];
             for (unsigned int j = i + 1; j < inprogress.size(); ++j) {
-                ++it1;
-                if (is_mate(*it0, *it1, target_len)) {
+                if (is_mate(inprogress[i], inprogress[j], target_len)) {
                     status[i].first = status[i].first == unmated ? j : multiple;
                     status[j].first = status[j].first == unmated ? i : multiple;
                 }
             }
-            ++it0;
         }
 
         // process unambiguous and ambigous mates
@@ -191,78 +216,62 @@ public:
                 ambiguous.push_back(status[i].second);
                 status[i].first = processed;
             }
-            ++it0;
         }
 
         // remove segments that have been assigned to complete or
         // ambiguous queue
-        it0 = inprogress.begin();
-        for (unsigned int i = 0; i != status.size(); ++i) {
-            if (status[i].first == processed) {
-                it0 = inprogress.erase(it0);
-            } else {
-                ++it0;
-            }
-        }
+        unsigned int n = 0;
+        for (unsigned int i = 0; i != status.size(); ++i)
+            if (status[i].first != processed)
+                inprogress[n++] = inprogress[i];
+        inprogress.resize(n);
     }
 
-    // (BamRangeIterator only)
-    void mate_inprogress_segments(bamFile bfile, const bam_index_t * bindex,
-                                  queue<Segments> &complete,
-                                  char qname_prefix, char qname_suffix,
-                                  int32_t tid, int32_t beg, int32_t end,
-                                  uint32_t *target_len,
-                                  string trimmed_qname) {
-        bam1_t *bam = bam_init1();
-        bool touched = false;
-
-        // complete all inprogress segments, then mate
-        // add_segment calls inprogress.push_back(), so cannot iterate to end()
-        size_t size = inprogress.size();
-        for (iterator it = inprogress.begin(); size--; ++it) {
-            const bam1_t *curr = *it;
+    // (BamRangeIterator only) positions of the mates of 'inprogress'
+    // segments, where they lie outside 'tid', 'beg', 'end'
+    void mate_positions(int32_t tid, int32_t beg, int32_t end,
+                        const uint32_t *target_len,
+                        vector<pair<int32_t, int32_t> > &positions) const {
+        for (size_t i = 0; i < inprogress.size(); ++i) {
+            const bam1_t *curr = inprogress[i];
             const int32_t mtid = curr->core.mtid;
+            if (mtid < 0 || curr->core.mpos == -1)
+                continue;
             const int32_t mpos = curr->core.mpos % target_len[mtid];
-
-            if ((mpos == -1) ||
-                // mate in iterator, so would have been discovered
-                ((tid == mtid) && (beg <= mpos) && (end > mpos)))
+            // mate in iterator, so would have been discovered
+            if ((tid == mtid) && (beg <= mpos) && (end > mpos))
                 continue;
-
-            // search all records that overlap the iterator
-            bam_iter_t iter = bam_iter_query(bindex, mtid, mpos, mpos + 1L);
-            while (bam_iter_read(bfile, iter, bam) >= 0) {
-                
-                if (bam->core.pos < mpos) // iterate up to mpos
-                    continue;
-                if (bam->core.pos > mpos)
-                    break;
-
-                const char *mate_trimmed_qname =
-                    qname_trim(bam1_qname(bam), qname_prefix, qname_suffix);
-                if (is_valid(bam) && 
-                    is_template(trimmed_qname, mate_trimmed_qname, bam) &&
-                    is_mate(curr, bam, target_len)) {
-                    bool added = add_segment(bam);
-                    touched = touched || added;
-                }
-            }
-            bam_iter_destroy(iter);
+            positions.push_back(make_pair(mtid, mpos));
         }
+    }
 
-        bam_destroy1(bam);
-        if (touched)
-            mate(complete, target_len);
+    // (BamRangeIterator only) add 'bam', read at a position from
+    // mate_positions(), once for each of the first 'n' 'inprogress'
+    // segments it mates; returns true if added
+    bool add_mate(const bam1_t *bam, size_t n, const string &trimmed_qname,
+                  const uint32_t *target_len, BamPool &pool) {
+        if (!is_valid(bam) ||
+            !is_template(trimmed_qname, bam1_qname(bam), bam))
+            return false;
+        bool added = false;
+        for (size_t i = 0; i < n; ++i)
+            if (is_mate(inprogress[i], bam, target_len))
+                added = add_segment(bam, pool) || added;
+        return added;
     }
 
     // move 'ambiguous' to ambiguous_queue 
     // move 'inprogress' and 'invalid' to 'invalid_queue'
     void cleanup(queue<Segments> &ambiguous_queue,
                  queue<Segments> &invalid_queue) {
-        if (!ambiguous.empty())
+        if (!ambiguous.empty()) {
             ambiguous_queue.push(ambiguous);
-        if  (!invalid.empty())
-            inprogress.splice(inprogress.end(), invalid);
+            ambiguous.clear();
+        }
+        if  (!invalid.empty()) {
+            inprogress.insert(inprogress.end(), invalid.begin(), invalid.end());
+            invalid.clear();
+        }
         if (!inprogress.empty()) {
             invalid_queue.push(inprogress);
             inprogress.clear();
@@ -0,0 +1,142 @@
+// TemplateSpill.h:
+// Segments of templates moved out of memory, in temporary files
+// partitioned by the hash of the trimmed qname; files are named from
+// BAM_DATA's spillPrefix, in R's tempdir(). Each record is written
+// as its Template::State (or ARRIVED, for records not yet added to a
+// template), the run of equal positions it was read in, the retire
+// position of its template, then the fixed fields and data of the
+// bam1_t, as in a BAM record.
+
+#ifndef TEMPLATESPILL_H
+#define TEMPLATESPILL_H
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+#include "BamPool.h"
+
+class TemplateSpill {
+
+public:
+
+    enum { N_PARTITION = 64, ARRIVED = -1 };
+
+private:
+
+    struct Header {
+        int32_t state;
+        uint32_t run;
+        uint64_t retire;
+        bam1_core_t core;
+        int32_t data_len;
+    };
+
+    FILE *file[N_PARTITION];
+    std::string path[N_PARTITION];      // until removed; open files cannot
+                                        // be removed on Windows
+    int n_spilled, n_paired;            // partitions, in order
+
+    void remove_file(int p) {
+        if (!path[p].empty() && 0 == unlink(path[p].c_str()))
+            path[p].clear();
+    }
+
+public:
+
+    TemplateSpill() : n_spilled(0), n_paired(0) {
+        for (int i = 0; i < N_PARTITION; ++i)
+            file[i] = NULL;
+    }
+
+    ~TemplateSpill() {
+        for (int i = 0; i < N_PARTITION; ++i)
+            if (NULL != file[i])
+                close(i);
+    }
+
+    static int partition(uint64_t hash) {
+        return hash >> 58;
+    }
+
+    bool spilled(int p) const {
+        return p < n_spilled;
+    }
+
+    // spilled partitions not yet paired
+    bool pending() const {
+        return n_paired < n_spilled;
+    }
+
+    int n_unspilled() const {
+        return N_PARTITION - n_spilled;
+    }
+
+    // start writing the next partition, in a file named 'prefix'
+    // followed by its number; returns the number, or -1 if the file
+    // cannot be created
+    int spill(const char *prefix) {
+        const int p = n_spilled;
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "_%d", p);
+        path[p] = std::string(prefix) + suffix;
+        if (NULL == (file[p] = fopen(path[p].c_str(), "w+b"))) {
+            path[p].clear();
+            return -1;
+        }
+        remove_file(p);
+        n_spilled += 1;
+        return p;
+    }
+
+    // false if the record cannot be written
+    bool write(int p, int state, uint32_t run, uint64_t retire,
+               const bam1_t *bam) {
+        Header h;
+        h.state = state;
+        h.run = run;
+        h.retire = retire;
+        h.core = bam->core;
+        h.data_len = bam->data_len;
+        return fwrite(&h, sizeof(Header), 1, file[p]) == 1 &&
+            fwrite(bam->data, 1, bam->data_len, file[p]) ==
+            (size_t) bam->data_len;
+    }
+
+    // the next spilled partition to pair, rewound for reading, or -1
+    int next() {
+        if (n_paired == n_spilled)
+            return -1;
+        const int p = n_paired++;
+        rewind(file[p]);
+        return p;
+    }
+
+    // the next record of partition 'p', from 'pool', in 'bam'; returns
+    // 1, 0 at the end and -1 if the file cannot be read
+    int read(int p, int &state, uint32_t &run, uint64_t &retire,
+             BamPool &pool, bam1_t *&bam) {
+        Header h;
+        if (fread(&h, sizeof(Header), 1, file[p]) != 1)
+            return ferror(file[p]) ? -1 : 0;
+        bam = pool.get(h.data_len);
+        bam->core = h.core;
+        if (fread(bam->data, 1, h.data_len, file[p]) != (size_t) h.data_len) {
+            pool.release(bam);
+            return -1;
+        }
+        state = h.state;
+        run = h.run;
+        retire = h.retire;
+        return 1;
+    }
+
+    // partition 'p' has been paired; its file is removed
+    void close(int p) {
+        fclose(file[p]);
+        file[p] = NULL;
+        remove_file(p);
+    }
+
+};
+
+#endif
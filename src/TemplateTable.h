@@ -0,0 +1,185 @@
+// TemplateTable.h:
+// Open-addressing hash table of Templates keyed by trimmed qname.
+// Slots hold the index of an entry; entries, and the vectors of their
+// Templates, are reused after a template is erased.
+
+#ifndef TEMPLATETABLE_H
+#define TEMPLATETABLE_H
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "Template.h"
+
+class TemplateTable {
+
+    struct Entry {
+        std::string qname;
+        uint64_t hash;
+        bool live;
+        unsigned int generation;        // times the entry was erased
+        Template tmpl;
+    };
+
+    enum { EMPTY = -1, DELETED = -2 };
+
+    std::vector<Entry> entries;
+    std::vector<int> unused;            // entries available for reuse
+    std::vector<int32_t> slots;         // size a power of 2
+    size_t n_live, n_occupied;          // live; live or DELETED slots
+
+    // slot of 'qname', or the first free slot on its probe sequence
+    size_t probe(uint64_t h, const char *qname, bool &found) const {
+        const size_t mask = slots.size() - 1;
+        size_t i = h & mask, free_slot = slots.size();
+        for (;; i = (i + 1) & mask) {
+            const int32_t id = slots[i];
+            if (id == EMPTY) {
+                found = false;
+                return free_slot == slots.size() ? i : free_slot;
+            }
+            if (id == DELETED) {
+                if (free_slot == slots.size())
+                    free_slot = i;
+            } else if (entries[id].hash == h &&
+                       entries[id].qname.compare(qname) == 0) {
+                found = true;
+                return i;
+            }
+        }
+    }
+
+    void rehash(size_t size) {
+        std::vector<int32_t> old;
+        old.swap(slots);
+        slots.assign(size, EMPTY);
+        const size_t mask = size - 1;
+        for (size_t i = 0; i < old.size(); ++i) {
+            if (old[i] < 0)
+                continue;
+            size_t j = entries[old[i]].hash & mask;
+            while (slots[j] != EMPTY)
+                j = (j + 1) & mask;
+            slots[j] = old[i];
+        }
+        n_occupied = n_live;
+    }
+
+    struct by_qname {
+        const std::vector<Entry> &entries;
+        by_qname(const std::vector<Entry> &entries) : entries(entries) {}
+        bool operator()(int a, int b) const {
+            return entries[a].qname < entries[b].qname;
+        }
+    };
+
+public:
+
+    // FNV-1a
+    static uint64_t hash_qname(const char *qname) {
+        uint64_t h = 14695981039346656037ULL;
+        for (const unsigned char *s = (const unsigned char *) qname; *s; ++s)
+            h = (h ^ *s) * 1099511628211ULL;
+        return h;
+    }
+
+    TemplateTable() : slots(1024, EMPTY), n_live(0), n_occupied(0) {}
+
+    bool empty() const {
+        return n_live == 0;
+    }
+
+    // id of the template of 'qname', added if not present
+    int find_or_add(const char *qname) {
+        const uint64_t h = hash_qname(qname);
+        bool found;
+        size_t i = probe(h, qname, found);
+        if (found)
+            return slots[i];
+
+        int id;
+        if (unused.empty()) {
+            id = entries.size();
+            entries.push_back(Entry());
+            entries[id].generation = 0;
+        } else {
+            id = unused.back();
+            unused.pop_back();
+        }
+        Entry &e = entries[id];
+        e.qname.assign(qname);
+        e.hash = h;
+        e.live = true;
+        e.tmpl.clear();
+
+        if (slots[i] == EMPTY)
+            n_occupied += 1;
+        slots[i] = id;
+        n_live += 1;
+        if (2 * n_occupied > slots.size())
+            rehash(4 * n_live > slots.size() ? 2 * slots.size() :
+                   slots.size());
+        return id;
+    }
+
+    // id of the template of 'qname', or -1
+    int find(const char *qname) const {
+        bool found;
+        size_t i = probe(hash_qname(qname), qname, found);
+        return found ? slots[i] : -1;
+    }
+
+    Template &operator[](int id) {
+        return entries[id].tmpl;
+    }
+
+    const std::string &qname(int id) const {
+        return entries[id].qname;
+    }
+
+    // distinguishes the templates that have used entry 'id'
+    unsigned int generation(int id) const {
+        return entries[id].generation;
+    }
+
+    void erase(int id) {
+        Entry &e = entries[id];
+        bool found;
+        size_t i = probe(e.hash, e.qname.c_str(), found);
+        slots[i] = DELETED;
+        e.live = false;
+        e.generation += 1;
+        unused.push_back(id);
+        n_live -= 1;
+    }
+
+    uint64_t hash(int id) const {
+        return entries[id].hash;
+    }
+
+    // live ids, in qname order unless 'ordered' is false
+    std::vector<int> ids(bool ordered = true) const {
+        std::vector<int> result;
+        result.reserve(n_live);
+        for (size_t i = 0; i < entries.size(); ++i)
+            if (entries[i].live)
+                result.push_back(i);
+        if (ordered)
+            sort_by_qname(result);
+        return result;
+    }
+
+    void sort_by_qname(std::vector<int> &ids) const {
+        std::sort(ids.begin(), ids.end(), by_qname(entries));
+    }
+
+    void clear() {
+        for (size_t i = 0; i < entries.size(); ++i)
+            if (entries[i].live)
+                erase(i);
+        rehash(slots.size());
+    }
+
+};
+
+#endif
@@ -0,0 +1,144 @@
+#include "aux_index.h"
+
+#define TAG_KEY(s) ((uint16_t) (((uint8_t) (s)[0]) << 8 | (uint8_t) (s)[1]))
+
+static int _aux_index_slot(const AUX_INDEX idx, uint16_t key)
+{
+    /* Fibonacci hashing of the two tag characters */
+    int h = ((uint32_t) key * 40503u >> 4) & idx->mask;
+    while (idx->key[h] != 0) {
+        if (idx->key[h] == key)
+            return h;
+        h = (h + 1) & idx->mask;
+    }
+    return h;
+}
+
+AUX_INDEX _aux_index_new(const char **tagnames, int n)
+{
+    for (int i = 0; i < n; ++i)     /* before allocating */
+        if (strlen(tagnames[i]) != 2)
+            Rf_error("tag '%s' must be two letters", tagnames[i]);
+    AUX_INDEX idx = Calloc(1, _AUX_INDEX);
+    int size = 16;
+    while (size < 2 * n)
+        size <<= 1;
+    idx->n = n;
+    idx->mask = size - 1;
+    idx->key = Calloc(size, uint16_t);
+    idx->slot = Calloc(size, int);
+    idx->map = Calloc(n > 0 ? n : 1, int);
+    idx->found = Calloc(n > 0 ? n : 1, uint8_t *);
+    for (int i = 0; i < n; ++i) {
+        const uint16_t key = TAG_KEY(tagnames[i]);
+        const int h = _aux_index_slot(idx, key);
+        if (idx->key[h] == 0) {
+            idx->key[h] = key;
+            idx->slot[h] = idx->n_unique++;
+        }
+        idx->map[i] = idx->slot[h];
+    }
+    return idx;
+}
+
+void _aux_index_free(AUX_INDEX idx)
+{
+    if (idx == NULL)
+        return;
+    Free(idx->key);
+    Free(idx->slot);
+    Free(idx->map);
+    Free(idx->found);
+    Free(idx);
+}
+
+AUX_INDEX _aux_index_copy(AUX_INDEX idx)
+{
+    if (idx == NULL)
+        return NULL;
+    const int size = idx->mask + 1, n = idx->n > 0 ? idx->n : 1;
+    AUX_INDEX copy = Calloc(1, _AUX_INDEX);
+    *copy = *idx;
+    copy->key = Calloc(size, uint16_t);
+    memcpy(copy->key, idx->key, size * sizeof(uint16_t));
+    copy->slot = Calloc(size, int);
+    memcpy(copy->slot, idx->slot, size * sizeof(int));
+    copy->map = Calloc(n, int);
+    memcpy(copy->map, idx->map, n * sizeof(int));
+    copy->found = Calloc(n, uint8_t *);
+    return copy;
+}
+
+int _aux_array_elt_size(char subtype)
+{
+    switch (subtype) {
+    case 'c': case 'C':
+        return 1;
+    case 's': case 'S':
+        return 2;
+    case 'i': case 'I': case 'f':
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+int _aux_value_size(const uint8_t *type, const uint8_t *end)
+{
+    const uint8_t *s = type + 1;
+    int size, elt_size;
+    int32_t n;
+
+    switch (*type) {
+    case 'A': case 'c': case 'C':
+        size = 1;
+        break;
+    case 's': case 'S':
+        size = 2;
+        break;
+    case 'i': case 'I': case 'f':
+        size = 4;
+        break;
+    case 'd':
+        size = 8;
+        break;
+    case 'Z': case 'H':
+        size = 0;
+        while (s + size < end && s[size] != '\0')
+            ++size;
+        if (s + size == end)
+            return -1;
+        size += 1;
+        break;
+    case 'B':
+        if (end - s < 5 || (elt_size = _aux_array_elt_size(s[0])) == 0)
+            return -1;
+        memcpy(&n, s + 1, 4);
+        if (n < 0 || (end - s - 5) / elt_size < n)
+            return -1;
+        size = 5 + n * elt_size;
+        break;
+    default:
+        return -1;
+    }
+    return end - s < size ? -1 : size;
+}
+
+int _aux_index_find(AUX_INDEX idx, const bam1_t *bam)
+{
+    const uint8_t *s = bam1_aux(bam), *end = bam->data + bam->data_len;
+    int nfound = 0, size;
+
+    memset(idx->found, 0, idx->n_unique * sizeof(uint8_t *));
+    while (nfound < idx->n_unique && end - s >= 3) {
+        const int h = _aux_index_slot(idx, TAG_KEY(s));
+        if ((size = _aux_value_size(s + 2, end)) < 0)
+            break;              /* malformed */
+        if (idx->key[h] != 0 && idx->found[idx->slot[h]] == NULL) {
+            idx->found[idx->slot[h]] = (uint8_t *) s + 2;
+            nfound += 1;
+        }
+        s += 3 + size;
+    }
+    return nfound;
+}
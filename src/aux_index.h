@@ -0,0 +1,37 @@
+#ifndef AUX_INDEX_H
+#define AUX_INDEX_H
+
+#include "samtools/sam.h"
+#include <Rdefines.h>
+
+/* requested aux tags, located in one pass over a record's aux data */
+
+typedef struct {
+    int n, n_unique;
+    int *map;                   /* requested tag -> unique tag */
+    int mask;
+    uint16_t *key;              /* open-addressed table of unique tags */
+    int *slot;
+    uint8_t **found;            /* unique tag -> type byte, or NULL */
+} _AUX_INDEX, *AUX_INDEX;
+
+AUX_INDEX _aux_index_new(const char **tagnames, int n);
+void _aux_index_free(AUX_INDEX idx);
+
+/* a copy with its own 'found', e.g., for another thread */
+AUX_INDEX _aux_index_copy(AUX_INDEX idx);
+
+/* fill idx->found for 'bam'; return the number of unique tags found */
+int _aux_index_find(AUX_INDEX idx, const bam1_t *bam);
+
+/* as bam_aux_get(), for the i-th requested tag after _aux_index_find() */
+#define _aux_index_get(idx, i) ((idx)->found[(idx)->map[(i)]])
+
+/* size in bytes of the value following the type byte 'type', or -1
+   if it does not end before 'end' */
+int _aux_value_size(const uint8_t *type, const uint8_t *end);
+
+/* 'B' array subtype size in bytes, 0 if unknown */
+int _aux_array_elt_size(char subtype);
+
+#endif /* AUX_INDEX_H */
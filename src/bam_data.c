@@ -1,3 +1,4 @@
+#include <limits.h>
 #include "samtools/khash.h"
 #include "samtools/sam.h"
 #include "bamfile.h"
@@ -7,16 +8,13 @@
 
 #define BAM_PARSE_STATUS_OK 0
 
-static const int BAM_INIT_SIZE = 1048576;
-
 enum { CIGAR_SIMPLE = 1 };
 
 /* _BAM_DATA */
 
-static BAM_DATA _Calloc_BAM_DATA(int blocksize, int cigar_buf_sz)
+static BAM_DATA _Calloc_BAM_DATA(int cigar_buf_sz)
 {
     BAM_DATA bd = Calloc(1, _BAM_DATA);
-    bd->BLOCKSIZE = blocksize;
     bd->cigar_buf_sz = cigar_buf_sz;
     bd->cigar_buf = Calloc(bd->cigar_buf_sz, char);
     return bd;
@@ -24,14 +22,16 @@ static BAM_DATA _Calloc_BAM_DATA(int blocksize, int cigar_buf_sz)
 
 BAM_DATA
 _init_BAM_DATA(SEXP ext, SEXP space, SEXP flag, SEXP isSimpleCigar,
-               SEXP tagFilter, SEXP mapqFilter, int reverseComplement,
+               SEXP tagFilter, SEXP mapqFilter, SEXP filterExpr,
+               int reverseComplement,
                int yieldSize, int obeyQname, int asMates,
                char qnamePrefixEnd, char qnameSuffixStart, void *extra)
 {
     int nrange = R_NilValue == space ? 1 : LENGTH(VECTOR_ELT(space, 0));
-    BAM_DATA bd =
-        _Calloc_BAM_DATA(1 == nrange ?
-                         5 * BAM_INIT_SIZE : BAM_INIT_SIZE, 32768);
+    /* validated first, as errors do not return */
+    _tagFilter_check(tagFilter);
+    FILTER_EXPR filterexpr = _filter_expr_new(filterExpr);
+    BAM_DATA bd = _Calloc_BAM_DATA(32768);
     bd->parse_status = BAM_PARSE_STATUS_OK;
     bd->bfile = BAMFILE(ext);
     bd->irange = bd->bfile->irange0;
@@ -43,6 +43,7 @@ _init_BAM_DATA(SEXP ext, SEXP space, SEXP flag, SEXP isSimpleCigar,
     bd->tagfilter = _tagFilter_as_C_types(tagFilter);
     int mapqfilter = INTEGER(mapqFilter)[0];
     bd->mapqfilter = mapqfilter == NA_INTEGER ? 0 : mapqfilter; /* uint32_t */
+    bd->filterexpr = filterexpr;
     bd->reverseComplement = reverseComplement;
     bd->yieldSize = yieldSize;
     bd->obeyQname = obeyQname;
@@ -56,10 +57,54 @@ _init_BAM_DATA(SEXP ext, SEXP space, SEXP flag, SEXP isSimpleCigar,
 void _Free_BAM_DATA(BAM_DATA bd)
 {
     _Free_C_TAGFILTER(bd->tagfilter);
+    _filter_expr_free(bd->filterexpr);
+    free(bd->spillPrefix);
     Free(bd->cigar_buf);
     Free(bd);
 }
 
+/* the record filters of 'bd', for use on another thread; tag filters
+   report errors through R, and are not copied */
+BAM_DATA _filters_BAM_DATA(BAM_DATA bd)
+{
+    BAM_DATA filters = _Calloc_BAM_DATA(1);
+    filters->bfile = bd->bfile;
+    filters->keep_flag[0] = bd->keep_flag[0];
+    filters->keep_flag[1] = bd->keep_flag[1];
+    filters->cigar_flag = bd->cigar_flag;
+    filters->mapqfilter = bd->mapqfilter;
+    filters->filterexpr = _filter_expr_copy(bd->filterexpr);
+    filters->yieldSize = bd->yieldSize;
+    filters->core_only = bd->core_only;
+    return filters;
+}
+
+/* can whole-file records be read without their variable-length data
+   (qname, cigar, seq, qual, tags)? 'template_list' is the scanBam
+   'what' template, or R_NilValue when no fields are parsed */
+int _core_only_BAM_DATA(BAM_DATA bd, SEXP space, SEXP template_list)
+{
+    if (R_NilValue != space || bd->asMates || NULL != bd->tagfilter ||
+        CIGAR_SIMPLE == bd->cigar_flag ||
+        (NULL != bd->filterexpr && bd->filterexpr->needs_data) ||
+        (bd->obeyQname && NA_INTEGER != bd->yieldSize))
+        return 0;
+    if (R_NilValue == template_list)
+        return 1;
+    for (int i = 0; i < LENGTH(template_list); ++i) {
+        if (R_NilValue == VECTOR_ELT(template_list, i))
+            continue;
+        switch (i) {
+        case FLAG_IDX: case RNAME_IDX: case STRAND_IDX: case POS_IDX:
+        case MAPQ_IDX: case MRNM_IDX: case MPOS_IDX: case ISIZE_IDX:
+            break;
+        default:
+            return 0;
+        }
+    }
+    return 1;
+}
+
 
 static void _grow_BAM_DATA_cigar(BAM_DATA bd)
 {
@@ -88,37 +133,6 @@ int _count1_BAM_DATA(const bam1_t * bam, BAM_DATA bd)
 
 /* parse helpers */
 
-static char *_bamseq(const bam1_t * bam, BAM_DATA bd)
-{
-    static const char key[] = {
-        '-', 'A', 'C', 'M', 'G', 'R', 'S', 'V',
-        'T', 'W', 'Y', 'H', 'K', 'D', 'B', 'N'
-    };
-
-    const uint32_t len = bam->core.l_qseq;
-    const unsigned char *seq = bam1_seq(bam);
-    char *s = Calloc(len + 1, char);
-    for (uint32_t i = 0; i < len; ++i)
-        s[i] = key[bam1_seqi(seq, i)];
-    if (bd->reverseComplement && (bam1_strand(bam) == 1))
-        _reverseComplement(s, len);
-    s[len] = '\0';
-    return s;
-}
-
-static char *_bamqual(const bam1_t * bam, BAM_DATA bd)
-{
-    const uint32_t len = bam->core.l_qseq;
-    const unsigned char *bamq = bam1_qual(bam);
-    char *s = Calloc(len + 1, char);
-    for (uint32_t i = 0; i < len; ++i)
-        s[i] = bamq[i] + 33;
-    if (bd->reverseComplement && (bam1_strand(bam) == 1))
-        _reverse(s, len);
-    s[len] = '\0';
-    return s;
-}
-
 static const char *_map(khash_t(str) * h, const char *s)
 {
     khiter_t k = kh_get(str, h, s);
@@ -149,65 +163,89 @@ static int _bamcigar(const uint32_t * cigar, const uint32_t n_cigar, char *buf,
     return buf_sz;
 }
 
-static void _tag_type_check(const char *tagname, SEXP tag, SEXPTYPE is)
+static void _tag_type_check(const char *tagname, SEXPTYPE was,
+                            SEXPTYPE is)
 {
-    SEXPTYPE was = TYPEOF(tag);
     if (was == is)
         return;
     error("tag '%s' type is inconsistent; was '%s', is '%s'",
           tagname, Rf_type2char(was), Rf_type2char(is));
 }
 
+/* bytes of a 'B' array value, as encoded */
+static int _bamtag_array_size(const uint8_t *aux)
+{
+    int32_t n;
+    int size;
+
+    memcpy(&n, aux + 2, 4);
+    switch (aux[1]) {
+    case 'c': case 'C': size = 1; break;
+    case 's': case 'S': size = 2; break;
+    case 'i': case 'I': case 'f': size = 4; break;
+    default:
+        error("unknown tag array type '%c'", aux[1]);
+    }
+    return 6 + n * size;
+}
+
 static void _bamtags(const bam1_t * bam, BAM_DATA bd, SEXP tags)
 {
     SCAN_BAM_DATA sbd = (SCAN_BAM_DATA) bd->extra;
-    static char *buf_A;
     int idx = sbd->icnt;
     SEXP nms = GET_ATTR(tags, R_NamesSymbol);
+
+    if (NULL == sbd->tagindex) {
+        const char **tagnames =
+            (const char **) R_alloc(LENGTH(nms), sizeof(const char *));
+        for (int i = 0; i < LENGTH(nms); ++i)
+            tagnames[i] = CHAR(STRING_ELT(nms, i));
+        sbd->tagindex = _aux_index_new(tagnames, LENGTH(nms));
+    }
+    if (0 == _aux_index_find(sbd->tagindex, bam))
+        return;
+    _TAG_COLUMN *cols = _tags_SCAN_BAM_DATA(sbd, LENGTH(nms));
+
     for (int i = 0; i < LENGTH(nms); ++i) {
         const char *tagname = CHAR(STRING_ELT(nms, i));
-        uint8_t *aux = bam_aux_get(bam, tagname);
+        uint8_t *aux = _aux_index_get(sbd->tagindex, i);
         if (0 == aux)
             continue;           /* no matching tag found */
-        SEXP tag = VECTOR_ELT(tags, i);
-        if (R_NilValue == tag) {	/* allocate */
-            int n = sbd->ncnt;
-            switch (aux[0]) {
-            case 'c':
-            case 'C':
-            case 'i':
-            case 'I':
-            case 's':
-            case 'S':
-                tag = NEW_INTEGER(n);
-                for (int j = 0; j < n; ++j)
-                    INTEGER(tag)[j] = NA_INTEGER;
-                break;
-            case 'd':
-            case 'f':
-                tag = NEW_NUMERIC(n);
-                for (int j = 0; j < n; ++j)
-                    REAL(tag)[j] = NA_REAL;
-                break;
-            case 'A':
-            case 'Z':
-                tag = NEW_CHARACTER(n);
-                for (int j = 0; j < n; ++j)
-                    SET_STRING_ELT(tag, j, NA_STRING);
-                if ('A' == aux[0]) {
-                    buf_A = R_alloc(2, sizeof(char));
-                    buf_A[1] = '\0';
-                }
-                break;
-            case 'H':
-                tag = NEW_RAW(n);
-                break;
-            default:
-                error("unknown tag type '%c'", aux[0]);
-                break;
-            }
-            SET_VECTOR_ELT(tags, i, tag);
+        _TAG_COLUMN *col = &cols[i];
+        SEXPTYPE type;
+        switch (aux[0]) {
+        case 'c':
+        case 'C':
+        case 'i':
+        case 'I':
+        case 's':
+        case 'S':
+            type = INTSXP;
+            break;
+        case 'd':
+        case 'f':
+            type = REALSXP;
+            break;
+        case 'A':
+        case 'Z':
+            type = STRSXP;
+            break;
+        case 'H':
+            type = RAWSXP;
+            break;
+        case 'B':
+            type = VECSXP;
+            break;
+        default:
+            error("unknown tag type '%c'", aux[0]);
+            break;
         }
+        if (NILSXP == col->type)  /* first seen; earlier records NA */
+            _init_TAG_COLUMN(col, type);
+        _tag_type_check(tagname, col->type, type);
+
+        char *buf;
+        int len;
         switch (aux[0]) {
         case 'c':
         case 'C':
@@ -215,29 +253,37 @@ static void _bamtags(const bam1_t * bam, BAM_DATA bd, SEXP tags)
         case 'S':
         case 'i':
         case 'I':
-            _tag_type_check(tagname, tag, INTSXP);
-            INTEGER(tag)[idx] = bam_aux2i(aux);
+            _grow_CHUNKS(&col->values, idx + 1);
+            CHUNKS_ELT(&col->values, int, idx) = bam_aux2i(aux);
             break;
         case 'f':
-            _tag_type_check(tagname, tag, REALSXP);
-            REAL(tag)[idx] = (double) bam_aux2f(aux);
+            _grow_CHUNKS(&col->values, idx + 1);
+            CHUNKS_ELT(&col->values, double, idx) = bam_aux2f(aux);
             break;
         case 'd':
-            _tag_type_check(tagname, tag, REALSXP);
-            REAL(tag)[idx] = bam_aux2d(aux);
+            _grow_CHUNKS(&col->values, idx + 1);
+            CHUNKS_ELT(&col->values, double, idx) = bam_aux2d(aux);
             break;
         case 'A':
-            _tag_type_check(tagname, tag, STRSXP);
-            sprintf(buf_A, "%c", bam_aux2A(aux));
-            SET_STRING_ELT(tag, idx, mkChar(buf_A));
+            _grow_CHUNKS(&col->bytes.width, idx + 1);
+            buf = _reserve_CHAR_ARENA(&col->bytes, idx, 1);
+            buf[0] = bam_aux2A(aux);
             break;
         case 'Z':
-            _tag_type_check(tagname, tag, STRSXP);
-            SET_STRING_ELT(tag, idx, mkChar(bam_aux2Z(aux)));
+            len = strlen(bam_aux2Z(aux));
+            _grow_CHUNKS(&col->bytes.width, idx + 1);
+            buf = _reserve_CHAR_ARENA(&col->bytes, idx, len);
+            memcpy(buf, bam_aux2Z(aux), len);
             break;
         case 'H':              /* FIXME: one byte or many? */
-            _tag_type_check(tagname, tag, RAWSXP);
-            RAW(tag)[idx] = aux[1];
+            _grow_CHUNKS(&col->values, idx + 1);
+            CHUNKS_ELT(&col->values, Rbyte, idx) = aux[1];
+            break;
+        case 'B':
+            len = _bamtag_array_size(aux);
+            _grow_CHUNKS(&col->bytes.width, idx + 1);
+            buf = _reserve_CHAR_ARENA(&col->bytes, idx, len);
+            memcpy(buf, aux, len);
             break;
         default:
             error("unknown tag type '%c'", aux[0]);
@@ -289,6 +335,10 @@ int _filter1_BAM_DATA(const bam1_t * bam, BAM_DATA bd)
               (n_cigar == 1 && ((cigar[0] & BAM_CIGAR_MASK) == 0))))
             return 0;
     }
+
+    /* filterExpr */
+    if (bd->filterexpr != NULL && !_filter_expr_eval(bd->filterexpr, bam))
+        return 0;
     return 1;
 }
 
@@ -304,7 +354,7 @@ int _parse1_BAM_DATA(const bam1_t *bam, BAM_DATA bd)
 {
     SCAN_BAM_DATA sbd = (SCAN_BAM_DATA) bd->extra;
     SEXP r = _get_or_grow_SCAN_BAM_DATA(bd, -1), s;
-    int idx = sbd->icnt;
+    int idx = sbd->icnt, len;
     char *buf;
 
     for (int i = 0; i < LENGTH(r); ++i) {
@@ -312,73 +362,77 @@ int _parse1_BAM_DATA(const bam1_t *bam, BAM_DATA bd)
             continue;
         switch (i) {
         case QNAME_IDX:
-            buf = Calloc(strlen(bam1_qname(bam)) + 1, char);
-            if (!buf)
-                Rf_error("_parse1: failed to allocate memory");
-            strcpy(buf, bam1_qname(bam));
-            sbd->qname[idx] = buf;
+            len = strlen(bam1_qname(bam));
+            buf = _reserve_CHAR_ARENA(&sbd->qname, idx, len);
+            memcpy(buf, bam1_qname(bam), len);
             break;
         case FLAG_IDX:
-            sbd->flag[idx] = bam->core.flag;
+            CHUNKS_ELT(&sbd->flag, int, idx) = bam->core.flag;
             break;
         case RNAME_IDX:
-            sbd->rname[idx] =
+            CHUNKS_ELT(&sbd->rname, int, idx) =
                 bam->core.tid < 0 ? NA_INTEGER : bam->core.tid + 1;
             break;
         case STRAND_IDX:
-            sbd->strand[idx] = bam->core.flag & BAM_FUNMAP ?
+            CHUNKS_ELT(&sbd->strand, int, idx) = bam->core.flag & BAM_FUNMAP ?
                 NA_INTEGER : (bam1_strand(bam) + 1);
             break;
         case POS_IDX:
-            sbd->pos[idx] = bam->core.flag & BAM_FUNMAP ?
+            CHUNKS_ELT(&sbd->pos, int, idx) = bam->core.flag & BAM_FUNMAP ?
                 NA_INTEGER : bam->core.pos + 1;
             break;
         case QWIDTH_IDX:
-            sbd->qwidth[idx] = bam->core.flag & BAM_FUNMAP ?
+            CHUNKS_ELT(&sbd->qwidth, int, idx) = bam->core.flag & BAM_FUNMAP ?
                 NA_INTEGER : bam_cigar2qlen(&bam->core, bam1_cigar(bam));
             break;
         case MAPQ_IDX:
             if ((bam->core.flag & BAM_FUNMAP))
-                sbd->mapq[idx] = NA_INTEGER;
-            else sbd->mapq[idx] = bam->core.qual;
+                CHUNKS_ELT(&sbd->mapq, int, idx) = NA_INTEGER;
+            else CHUNKS_ELT(&sbd->mapq, int, idx) = bam->core.qual;
             break;
         case CIGAR_IDX:
             if (bam->core.flag & BAM_FUNMAP)
-                sbd->cigar[idx] = NULL;
+                CHUNKS_ELT(&sbd->cigar, const char *, idx) = NULL;
             else {
                 while (_bamcigar(bam1_cigar(bam), bam->core.n_cigar,
                               bd->cigar_buf, bd->cigar_buf_sz) < 0)
                     _grow_BAM_DATA_cigar(bd);
-                sbd->cigar[idx] = _map(sbd->cigarhash, bd->cigar_buf);
+                CHUNKS_ELT(&sbd->cigar, const char *, idx) = _map(sbd->cigarhash, bd->cigar_buf);
             }
             break;
         case MRNM_IDX:
-            sbd->mrnm[idx] = bam->core.mtid < 0 ?
+            CHUNKS_ELT(&sbd->mrnm, int, idx) = bam->core.mtid < 0 ?
                 NA_INTEGER : bam->core.mtid + 1;
             break;
         case MPOS_IDX:
-            sbd->mpos[idx] = bam->core.flag & BAM_FMUNMAP ?
+            CHUNKS_ELT(&sbd->mpos, int, idx) = bam->core.flag & BAM_FMUNMAP ?
                 NA_INTEGER : bam->core.mpos + 1;
             break;
         case ISIZE_IDX:
-            sbd->isize[idx] =
+            CHUNKS_ELT(&sbd->isize, int, idx) =
                 bam->core.flag & (BAM_FUNMAP | BAM_FMUNMAP) ?
                 NA_INTEGER : bam->core.isize;
             break;
         case SEQ_IDX:
-            sbd->seq[idx] = _bamseq(bam, bd);
+            len = bam->core.l_qseq;
+            buf = _reserve_CHAR_ARENA(&sbd->seq, idx, len);
+            _bam_seq_decode(buf, bam1_seq(bam), len,
+                            bd->reverseComplement && bam1_strand(bam));
             break;
         case QUAL_IDX:
-            sbd->qual[idx] = _bamqual(bam, bd);
+            len = bam->core.l_qseq;
+            buf = _reserve_CHAR_ARENA(&sbd->qual, idx, len);
+            _bam_qual_decode(buf, bam1_qual(bam), len,
+                             bd->reverseComplement && bam1_strand(bam));
             break;
         case TAG_IDX:
             _bamtags(bam, bd, s);
             break;
         case PARTITION_IDX:
-            sbd->partition[idx] = sbd->partition_id;
+            CHUNKS_ELT(&sbd->partition, int, idx) = sbd->partition_id;
             break;
         case MATES_IDX:
-            sbd->mates[idx] = sbd->mates_flag;
+            CHUNKS_ELT(&sbd->mates, int, idx) = sbd->mates_flag;
             break;
         default:
             Rf_error("[Rsamtools internal]: unhandled _parse1");
@@ -4,6 +4,7 @@
 #include "Rdefines.h"
 #include "bamfile.h"
 #include "tagfilter.h"
+#include "filter_expr.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,7 +14,6 @@ typedef char * (*bam_qname_f)(const bam1_t *bam, char qname_prefix,
                               char qname_suffix);
 
 typedef struct {
-    int BLOCKSIZE;              /* size to grow vectors */
     char *cigar_buf;            /* string representation of CIGAR */
     uint32_t cigar_buf_sz;
 
@@ -25,6 +25,14 @@ typedef struct {
     char qnamePrefixEnd, qnameSuffixStart;
     C_TAGFILTER tagfilter;
     uint32_t mapqfilter;
+    FILTER_EXPR filterexpr;
+    int core_only;              /* records need only their fixed fields */
+    double maxMateMemory;       /* MB held by asMates before spilling to
+                                   disk; 0: no limit */
+    char *spillPrefix;          /* stem of spill file names, from
+                                   R_tmpnam2(); NULL without a limit */
+    const char *failure;        /* why reading stopped, when not a
+                                   record; a static string */
 
     void *extra;
 } _BAM_DATA, *BAM_DATA;
@@ -36,11 +44,13 @@ enum {
 };
 
 BAM_DATA _init_BAM_DATA(SEXP ext, SEXP space, SEXP flag, SEXP isSimpleCigar,
-                        SEXP tagFilter, SEXP mapqFilter,
+                        SEXP tagFilter, SEXP mapqFilter, SEXP filterExpr,
                         int reverseComplement, int yieldSize,
                         int obeyQname, int asMates, char qnamePrefixEnd, 
                         char qnameSuffixStart, void *extra);
 void _Free_BAM_DATA(BAM_DATA bd);
+BAM_DATA _filters_BAM_DATA(BAM_DATA bd);
+int _core_only_BAM_DATA(BAM_DATA bd, SEXP space, SEXP template_list);
 BAM_FILE _bam_file_BAM_DATA(BAM_DATA bd);
 int _count1_BAM_DATA(const bam1_t *bam, BAM_DATA bd);
 int _filter_and_parse1_BAM_DATA(const bam1_t *bam, BAM_DATA bd);
@@ -1,6 +1,7 @@
 #include <Rdefines.h>
 #include "BamRangeIterator.h"
 #include "BamFileIterator.h"
+#include "BamQnameIterator.h"
 #include "bam_mate_iter.h"
 
 #ifdef __cplusplus
@@ -56,7 +57,18 @@ void bam_mates_destroy(bam_mates_t *mates)
 int bam_mate_read(bamFile fb, bam_mate_iter_t iter, bam_mates_t *mates)
 {
     iter->b_iter->yield(fb, mates);
-    return mates->n;
+    return NULL == iter->b_iter->failed() ? mates->n : -1;
+}
+
+void bam_mate_iter_release(bam_mate_iter_t iter, bam_mates_t *mates)
+{
+    if (NULL != iter)
+        iter->b_iter->release(mates);
+}
+
+const char *bam_mate_iter_error(bam_mate_iter_t iter)
+{
+    return iter->b_iter->failed();
 }
 
 // BamRangeIterator methods
@@ -84,12 +96,16 @@ int bam_fetch_mate(bamFile bf, const bam_index_t *idx, int tid, int beg,
     return n_rec;
 }
 
-// BamFileIterator methods
+// BamFileIterator and BamQnameIterator methods
 bam_mate_iter_t bam_mate_file_iter_new(bamFile bfile,
-                                       const bam_index_t *bindex)
+                                       const bam_index_t *bindex,
+                                       bool by_qname)
 {
     bam_mate_iter_t iter = Calloc(1, struct _bam_mate_iter_t);
-    iter->b_iter = new BamFileIterator(bfile, bindex);
+    if (by_qname)
+        iter->b_iter = new BamQnameIterator(bfile, bindex);
+    else
+        iter->b_iter = new BamFileIterator(bfile, bindex);
     return iter;
 }
 
@@ -100,8 +116,10 @@ int samread_mate(bamFile bfile, const bam_index_t *bindex,
     BAM_DATA bd = (BAM_DATA) data;
     bam_mate_iter_t iter;
     int status;
+    // segments of a template are adjacent when sorted by qname
     if (NULL == *iter_p)
-        *iter_p = bam_mate_file_iter_new(bfile, bindex);
+        *iter_p = bam_mate_file_iter_new(bfile, bindex, bd->obeyQname ||
+            BamIterator::sorted_by(bd->bfile->file->header, "queryname"));
     iter = *iter_p;
     iter->b_iter->set_bam_data(bd);
     iter->b_iter->iter_done = false;
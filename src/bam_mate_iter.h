@@ -31,6 +31,10 @@ int samread_mate(bamFile fb, const bam_index_t *bindex,
                  bam_mate_iter_t *iter_p, bam_mates_t *mates,
                  void *data);
 void bam_mate_iter_destroy(bam_mate_iter_t iter);
+/* return the records of the last read to the iterator */
+void bam_mate_iter_release(bam_mate_iter_t iter, bam_mates_t *mates);
+/* why the last read returned -1 */
+const char *bam_mate_iter_error(bam_mate_iter_t iter);
 
 #ifdef __cplusplus
 }
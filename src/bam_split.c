@@ -0,0 +1,166 @@
+#include <string.h>
+#include <sys/stat.h>
+#include "bam_split.h"
+
+/* compressed bytes per slice, bounding the records buffered */
+static const int64_t SPLIT_SLICE_SIZE = 8 << 20;
+static const int SPLIT_BATCHSIZE = 256;
+
+/* read the records of 'slice' that pass the filters */
+static int _bam_split_slice(_BAM_SPLIT_WORKER *w, _BAM_SLICE *slice,
+                            bam_batch_t *buf)
+{
+    BAM_DATA filters = w->filters;
+    int (*read_batch)(bamFile, bam_batch_t *, int) =
+        filters->core_only ? bam_read_batch_core_only : bam_read_batch;
+    uint64_t offset = slice->beg;   /* start of the next record */
+
+    bam_seek(w->fp, slice->beg, SEEK_SET);
+    while (read_batch(w->fp, buf, SPLIT_BATCHSIZE) > 0) {
+        for (int i = 0; i < buf->n; ++i) {
+            if (offset >= slice->end)
+                return 0;
+            if (_filter1_BAM_DATA(&buf->rec[i], filters))
+                bam_batch_push(slice->batch, &buf->rec[i]);
+            offset = buf->voffset[i];
+        }
+        if (buf->ret < 0)
+            break;
+    }
+    return 1;                   /* end-of-file */
+}
+
+static void *_bam_split_read(void *data)
+{
+    _BAM_SPLIT_WORKER *w = (_BAM_SPLIT_WORKER *) data;
+    BAM_SPLIT split = w->split;
+    bam_batch_t *buf = bam_batch_init();
+
+    pthread_mutex_lock(&split->lock);
+    for (;;) {
+        while (!split->stop && split->next < split->n &&
+               split->next >= split->consumed + split->window)
+            pthread_cond_wait(&split->space, &split->lock);
+        if (split->stop || split->next >= split->n)
+            break;
+        _BAM_SLICE *slice = &split->slice[split->next++];
+        pthread_mutex_unlock(&split->lock);
+
+        slice->batch = bam_batch_init();
+        int eof = _bam_split_slice(w, slice, buf);
+
+        pthread_mutex_lock(&split->lock);
+        if (eof)
+            split->eof = bam_tell(w->fp);
+        slice->done = 1;
+        pthread_cond_broadcast(&split->ready);
+    }
+    pthread_mutex_unlock(&split->lock);
+
+    bam_batch_destroy(buf);
+    return NULL;
+}
+
+BAM_SPLIT _bam_split_new(BAM_DATA bd)
+{
+    BAM_FILE bfile = _bam_file_BAM_DATA(bd);
+    const char *path = bfile->path;
+    struct stat st;
+
+    /* remote files report errors through R; keep them on this thread */
+    if (bfile->n_threads < 2 || NULL == bfile->index || NULL == path ||
+        strstr(path, "ftp://") == path || strstr(path, "http://") == path ||
+        0 != stat(path, &st))
+        return NULL;
+
+    int n = st.st_size / SPLIT_SLICE_SIZE;
+    if (n < 4 * bfile->n_threads)
+        n = 4 * bfile->n_threads;
+    uint64_t *offset = Calloc(n, uint64_t);
+    int n_split = bam_index_split(bfile->index, bfile->pos0, n, offset);
+    if (0 == n_split) {
+        Free(offset);
+        return NULL;
+    }
+
+    BAM_SPLIT split = Calloc(1, struct _BAM_SPLIT);
+    split->n = n_split + 1;
+    split->slice = Calloc(split->n, _BAM_SLICE);
+    for (int i = 0; i < split->n; ++i) {
+        split->slice[i].beg = 0 == i ? bfile->pos0 : offset[i - 1];
+        split->slice[i].end = i < n_split ? offset[i] : UINT64_MAX;
+    }
+    Free(offset);
+    split->window = 2 * bfile->n_threads;
+    pthread_mutex_init(&split->lock, NULL);
+    pthread_cond_init(&split->ready, NULL);
+    pthread_cond_init(&split->space, NULL);
+
+    /* handles and filters are created here, so workers make no R API
+       calls */
+    split->worker = Calloc(bfile->n_threads, _BAM_SPLIT_WORKER);
+    for (int i = 0; i < bfile->n_threads; ++i) {
+        _BAM_SPLIT_WORKER *w = &split->worker[i];
+        w->split = split;
+        if (NULL == (w->fp = bam_open(path, "r")))
+            break;
+        w->filters = _filters_BAM_DATA(bd);
+        if (0 != pthread_create(&w->thread, NULL, _bam_split_read, w)) {
+            bam_close(w->fp);
+            _Free_BAM_DATA(w->filters);
+            break;
+        }
+        split->n_threads += 1;
+    }
+    if (0 == split->n_threads) {
+        _bam_split_free(split);
+        return NULL;
+    }
+
+    return split;
+}
+
+bam_batch_t *_bam_split_next(BAM_SPLIT split)
+{
+    pthread_mutex_lock(&split->lock);
+    if (split->consumed > 0) {  /* the caller is done with the last */
+        _BAM_SLICE *last = &split->slice[split->consumed - 1];
+        bam_batch_destroy(last->batch);
+        last->batch = NULL;
+    }
+    if (split->consumed == split->n) {
+        pthread_mutex_unlock(&split->lock);
+        return NULL;
+    }
+    _BAM_SLICE *slice = &split->slice[split->consumed];
+    while (!slice->done)
+        pthread_cond_wait(&split->ready, &split->lock);
+    split->consumed += 1;
+    pthread_cond_broadcast(&split->space);
+    pthread_mutex_unlock(&split->lock);
+
+    return slice->batch;
+}
+
+void _bam_split_free(BAM_SPLIT split)
+{
+    if (NULL == split)
+        return;
+    pthread_mutex_lock(&split->lock);
+    split->stop = 1;
+    pthread_cond_broadcast(&split->space);
+    pthread_mutex_unlock(&split->lock);
+    for (int i = 0; i < split->n_threads; ++i) {
+        pthread_join(split->worker[i].thread, NULL);
+        bam_close(split->worker[i].fp);
+        _Free_BAM_DATA(split->worker[i].filters);
+    }
+    for (int i = 0; i < split->n; ++i)
+        bam_batch_destroy(split->slice[i].batch);
+    pthread_mutex_destroy(&split->lock);
+    pthread_cond_destroy(&split->ready);
+    pthread_cond_destroy(&split->space);
+    Free(split->worker);
+    Free(split->slice);
+    Free(split);
+}
@@ -0,0 +1,56 @@
+#ifndef BAM_SPLIT_H
+#define BAM_SPLIT_H
+
+#include <pthread.h>
+#include "bam_data.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Whole-file reads of an indexed BAM file, split into slices between
+   record offsets from the index. nThreads threads, each on its own
+   handle, read and filter slices into native record batches, at most
+   'window' slices ahead of the caller; slices are returned in file
+   order, and the caller parses them. */
+
+typedef struct {
+    uint64_t beg, end;          /* record offsets; the last slice ends
+                                   at end-of-file */
+    bam_batch_t *batch;         /* records passing the filters */
+    int done;
+} _BAM_SLICE;
+
+typedef struct _BAM_SPLIT *BAM_SPLIT;
+
+typedef struct {
+    BAM_SPLIT split;
+    BAM_DATA filters;
+    bamFile fp;
+    pthread_t thread;
+} _BAM_SPLIT_WORKER;
+
+struct _BAM_SPLIT {
+    int n, next, consumed, window, stop;
+    _BAM_SLICE *slice;
+    int n_threads;
+    _BAM_SPLIT_WORKER *worker;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, space;
+    uint64_t eof;               /* offset after the last record */
+};
+
+/* records of bd->bfile from bfile->pos0 to end-of-file, with the
+   filters of 'bd'; NULL when the file cannot be split */
+BAM_SPLIT _bam_split_new(BAM_DATA bd);
+
+/* the next slice, valid until the next call; NULL after the last */
+bam_batch_t *_bam_split_next(BAM_SPLIT split);
+
+void _bam_split_free(BAM_SPLIT split);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BAM_SPLIT_H */
@@ -0,0 +1,157 @@
+#include <string.h>
+#include "bam_yield.h"
+
+static const int YIELD_BATCHSIZE = 1024;
+
+/* thread: read records from y->pos0 until y->bd->yieldSize pass the
+   filters, or end-of-file */
+static void *_bam_yield_read(void *data)
+{
+    BAM_YIELD y = (BAM_YIELD) data;
+    BAM_DATA bd = y->bd;
+    bam_batch_t *chunk = y->chunk[0], *batch = bam_batch_init();
+    int (*read_batch)(bamFile, bam_batch_t *, int) =
+        bd->core_only ? bam_read_batch_core_only : bam_read_batch;
+
+    bam_batch_clear(chunk);
+    bam_seek(y->fp, y->pos0, SEEK_SET);
+    y->pos1 = y->pos0;
+    y->eof = 0;
+    while (chunk->n < bd->yieldSize) {
+        int stop;
+        pthread_mutex_lock(&y->lock);
+        stop = y->stop;
+        pthread_mutex_unlock(&y->lock);
+        if (stop)
+            break;
+
+        /* read no further than the chunk needs, as _samread */
+        int n = bd->yieldSize - chunk->n;
+        if (n > YIELD_BATCHSIZE)
+            n = YIELD_BATCHSIZE;
+        if (read_batch(y->fp, batch, n) == 0) {
+            y->eof = 1;
+            break;
+        }
+        for (int i = 0; i < batch->n; ++i)
+            if (_filter1_BAM_DATA(&batch->rec[i], bd)) {
+                bam_batch_push(chunk, &batch->rec[i]);
+                chunk->voffset[chunk->n - 1] = batch->voffset[i];
+            }
+        y->pos1 = batch->voffset[batch->n - 1];
+        if (batch->ret < 0) {
+            y->eof = 1;
+            break;
+        }
+    }
+
+    bam_batch_destroy(batch);
+    return NULL;
+}
+
+static void _bam_yield_join(BAM_YIELD y)
+{
+    if (!y->running)
+        return;
+    pthread_mutex_lock(&y->lock);
+    y->stop = 1;
+    pthread_mutex_unlock(&y->lock);
+    pthread_join(y->thread, NULL);
+    y->running = 0;
+}
+
+static BAM_YIELD _bam_yield_new(SEXP ext, SEXP key)
+{
+    BAM_FILE bfile = BAMFILE(ext);
+    const char *path = bfile->path;
+
+    /* remote files report errors through R; keep them on this thread */
+    if (NULL == path || strstr(path, "ftp://") == path ||
+        strstr(path, "http://") == path)
+        return NULL;
+    bamFile fp = bam_open(path, "r");
+    if (NULL == fp)
+        return NULL;
+    bgzf_advise(fp, BGZF_ADVICE_SEQUENTIAL);
+
+    BAM_YIELD y = Calloc(1, _BAM_YIELD);
+    y->key = key;
+    R_PreserveObject(key);
+    y->bd = _init_BAM_DATA(ext, R_NilValue,
+                           VECTOR_ELT(key, YIELD_KEEPFLAGS),
+                           VECTOR_ELT(key, YIELD_SIMPLECIGAR), R_NilValue,
+                           VECTOR_ELT(key, YIELD_MAPQFILTER),
+                           VECTOR_ELT(key, YIELD_FILTEREXPR), FALSE,
+                           INTEGER(VECTOR_ELT(key, YIELD_YIELDSIZE))[0],
+                           FALSE, FALSE, '\0', '\0', NULL);
+    y->bd->core_only = INTEGER(VECTOR_ELT(key, YIELD_COREONLY))[0];
+    y->fp = fp;
+    pthread_mutex_init(&y->lock, NULL);
+    y->chunk[0] = bam_batch_init();
+    y->chunk[1] = bam_batch_init();
+    return y;
+}
+
+BAM_YIELD _bam_yield_get(SEXP ext, SEXP key)
+{
+    BAM_FILE bfile = BAMFILE(ext);
+    BAM_YIELD y = (BAM_YIELD) bfile->yield;
+
+    /* parameters changed since the chunk was started */
+    if (NULL != y && !R_compute_identical(y->key, key, 16)) {
+        _bam_yield_free(y);
+        bfile->yield = y = NULL;
+    }
+    if (NULL == y) {
+        if (NULL == (y = _bam_yield_new(ext, key)))
+            return NULL;
+        bfile->yield = y;
+    }
+
+    /* the file was read, or the reader stopped at end-of-file, since */
+    if (!y->running || y->pos0 != bfile->pos0) {
+        _bam_yield_join(y);
+        _bam_yield_start(y, bfile->pos0);
+        if (!y->running) {
+            _bam_yield_free(y);
+            bfile->yield = NULL;
+            return NULL;
+        }
+    }
+    return y;
+}
+
+bam_batch_t *_bam_yield_wait(BAM_YIELD y)
+{
+    bam_batch_t *chunk = y->chunk[0];
+    if (y->running) {
+        pthread_join(y->thread, NULL);
+        y->running = 0;
+    }
+    /* the next chunk is read into the other buffer */
+    y->chunk[0] = y->chunk[1];
+    y->chunk[1] = chunk;
+    return chunk;
+}
+
+void _bam_yield_start(BAM_YIELD y, uint64_t pos0)
+{
+    y->pos0 = pos0;
+    y->stop = 0;
+    y->running =
+        0 == pthread_create(&y->thread, NULL, _bam_yield_read, (void *) y);
+}
+
+void _bam_yield_free(BAM_YIELD y)
+{
+    if (NULL == y)
+        return;
+    _bam_yield_join(y);
+    pthread_mutex_destroy(&y->lock);
+    bam_close(y->fp);
+    bam_batch_destroy(y->chunk[0]);
+    bam_batch_destroy(y->chunk[1]);
+    _Free_BAM_DATA(y->bd);
+    R_ReleaseObject(y->key);
+    Free(y);
+}
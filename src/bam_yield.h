@@ -0,0 +1,54 @@
+#ifndef BAM_YIELD_H
+#define BAM_YIELD_H
+
+#include <pthread.h>
+#include <Rinternals.h>
+#include "bam_data.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Background reader for whole-file scanBam() with yieldSize: while R
+   works on one chunk, a thread reads and filters the records of the
+   next chunk into a native buffer, on its own handle on the file. The
+   thread makes no R API calls; the caller parses the buffer. */
+
+/* elements of 'key', the filter and chunk parameters of the reader */
+enum {
+    YIELD_KEEPFLAGS = 0, YIELD_SIMPLECIGAR, YIELD_MAPQFILTER,
+    YIELD_FILTEREXPR, YIELD_YIELDSIZE, YIELD_COREONLY, YIELD_N
+};
+
+typedef struct {
+    SEXP key;                   /* preserved; 'bd' points into it */
+    BAM_DATA bd;                /* filters only; no R API calls */
+    bamFile fp;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int running, stop;
+    bam_batch_t *chunk[2];      /* being read, being parsed */
+    uint64_t pos0, pos1;        /* chunk start; offset after the chunk */
+    int eof;
+} _BAM_YIELD, *BAM_YIELD;
+
+/* the reader of 'bfile' for 'key', reading or having read the chunk
+   starting at bfile->pos0; NULL when no thread can be used */
+BAM_YIELD _bam_yield_get(SEXP ext, SEXP key);
+
+/* wait for the chunk. The two buffers alternate: the next
+   _bam_yield_start() reads into the other one, so the chunk may be
+   parsed while the next is read, and stays valid until the second
+   _bam_yield_start() that follows */
+bam_batch_t *_bam_yield_wait(BAM_YIELD y);
+
+/* read the chunk starting at 'pos0' in the background */
+void _bam_yield_start(BAM_YIELD y, uint64_t pos0);
+
+void _bam_yield_free(BAM_YIELD y);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BAM_YIELD_H */
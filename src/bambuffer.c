@@ -13,7 +13,7 @@ BAM_BUFFER bambuffer_new(int n, int as_mates)
     BAM_BUFFER buf = Calloc(1, _BAM_BUFFER);
     buf->i = 0;
     buf->n = n;
-    buf->buffer = Calloc(n, bam1_t *);
+    buf->buffer = bam_batch_init();
     if (as_mates) {
         buf->as_mates = TRUE;
         buf->mates = Calloc(n, int);
@@ -26,13 +26,12 @@ void bambuffer_push(BAM_BUFFER buf, const bam1_t *bam)
 {
     if (buf->i == buf->n) {
         buf->n *= 1.3;
-        buf->buffer = Realloc(buf->buffer, buf->n, bam1_t *);
         if (buf->as_mates) {
             buf->mates = Realloc(buf->mates, buf->n, int);
             buf->partition = Realloc(buf->partition, buf->n, int);
         }
     }
-    buf->buffer[buf->i] = bam_dup1(bam);
+    bam_batch_push(buf->buffer, bam);
     if (buf->as_mates) {
         buf->mates[buf->i] = buf->mate_flag;
         buf->partition[buf->i] = buf->partition_id;
@@ -42,15 +41,13 @@ void bambuffer_push(BAM_BUFFER buf, const bam1_t *bam)
 
 void bambuffer_reset(BAM_BUFFER buf)
 {
-    for (int i = 0; i < buf->i; ++i)
-        bam_destroy1(buf->buffer[i]);
+    bam_batch_clear(buf->buffer);
     buf->i = 0;
 }
 
 void bambuffer_free(BAM_BUFFER buf)
 {
-    bambuffer_reset(buf);
-    Free(buf->buffer);
+    bam_batch_destroy(buf->buffer);
     if (buf->as_mates) {
         Free(buf->mates);
         Free(buf->partition);
@@ -91,7 +88,8 @@ SEXP bambuffer_length(SEXP bufext)
 }
 
 SEXP bambuffer_parse(SEXP ext, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
-                     SEXP tagFilter, SEXP mapqFilter, SEXP bufext,
+                     SEXP tagFilter, SEXP mapqFilter, SEXP filterExpr,
+                     SEXP bufext,
                      SEXP reverseComplement, SEXP templateList)
 {
     _check_isbamfile(ext, "bamBuffer, 'parse'");
@@ -107,7 +105,7 @@ SEXP bambuffer_parse(SEXP ext, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
                                       BAMFILE(ext)));
     SCAN_BAM_DATA sbd = _init_SCAN_BAM_DATA(result);
     BAM_DATA bd = _init_BAM_DATA(ext, R_NilValue, keepFlags, isSimpleCigar,
-                                 tagFilter, mapqFilter,
+                                 tagFilter, mapqFilter, filterExpr,
                                  LOGICAL(reverseComplement)[0],
                                  NA_INTEGER, 0, 0, '\0', '\0', (void *) sbd);
     bd->irange = 0;             /* everything parsed to 'irange' 0 */
@@ -119,7 +117,7 @@ SEXP bambuffer_parse(SEXP ext, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
             sbd->mates_flag = buf->mates[i];
             sbd->partition_id = buf->partition[i];
         }
-        int result = _parse1_BAM_DATA(buf->buffer[i], bd);
+        int result = _parse1_BAM_DATA(&buf->buffer->rec[i], bd);
         if (result < 0) {   /* parse error: e.g., cigar buffer overflow */
             _grow_SCAN_BAM_DATA(bd, 0);
             bd->iparsed = -1;
@@ -165,7 +163,7 @@ SEXP bambuffer_write(SEXP bufext, SEXP bamext, SEXP filter)
     n = buf->i;
     for (int i = 0; i < n; ++i)
         if (LOGICAL(filter)[i % filt_n]) {
-            status = samwrite(bfile->file, buf->buffer[i]);
+            status = samwrite(bfile->file, &buf->buffer->rec[i]);
             if (status <= 0)
                 Rf_error("'bamBuffer' write failed, record %d", i);
         }
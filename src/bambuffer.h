@@ -5,7 +5,7 @@
 #include "samtools/bam.h"
 
 typedef struct {
-    bam1_t **buffer;
+    bam_batch_t *buffer;        /* records share one arena */
     int *mates, *partition;
     int i, n, as_mates, mate_flag, partition_id;
 } _BAM_BUFFER, *BAM_BUFFER;
@@ -16,7 +16,7 @@ SEXP bambuffer(int yieldSize, int as_mates);
 SEXP bambuffer_length(SEXP bufext);
 SEXP bambuffer_parse(SEXP bamext, SEXP space, SEXP keepFlags,
                      SEXP isSimpleCigar, SEXP tagFilter, SEXP mapqFilter,
-                     SEXP bufext, SEXP reverseComplement, SEXP template_list);
+                     SEXP filterExpr, SEXP bufext, SEXP reverseComplement, SEXP template_list);
 SEXP bambuffer_write(SEXP bufext, SEXP bamext, SEXP filter);
 
 BAM_BUFFER bambuffer_new(int n, int as_mates);
@@ -1,6 +1,7 @@
 #include "bamfile.h"
 #include "io_sam.h"
 #include "bam_mate_iter.h"
+#include "bam_yield.h"
 #include "utilities.h"
 
 static SEXP BAMFILE_TAG = NULL;
@@ -34,6 +35,8 @@ static bam_index_t *_bam_tryindexload(const char *indexname)
 static void _bamfile_close(SEXP ext)
 {
     BAM_FILE bfile = BAMFILE(ext);
+    if (NULL != bfile->yield)
+        _bam_yield_free(bfile->yield);
     if (NULL != bfile->file)
         samclose(bfile->file);
     if (NULL != bfile->index)
@@ -42,9 +45,12 @@ static void _bamfile_close(SEXP ext)
         bam_mate_iter_destroy(bfile->iter);
     if (NULL != bfile->pbuffer)
         pileup_pbuffer_destroy(bfile->pbuffer);
+    if (NULL != bfile->path)
+        Free(bfile->path);
     bfile->file = NULL;
     bfile->index = NULL;
     bfile->iter = NULL;
+    bfile->yield = NULL;
 }
 
 static void _bamfile_finalizer(SEXP ext)
@@ -78,6 +84,8 @@ static BAM_FILE _bamfile_open_r(SEXP filename, SEXP indexname, SEXP filemode)
         }
         bfile->pos0 = bam_tell(bfile->file->x.bam);
         bfile->irange0 = 0;
+        bfile->path = Calloc(strlen(cfile) + 1, char);
+        strcpy(bfile->path, cfile);
     }
 
     bfile->index = NULL;
@@ -86,6 +94,7 @@ static BAM_FILE _bamfile_open_r(SEXP filename, SEXP indexname, SEXP filemode)
         bfile->index = _bam_tryindexload(cindex);
         if (NULL == bfile->index) {
             samclose(bfile->file);
+            Free(bfile->path);
             Free(bfile);
             Rf_error("failed to open BAM index\n  index: %s\n", cindex);
         }
@@ -93,6 +102,7 @@ static BAM_FILE _bamfile_open_r(SEXP filename, SEXP indexname, SEXP filemode)
 
     bfile->iter = NULL;
     bfile->pbuffer = NULL;
+    bfile->yield = NULL;
     return bfile;
 }
 
@@ -116,14 +126,22 @@ static BAM_FILE _bamfile_open_w(SEXP file0, SEXP file1)
     return bfile;
 }
 
-SEXP bamfile_open(SEXP file0, SEXP file1, SEXP mode)
+SEXP bamfile_open(SEXP file0, SEXP file1, SEXP mode, SEXP nThreads)
 {
     _checknames(file0, file1, mode);
+    int n_threads = _checkthreads(nThreads);
     BAM_FILE bfile;
-    if (*CHAR(STRING_ELT(mode, 0)) == 'r')
+    if (*CHAR(STRING_ELT(mode, 0)) == 'r') {
         bfile = _bamfile_open_r(file0, file1, mode);
-    else
+        /* one thread means inflate on the calling thread, as before */
+        if (NULL != bfile->file && n_threads > 1)
+            bgzf_mt(bfile->file->x.bam, n_threads, 4);
+        bfile->n_threads = n_threads;
+    } else {
         bfile = _bamfile_open_w(file0, file1);
+        if (n_threads > 1)
+            bgzf_mt(bfile->file->x.bam, n_threads, 256);
+    }
 
     SEXP ext = PROTECT(R_MakeExternalPtr(bfile, BAMFILE_TAG, file0));
     R_RegisterCFinalizerEx(ext, _bamfile_finalizer, TRUE);
@@ -181,10 +199,11 @@ SEXP read_bamfile_header(SEXP ext, SEXP what)
 }
 
 SEXP scan_bamfile(SEXP ext, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
-                  SEXP tagFilter, SEXP mapqFilter, SEXP reverseComplement,
-                  SEXP yieldSize,
+                  SEXP tagFilter, SEXP mapqFilter, SEXP filterExpr,
+                  SEXP reverseComplement, SEXP yieldSize,
                   SEXP template_list, SEXP obeyQname, SEXP asMates,
-                  SEXP qnamePrefixEnd, SEXP qnameSuffixStart)
+                  SEXP qnamePrefixEnd, SEXP qnameSuffixStart,
+                  SEXP maxMateMemory)
 {
     _checkext(ext, BAMFILE_TAG, "scanBam");
     _checkparams(space, keepFlags, isSimpleCigar);
@@ -196,29 +215,48 @@ SEXP scan_bamfile(SEXP ext, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
         Rf_error("'obeyQname' must be logical(1)");
     if (!(IS_LOGICAL(asMates) && (1L == LENGTH(asMates))))
         Rf_error("'asMates' must be logical(1)");
+    if (!(IS_NUMERIC(maxMateMemory) && (1L == LENGTH(maxMateMemory))))
+        Rf_error("'maxMateMemory' must be numeric(1)");
     _bam_check_template_list(template_list);
     return _scan_bam(ext, space, keepFlags, isSimpleCigar,
-                     tagFilter, mapqFilter, reverseComplement, yieldSize,
+                     tagFilter, mapqFilter, filterExpr, reverseComplement,
+                     yieldSize,
                      template_list, obeyQname, asMates, qnamePrefixEnd,
-                     qnameSuffixStart);
+                     qnameSuffixStart, maxMateMemory);
 }
 
 SEXP count_bamfile(SEXP ext, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
-                   SEXP tagFilter, SEXP mapqFilter)
+                   SEXP tagFilter, SEXP mapqFilter, SEXP filterExpr)
 {
     _checkext(ext, BAMFILE_TAG, "countBam");
     _checkparams(space, keepFlags, isSimpleCigar);
     SEXP count = _count_bam(ext, space, keepFlags, isSimpleCigar, tagFilter,
-                            mapqFilter);
+                            mapqFilter, filterExpr);
     if (R_NilValue == count)
         Rf_error("'countBam' failed");
     return count;
 }
 
+SEXP idxstats_bamfile(SEXP ext)
+{
+    _checkext(ext, BAMFILE_TAG, "idxstatsBam");
+    return _idxstats_bam(ext);
+}
+
+SEXP count_bamfile_approximate(SEXP ext, SEXP space)
+{
+    _checkext(ext, BAMFILE_TAG, "countBam");
+    if (R_NilValue != space && !(IS_LIST(space) && 3L == LENGTH(space)))
+        Rf_error("'space' must be NULL or list(3)");
+    return _count_bam_approximate(ext, space);
+}
+
 SEXP prefilter_bamfile(SEXP ext, SEXP space, SEXP keepFlags,
                        SEXP isSimpleCigar, SEXP tagFilter, SEXP mapqFilter,
-                       SEXP yieldSize, SEXP obeyQname, SEXP asMates,
-                       SEXP qnamePrefixEnd, SEXP qnameSuffixStart)
+                       SEXP filterExpr, SEXP yieldSize, SEXP obeyQname,
+                       SEXP asMates,
+                       SEXP qnamePrefixEnd, SEXP qnameSuffixStart,
+                       SEXP maxMateMemory)
 {
     _checkext(ext, BAMFILE_TAG, "filterBam");
     _checkparams(space, keepFlags, isSimpleCigar);
@@ -228,17 +266,19 @@ SEXP prefilter_bamfile(SEXP ext, SEXP space, SEXP keepFlags,
         Rf_error("'obeyQname' must be logical(1)");
     if (!(IS_LOGICAL(asMates) && (1L == LENGTH(asMates))))
         Rf_error("'asMates' must be logical(1)");
+    if (!(IS_NUMERIC(maxMateMemory) && (1L == LENGTH(maxMateMemory))))
+        Rf_error("'maxMateMemory' must be numeric(1)");
     SEXP result =
         _prefilter_bam(ext, space, keepFlags, isSimpleCigar, tagFilter,
-                       mapqFilter, yieldSize, obeyQname, asMates,
-                       qnamePrefixEnd, qnameSuffixStart);
+                       mapqFilter, filterExpr, yieldSize, obeyQname, asMates,
+                       qnamePrefixEnd, qnameSuffixStart, maxMateMemory);
     if (R_NilValue == result)
         Rf_error("'filterBam' failed during pre-filtering");
     return result;
 }
 
 SEXP filter_bamfile(SEXP ext, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
-                    SEXP tagFilter, SEXP mapqFilter,
+                    SEXP tagFilter, SEXP mapqFilter, SEXP filterExpr,
                     SEXP fout_name, SEXP fout_mode)
 {
     _checkext(ext, BAMFILE_TAG, "filterBam");
@@ -248,7 +288,7 @@ SEXP filter_bamfile(SEXP ext, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
     if (!IS_CHARACTER(fout_mode) || 1 != LENGTH(fout_mode))
         Rf_error("'fout_mode' must be character(1)");
     SEXP result = _filter_bam(ext, space, keepFlags, isSimpleCigar,
-                              tagFilter, mapqFilter,
+                              tagFilter, mapqFilter, filterExpr,
                               fout_name, fout_mode);
     if (R_NilValue == result)
         Rf_error("'filterBam' failed");
@@ -14,16 +14,19 @@ extern "C" {
 typedef struct {
     samfile_t *file;
     bam_index_t *index;
+    char *path;                 /* for additional handles on 'file' */
+    int n_threads;
     uint64_t pos0;
     int irange0;
     bam_mate_iter_t iter;
     void *pbuffer; /* for buffered pileup */
+    void *yield;   /* next yieldSize chunk, read in the background */
 } _BAM_FILE, *BAM_FILE;
 
 #define BAMFILE(b) ((BAM_FILE) R_ExternalPtrAddr(b))
 
 SEXP bamfile_init();
-SEXP bamfile_open(SEXP file0, SEXP file1, SEXP mode);
+SEXP bamfile_open(SEXP file0, SEXP file1, SEXP mode, SEXP nThreads);
 SEXP bamfile_close(SEXP ext);
 SEXP bamfile_isopen(SEXP ext);
 SEXP bamfile_isincomplete(SEXP ext);
@@ -31,19 +34,22 @@ SEXP bamfile_isincomplete(SEXP ext);
 SEXP read_bamfile_header(SEXP ext, SEXP what);
 SEXP scan_bamfile(SEXP ext, SEXP space, SEXP keepFlags,
                   SEXP simpleCigar, SEXP tagFilter,  SEXP mapqFilter,
-                  SEXP reverseComplement, SEXP yieldSize,
+                  SEXP filterExpr, SEXP reverseComplement, SEXP yieldSize,
                   SEXP tmpl, SEXP obeyQname, 
-                  SEXP asMates, SEXP qnamePrefix, SEXP qnameSuffix);
+                  SEXP asMates, SEXP qnamePrefix, SEXP qnameSuffix,
+                  SEXP maxMateMemory);
 SEXP count_bamfile(SEXP ext, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
-                   SEXP tagFilter, SEXP mapqFilter);
+                   SEXP tagFilter, SEXP mapqFilter, SEXP filterExpr);
+SEXP idxstats_bamfile(SEXP ext);
+SEXP count_bamfile_approximate(SEXP ext, SEXP space);
 SEXP prefilter_bamfile(SEXP ext, SEXP space, SEXP keepFlags,
 		       SEXP isSimpleCigar, SEXP tagFilter, SEXP mapqFilter,
-                       SEXP yieldSize,
+                       SEXP filterExpr, SEXP yieldSize,
                        SEXP obeyQname, SEXP asMates, SEXP qnamePrefix,
-                       SEXP qnameSuffix);
+                       SEXP qnameSuffix, SEXP maxMateMemory);
 SEXP filter_bamfile(SEXP ext, SEXP space, SEXP keepFlags,
                     SEXP isSimpleCigar, SEXP tagFilter, SEXP mapqFilter,
-                    SEXP fout_name, SEXP fout_mode);
+                    SEXP filterExpr, SEXP fout_name, SEXP fout_mode);
 
 void _check_isbamfile(SEXP ext, const char *lbl);
 samfile_t *_bam_tryopen(const char *filename, const char *mode, void *aux);
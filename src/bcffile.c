@@ -83,9 +83,11 @@ SEXP bcffile_init()
     return R_NilValue;
 }
 
-SEXP bcffile_open(SEXP filename, SEXP indexname, SEXP filemode)
+SEXP bcffile_open(SEXP filename, SEXP indexname, SEXP filemode,
+                  SEXP nThreads)
 {
     _checknames(filename, indexname, filemode);
+    int n_threads = _checkthreads(nThreads);
 
     _BCF_FILE *bfile = Calloc(1, _BCF_FILE);
 
@@ -110,6 +112,10 @@ SEXP bcffile_open(SEXP filename, SEXP indexname, SEXP filemode)
         }
     }
 
+    if (NULL != bfile->file && !bfile->file->is_vcf && n_threads > 1)
+        bgzf_mt(bfile->file->fp, n_threads,
+                *CHAR(STRING_ELT(filemode, 0)) == 'r' ? 4 : 256);
+
     SEXP ext = PROTECT(R_MakeExternalPtr(bfile, BCFFILE_TAG, filename));
     R_RegisterCFinalizerEx(ext, _bcffile_finalizer, TRUE);
     UNPROTECT(1);
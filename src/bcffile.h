@@ -13,7 +13,8 @@ typedef struct {
 #define BCFFILE(b) ((_BCF_FILE *) R_ExternalPtrAddr(b))
 
 SEXP bcffile_init();
-SEXP bcffile_open(SEXP filename, SEXP indexname, SEXP mode);
+SEXP bcffile_open(SEXP filename, SEXP indexname, SEXP mode,
+                  SEXP nThreads);
 SEXP bcffile_close(SEXP ext);
 SEXP bcffile_isopen(SEXP ext);
 SEXP bcffile_isvcf(SEXP ext);
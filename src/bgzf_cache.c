@@ -0,0 +1,46 @@
+#include "bgzf_cache.h"
+#include "bgzf.h"
+
+SEXP bgzf_cache_size(SEXP size)
+{
+    bgzf_cache_stats_t stats;
+    bgzf_cache_stats(&stats);
+    if (R_NilValue != size) {
+        if (!IS_NUMERIC(size) || 1L != Rf_length(size) ||
+            ISNAN(REAL(size)[0]) || REAL(size)[0] < 0)
+            Rf_error("'size' must be numeric(1) >= 0");
+        bgzf_cache_resize((int64_t) REAL(size)[0]);
+    }
+    return ScalarReal((double) stats.capacity);
+}
+
+SEXP bgzf_cache_info()
+{
+    const char *nms[] = {
+        "size", "used", "blocks", "files", "hits", "misses", "evictions"
+    };
+    const int n = sizeof(nms) / sizeof(const char *);
+    bgzf_cache_stats_t stats;
+    bgzf_cache_stats(&stats);
+
+    SEXP ans = PROTECT(NEW_NUMERIC(n)), names = PROTECT(NEW_CHARACTER(n));
+    double *v = REAL(ans);
+    v[0] = stats.capacity;
+    v[1] = stats.used;
+    v[2] = stats.n_blocks;
+    v[3] = stats.n_files;
+    v[4] = stats.hits;
+    v[5] = stats.misses;
+    v[6] = stats.evictions;
+    for (int i = 0; i < n; ++i)
+        SET_STRING_ELT(names, i, mkChar(nms[i]));
+    SET_NAMES(ans, names);
+    UNPROTECT(2);
+    return ans;
+}
+
+SEXP bgzf_cache_reset()
+{
+    bgzf_cache_clear();
+    return R_NilValue;
+}
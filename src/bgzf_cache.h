@@ -0,0 +1,10 @@
+#ifndef BGZF_CACHE_H
+#define BGZF_CACHE_H
+
+#include <Rdefines.h>
+
+SEXP bgzf_cache_size(SEXP size);
+SEXP bgzf_cache_info();
+SEXP bgzf_cache_reset();
+
+#endif
@@ -0,0 +1,28 @@
+#include "bgzf_codec.h"
+#include "bgzf.h"
+
+SEXP bgzf_codec_select(SEXP codec)
+{
+    SEXP ans = PROTECT(mkString(bgzf_codec(NULL)));
+    if (R_NilValue != codec) {
+        if (!IS_CHARACTER(codec) || 1L != Rf_length(codec) ||
+            NA_STRING == STRING_ELT(codec, 0))
+            Rf_error("'codec' must be character(1) and not NA");
+        if (NULL == bgzf_codec(CHAR(STRING_ELT(codec, 0))))
+            Rf_error("codec '%s' is not available",
+                     CHAR(STRING_ELT(codec, 0)));
+    }
+    UNPROTECT(1);
+    return ans;
+}
+
+SEXP bgzf_codec_available()
+{
+    const char *names[8];
+    int n = bgzf_codec_list(names, 8);
+    SEXP ans = PROTECT(NEW_CHARACTER(n));
+    for (int i = 0; i < n; ++i)
+        SET_STRING_ELT(ans, i, mkChar(names[i]));
+    UNPROTECT(1);
+    return ans;
+}
@@ -0,0 +1,9 @@
+#ifndef BGZF_CODEC_H
+#define BGZF_CODEC_H
+
+#include <Rdefines.h>
+
+SEXP bgzf_codec_select(SEXP codec);
+SEXP bgzf_codec_available();
+
+#endif
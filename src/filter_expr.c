@@ -0,0 +1,288 @@
+#include <math.h>
+#include "filter_expr.h"
+
+static SEXP _filter_expr_elt(SEXP expr, const char *name, SEXPTYPE type)
+{
+    SEXP names = GET_NAMES(expr);
+    for (int i = 0; i < LENGTH(expr); ++i)
+        if (0 == strcmp(name, CHAR(STRING_ELT(names, i)))) {
+            SEXP elt = VECTOR_ELT(expr, i);
+            if (TYPEOF(elt) != type)
+                Rf_error("'filterExpr' element '%s' must be %s", name,
+                         Rf_type2char(type));
+            return elt;
+        }
+    Rf_error("'filterExpr' element '%s' not found", name);
+    return R_NilValue;          /* not reached */
+}
+
+/* check operands and stack use, so evaluation needs no checks; called
+   before anything is allocated, as errors do not return. Returns
+   whether the code reads variable-length data */
+/* operands following opcode 'op' in the code */
+static int _filter_expr_n_operand(int op)
+{
+    switch (op) {
+    case FE_CONST: case FE_FIELD: case FE_FLAGBIT: case FE_TAG:
+    case FE_HASTAG:
+        return 1;
+    case FE_TAGSTREQ:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+static int _filter_expr_check(const int *code, int n_code, int n_constant,
+                              int n_tag, int n_string, int n_stack)
+{
+    int depth = 0, pc = 0, needs_data = 0;
+    while (pc < n_code) {
+        const int op = code[pc++];
+        if (pc + _filter_expr_n_operand(op) > n_code)
+            Rf_error("'filterExpr' opcode %d lacks its operand", op);
+        const int arg = pc < n_code ? code[pc] : -1;
+        switch (op) {
+        case FE_CONST:
+            if (arg < 0 || arg >= n_constant)
+                Rf_error("'filterExpr' constant out of range");
+            pc += 1; depth += 1;
+            break;
+        case FE_FIELD:
+            if (arg < 0 || arg >= FE_FIELD_N)
+                Rf_error("'filterExpr' field out of range");
+            if (FE_FIELD_QWIDTH == arg || FE_FIELD_WIDTH == arg)
+                needs_data = 1;
+            pc += 1; depth += 1;
+            break;
+        case FE_FLAGBIT:
+            pc += 1; depth += 1;
+            break;
+        case FE_TAG:
+        case FE_HASTAG:
+            if (arg < 0 || arg >= n_tag)
+                Rf_error("'filterExpr' tag out of range");
+            needs_data = 1;
+            pc += 1; depth += 1;
+            break;
+        case FE_TAGSTREQ:
+            if (arg < 0 || arg >= n_tag ||
+                code[pc + 1] < 0 || code[pc + 1] >= n_string)
+                Rf_error("'filterExpr' tag or string out of range");
+            needs_data = 1;
+            pc += 2; depth += 1;
+            break;
+        case FE_NOT:
+        case FE_NEG:
+            if (depth < 1)
+                Rf_error("'filterExpr' stack underflow");
+            break;
+        case FE_AND: case FE_OR: case FE_EQ: case FE_NE: case FE_LT:
+        case FE_LE: case FE_GT: case FE_GE: case FE_ADD: case FE_SUB:
+        case FE_MUL: case FE_DIV:
+            if (depth < 2)
+                Rf_error("'filterExpr' stack underflow");
+            depth -= 1;
+            break;
+        default:
+            Rf_error("'filterExpr' unknown opcode %d", op);
+        }
+        if (depth > n_stack)
+            Rf_error("'filterExpr' stack overflow");
+    }
+    if (depth != 1)
+        Rf_error("'filterExpr' must compute a single value");
+    return needs_data;
+}
+
+FILTER_EXPR _filter_expr_new(SEXP expr)
+{
+    if (R_NilValue == expr)
+        return NULL;
+    if (!IS_LIST(expr))
+        Rf_error("'filterExpr' must be list() or NULL");
+
+    SEXP code = _filter_expr_elt(expr, "code", INTSXP),
+        constant = _filter_expr_elt(expr, "constant", REALSXP),
+        tag = _filter_expr_elt(expr, "tag", STRSXP),
+        string = _filter_expr_elt(expr, "string", STRSXP),
+        stack = _filter_expr_elt(expr, "stack", INTSXP);
+    if (1L != LENGTH(stack) || INTEGER(stack)[0] < 1)
+        Rf_error("'filterExpr' stack must be integer(1) > 0");
+    const int needs_data =
+        _filter_expr_check(INTEGER(code), LENGTH(code), LENGTH(constant),
+                           LENGTH(tag), LENGTH(string), INTEGER(stack)[0]);
+
+    FILTER_EXPR fe = Calloc(1, _FILTER_EXPR);
+    fe->needs_data = needs_data;
+    fe->n_code = LENGTH(code);
+    fe->code = INTEGER(code);
+    fe->n_constant = LENGTH(constant);
+    fe->constant = REAL(constant);
+    fe->n_string = LENGTH(string);
+    fe->string = Calloc(fe->n_string > 0 ? fe->n_string : 1, const char *);
+    for (int i = 0; i < fe->n_string; ++i)
+        fe->string[i] = CHAR(STRING_ELT(string, i));
+    if (LENGTH(tag) > 0) {
+        const char **tagnames =
+            (const char **) R_alloc(LENGTH(tag), sizeof(const char *));
+        for (int i = 0; i < LENGTH(tag); ++i)
+            tagnames[i] = CHAR(STRING_ELT(tag, i));
+        fe->tags = _aux_index_new(tagnames, LENGTH(tag));
+    }
+    fe->n_stack = INTEGER(stack)[0];
+    fe->stack = Calloc(fe->n_stack, double);
+    return fe;
+}
+
+FILTER_EXPR _filter_expr_copy(FILTER_EXPR fe)
+{
+    if (NULL == fe)
+        return NULL;
+    FILTER_EXPR copy = Calloc(1, _FILTER_EXPR);
+    *copy = *fe;
+    copy->string = Calloc(fe->n_string > 0 ? fe->n_string : 1, const char *);
+    for (int i = 0; i < fe->n_string; ++i)
+        copy->string[i] = fe->string[i];
+    copy->tags = _aux_index_copy(fe->tags);
+    copy->stack = Calloc(fe->n_stack, double);
+    return copy;
+}
+
+void _filter_expr_free(FILTER_EXPR fe)
+{
+    if (NULL == fe)
+        return;
+    _aux_index_free(fe->tags);
+    Free(fe->string);
+    Free(fe->stack);
+    Free(fe);
+}
+
+static double _filter_expr_field(const bam1_t *bam, int field)
+{
+    const bam1_core_t *c = &bam->core;
+    switch (field) {
+    case FE_FIELD_FLAG:
+        return c->flag;
+    case FE_FIELD_MAPQ:
+        return c->flag & BAM_FUNMAP ? NAN : c->qual;
+    case FE_FIELD_POS:
+        return c->flag & BAM_FUNMAP ? NAN : c->pos + 1;
+    case FE_FIELD_QWIDTH:
+        return c->flag & BAM_FUNMAP ?
+            NAN : bam_cigar2qlen(c, bam1_cigar(bam));
+    case FE_FIELD_WIDTH:
+        return c->flag & BAM_FUNMAP ?
+            NAN : bam_calend(c, bam1_cigar(bam)) - c->pos;
+    case FE_FIELD_ISIZE:
+        return c->flag & (BAM_FUNMAP | BAM_FMUNMAP) ? NAN : c->isize;
+    default:                    /* FE_FIELD_MPOS */
+        return c->flag & BAM_FMUNMAP ? NAN : c->mpos + 1;
+    }
+}
+
+static double _filter_expr_tag(const uint8_t *aux)
+{
+    if (NULL == aux)
+        return NAN;
+    switch (aux[0]) {
+    case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
+        return bam_aux2i(aux);
+    case 'f':
+        return bam_aux2f(aux);
+    case 'd':
+        return bam_aux2d(aux);
+    default:                    /* not a number */
+        return NAN;
+    }
+}
+
+static double _filter_expr_tagstreq(const uint8_t *aux, const char *s)
+{
+    if (NULL == aux)
+        return NAN;
+    switch (aux[0]) {
+    case 'A':
+        return s[0] == (char) aux[1] && s[1] == '\0';
+    case 'Z':
+        return 0 == strcmp((const char *) aux + 1, s);
+    default:
+        return 0;
+    }
+}
+
+int _filter_expr_eval(FILTER_EXPR fe, const bam1_t *bam)
+{
+    const int *code = fe->code;
+    double *s = fe->stack - 1, a, b; /* s points to the top */
+    int pc = 0;
+
+    if (NULL != fe->tags)
+        _aux_index_find(fe->tags, bam);
+
+    while (pc < fe->n_code) {
+        switch (code[pc++]) {
+        case FE_CONST:
+            *++s = fe->constant[code[pc++]];
+            break;
+        case FE_FIELD:
+            *++s = _filter_expr_field(bam, code[pc++]);
+            break;
+        case FE_FLAGBIT:
+            *++s = (bam->core.flag & code[pc++]) != 0;
+            break;
+        case FE_TAG:
+            *++s = _filter_expr_tag(_aux_index_get(fe->tags, code[pc++]));
+            break;
+        case FE_HASTAG:
+            *++s = NULL != _aux_index_get(fe->tags, code[pc++]);
+            break;
+        case FE_TAGSTREQ:
+            *++s = _filter_expr_tagstreq(_aux_index_get(fe->tags, code[pc]),
+                                         fe->string[code[pc + 1]]);
+            pc += 2;
+            break;
+        case FE_NOT:
+            if (!isnan(*s))
+                *s = *s == 0;
+            break;
+        case FE_NEG:
+            *s = -*s;
+            break;
+        case FE_AND:            /* FALSE & NA is FALSE */
+            b = *s--; a = *s;
+            *s = (a == 0 || b == 0) ? 0 : (isnan(a) || isnan(b)) ? NAN : 1;
+            break;
+        case FE_OR:             /* TRUE | NA is TRUE */
+            b = *s--; a = *s;
+            *s = ((!isnan(a) && a != 0) || (!isnan(b) && b != 0)) ? 1 :
+                (isnan(a) || isnan(b)) ? NAN : 0;
+            break;
+#define FE_COMPARE(OP)                                          \
+            b = *s--; a = *s;                                   \
+            *s = (isnan(a) || isnan(b)) ? NAN : (a OP b);       \
+            break
+        case FE_EQ: FE_COMPARE(==);
+        case FE_NE: FE_COMPARE(!=);
+        case FE_LT: FE_COMPARE(<);
+        case FE_LE: FE_COMPARE(<=);
+        case FE_GT: FE_COMPARE(>);
+        case FE_GE: FE_COMPARE(>=);
+#undef FE_COMPARE
+        case FE_ADD:
+            b = *s--; *s += b;
+            break;
+        case FE_SUB:
+            b = *s--; *s -= b;
+            break;
+        case FE_MUL:
+            b = *s--; *s *= b;
+            break;
+        case FE_DIV:
+            b = *s--; *s /= b;
+            break;
+        }
+    }
+    return !isnan(*s) && *s != 0;
+}
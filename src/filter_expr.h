@@ -0,0 +1,54 @@
+#ifndef FILTER_EXPR_H
+#define FILTER_EXPR_H
+
+#include "samtools/sam.h"
+#include <Rdefines.h>
+#include "aux_index.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ScanBamParam(filterExpr=) compiled by .compile_filterExpr() in
+   R/filterExpr.R; opcodes must match .FILTER_OP there */
+
+enum {
+    FE_CONST = 1, FE_FIELD, FE_FLAGBIT, FE_TAG, FE_HASTAG, FE_TAGSTREQ,
+    FE_NOT, FE_NEG, FE_AND, FE_OR, FE_EQ, FE_NE, FE_LT, FE_LE, FE_GT, FE_GE,
+    FE_ADD, FE_SUB, FE_MUL, FE_DIV
+};
+
+/* fields, as .FILTER_FIELD */
+enum {
+    FE_FIELD_FLAG = 0, FE_FIELD_MAPQ, FE_FIELD_POS, FE_FIELD_QWIDTH,
+    FE_FIELD_WIDTH, FE_FIELD_ISIZE, FE_FIELD_MPOS, FE_FIELD_N
+};
+
+typedef struct {
+    int n_code, *code;
+    int n_constant;
+    double *constant;
+    int n_string;
+    const char **string;
+    AUX_INDEX tags;             /* NULL if no tag is used */
+    double *stack;
+    int n_stack;
+    int needs_data;             /* uses cigar or tags, not just the core */
+} _FILTER_EXPR, *FILTER_EXPR;
+
+/* NULL when 'expr' is R_NilValue */
+FILTER_EXPR _filter_expr_new(SEXP expr);
+void _filter_expr_free(FILTER_EXPR fe);
+
+/* a copy sharing the compiled code, with its own evaluation state,
+   e.g., for another thread; valid while 'fe' is */
+FILTER_EXPR _filter_expr_copy(FILTER_EXPR fe);
+
+/* 1 if 'bam' passes; FALSE and NA fail */
+int _filter_expr_eval(FILTER_EXPR fe, const bam1_t *bam);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FILTER_EXPR_H */
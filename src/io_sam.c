@@ -10,6 +10,8 @@
 #include "XVector_interface.h"
 #include "Biostrings_interface.h"
 #include "bam_mate_iter.h"
+#include "bam_yield.h"
+#include "bam_split.h"
 
 /* from samtoools/bam_sort.c */
 void bam_sort_core(int is_by_qname, const char *fn, const char *prefix,
@@ -228,36 +230,56 @@ int check_qname(char *last_qname, int bufsize, bam1_t *bam, int max)
 int _samread(BAM_FILE bfile, BAM_DATA bd, const int yieldSize,
              bam_fetch_f parse1)
 {
-    int yield = 0, status = 1, bufsize = 1000;
+    const int batchsize = 1024;
+    int yield = 0, status = 1, bufsize = 1000, done = 0;
     char *last_qname = Calloc(bufsize, char);
-    bam1_t *bam = bam_init1();
-
-    while (samread(bfile->file, bam) >= 0) {
-        if (NA_INTEGER != yieldSize) {
-            if (bd->obeyQname)
-                status = check_qname(last_qname, bufsize, bam, 
-                                     yield >= yieldSize);
-            if (status < 0)
-                break;
-        }
- 
-        int result = parse1(bam, bd);
-        if (result < 0) {   /* parse error: e.g., cigar buffer overflow */
-            bam_destroy1(bam);
-            Free(last_qname);
-            return yield;
-        } else if (result == 0L) /* does not pass filter */
-            continue;
+    bam_batch_t *batch = bam_batch_init();
+    int (*read_batch)(bamFile, bam_batch_t *, int) =
+        bd->core_only ? bam_read_batch_core_only : bam_read_batch;
+
+    while (!done) {
+        /* without obeyQname, read no further than yieldSize needs */
+        int n = batchsize;
+        if (NA_INTEGER != yieldSize && !bd->obeyQname &&
+            yieldSize - yield < n)
+            n = yieldSize - yield;
+        if (read_batch(bfile->file->x.bam, batch, n) == 0)
+            break;
 
-        yield += status;
-        if (NA_INTEGER != yieldSize && yield == yieldSize) { 
-            bfile->pos0 = bam_tell(bfile->file->x.bam);
-            if (!bd->obeyQname) 
-                break;
+        for (int i = 0; i < batch->n; ++i) {
+            bam1_t *bam = &batch->rec[i];
+            if (NA_INTEGER != yieldSize) {
+                if (bd->obeyQname)
+                    status = check_qname(last_qname, bufsize, bam,
+                                         yield >= yieldSize);
+                if (status < 0) {
+                    done = 1;
+                    break;
+                }
+            }
+
+            int result = parse1(bam, bd);
+            if (result < 0) {   /* parse error: e.g., cigar buffer overflow */
+                bam_batch_destroy(batch);
+                Free(last_qname);
+                return yield;
+            } else if (result == 0L) /* does not pass filter */
+                continue;
+
+            yield += status;
+            if (NA_INTEGER != yieldSize && yield == yieldSize) {
+                bfile->pos0 = batch->voffset[i];
+                if (!bd->obeyQname) {
+                    done = 1;
+                    break;
+                }
+            }
         }
+        if (batch->ret < 0)
+            break;
     }
 
-    bam_destroy1(bam);
+    bam_batch_destroy(batch);
     Free(last_qname);
     return yield;
 }
@@ -265,19 +287,19 @@ int _samread(BAM_FILE bfile, BAM_DATA bd, const int yieldSize,
 int _samread_mate(BAM_FILE bfile, BAM_DATA bd, const int yieldSize,
                   bam_fetch_mate_f parse1_mate)
 {
-    int yield = 0;
+    int yield = 0, status;
     bam_mates_t *bam_mates = bam_mates_new();
 
-    while (samread_mate(bfile->file->x.bam, bfile->index,
-                        &bfile->iter, bam_mates, bd) > 0) {
+    while ((status = samread_mate(bfile->file->x.bam, bfile->index,
+                                  &bfile->iter, bam_mates, bd)) > 0) {
 
         if (NA_INTEGER != yieldSize && yield  >= yieldSize)
             break;
 
         int result = parse1_mate(bam_mates, bd);
         if (result < 0) {       /* parse error */
-            bam_mates_destroy(bam_mates);
-            return result;
+            yield = result;
+            break;
         } else if (result == 0)
             continue;
 
@@ -289,10 +311,70 @@ int _samread_mate(BAM_FILE bfile, BAM_DATA bd, const int yieldSize,
 
     }
 
+    /* the iterator owns the records of the last yield */
+    bam_mate_iter_release(bfile->iter, bam_mates);
     bam_mates_destroy(bam_mates);
+    if (status < 0) {           /* e.g., temporary file not written */
+        bd->failure = bam_mate_iter_error(bfile->iter);
+        bam_mate_iter_destroy(bfile->iter);
+        bfile->iter = NULL;
+        bd->iparsed = -1;
+        return -1;
+    }
     return yield;
 }
 
+/* state of _samread_split, for parsing under R_ExecWithCleanup() */
+typedef struct {
+    BAM_FILE bfile;
+    BAM_DATA bd;
+    BAM_SPLIT split;
+    bam_fetch_f parse1;
+    int yield, result;
+} _SAMREAD_SPLIT;
+
+static SEXP _samread_split_parse(void *data)
+{
+    _SAMREAD_SPLIT *rs = (_SAMREAD_SPLIT *) data;
+    bam_batch_t *batch;
+    while (rs->result >= 0 && NULL != (batch = _bam_split_next(rs->split))) {
+        for (int i = 0; i < batch->n; ++i) {
+            /* the filters passed in the reader; parse1 counts records */
+            if ((rs->result = rs->parse1(&batch->rec[i], rs->bd)) < 0)
+                break;
+            rs->yield += rs->result;
+        }
+    }
+    if (rs->result >= 0)
+        bam_seek(rs->bfile->file->x.bam, rs->split->eof, SEEK_SET);
+    return R_NilValue;
+}
+
+/* also on an R error while parsing, so the reading threads stop */
+static void _samread_split_free(void *data)
+{
+    _bam_split_free(((_SAMREAD_SPLIT *) data)->split);
+}
+
+/* whole file, in slices read and filtered on nThreads threads; -1
+   when the file cannot be split */
+static int _samread_split(BAM_FILE bfile, BAM_DATA bd, bam_fetch_f parse1)
+{
+    if (NA_INTEGER != bd->yieldSize || NULL != bd->tagfilter)
+        return -1;
+    _SAMREAD_SPLIT rs;
+    rs.split = _bam_split_new(bd);
+    if (NULL == rs.split)
+        return -1;
+
+    rs.bfile = bfile;
+    rs.bd = bd;
+    rs.parse1 = parse1;
+    rs.yield = rs.result = 0;
+    R_ExecWithCleanup(_samread_split_parse, &rs, _samread_split_free, &rs);
+    return rs.yield;
+}
+
 /* read complete file */
 static int _scan_bam_all(BAM_DATA bd, bam_fetch_f parse1,
                          bam_fetch_mate_f parse1_mate, _FINISH1_FUNC finish1)
@@ -301,10 +383,11 @@ static int _scan_bam_all(BAM_DATA bd, bam_fetch_f parse1,
     const int yieldSize = bd->yieldSize;
     int yield = 0;
 
+    bgzf_advise(bfile->file->x.bam, BGZF_ADVICE_SEQUENTIAL);
     bam_seek(bfile->file->x.bam, bfile->pos0, SEEK_SET);
     if (bd->asMates) {
         yield = _samread_mate(bfile, bd, yieldSize, parse1_mate);
-    } else {
+    } else if ((yield = _samread_split(bfile, bd, parse1)) < 0) {
         yield = _samread(bfile, bd, yieldSize, parse1);
     }
 
@@ -317,45 +400,240 @@ static int _scan_bam_all(BAM_DATA bd, bam_fetch_f parse1,
     return bd->iparsed;
 }
 
+/* read the complete file in yieldSize chunks, the next chunk in the
+   background while R works on this one */
+static int _scan_bam_yield_ok(BAM_DATA bd, SEXP space)
+{
+    BAM_FILE bfile = _bam_file_BAM_DATA(bd);
+    return R_NilValue == space && NA_INTEGER != bd->yieldSize &&
+        !bd->asMates && !bd->obeyQname && NULL == bd->tagfilter &&
+        bfile->n_threads > 1;
+}
+
+static int _scan_bam_yield(SEXP ext, SEXP key, BAM_DATA bd,
+                           bam_fetch_f parse1, _FINISH1_FUNC finish1)
+{
+    BAM_FILE bfile = _bam_file_BAM_DATA(bd);
+    BAM_YIELD y = _bam_yield_get(ext, key);
+    if (NULL == y)
+        return _scan_bam_all(bd, parse1, NULL, finish1);
+
+    bam_batch_t *chunk = _bam_yield_wait(y);
+    bfile->pos0 = y->pos1;
+    bam_seek(bfile->file->x.bam, bfile->pos0, SEEK_SET);
+    if (!y->eof)
+        _bam_yield_start(y, bfile->pos0);
+
+    /* records passed the filters in the reader; filter again for
+       bd's record count */
+    for (int i = 0; i < chunk->n; ++i)
+        if (parse1(&chunk->rec[i], bd) < 0)
+            break;
+    if ((NULL != finish1) && (bd->iparsed >= 0))
+        (*finish1) (bd);
+
+    return bd->iparsed;
+}
+
+/* 0-based target ids and starts of the ranges from 'irange0' on; -1
+   for spaces not in the header */
+static void _range_tids(bam_header_t *header, SEXP space, int irange0,
+                        int *start, int *tid, int *beg)
+{
+    bam_init_header_hash(header);
+    for (int i = 0; i < LENGTH(space) - irange0; ++i) {
+        const int irange = irange0 + i;
+        tid[i] = bam_get_tid(header, translateChar(STRING_ELT(space, irange)));
+        beg[i] = start[irange] > 0 ? start[irange] - 1 : start[irange];
+    }
+}
+
+/* consecutive ranges read in one sweep by bam_fetch_regions(), so that
+   blocks shared by nearby ranges are read once */
+static const int COALESCE_MAX_RANGES = 512, COALESCE_MAX_WIDTH = 1 << 20;
+
+/* number of ranges from 'i' to read in one sweep: ranges on the space
+   of range 'i' spanning, from the least start to the greatest end, at
+   most COALESCE_MAX_WIDTH; 1 to read range 'i' on its own, e.g., when
+   it is wide or its space is unknown */
+static int _coalesce_ranges(const int *tid, const int *beg, const int *end,
+                            int i, int n)
+{
+    int j, lo = beg[i], hi = end[i];
+    for (j = i; j < n && j - i < COALESCE_MAX_RANGES && tid[j] >= 0; ++j) {
+        if (tid[j] != tid[i])
+            break;
+        if (beg[j] < lo)
+            lo = beg[j];
+        if (end[j] > hi)
+            hi = end[j];
+        if ((double) hi - lo > COALESCE_MAX_WIDTH)
+            break;
+    }
+    return j - i > 1 ? j - i : 1;
+}
+
+/* state of _scan_bam_fetch_mt, for parsing under R_ExecWithCleanup() */
+typedef struct {
+    BAM_DATA bd;
+    SEXP space;
+    const int *tid;
+    int n, initial, status;
+    bam_mtfetch_t mf;
+    bam_fetch_f parse1;
+    _FINISH1_FUNC *finish1;
+} _FETCH_MT;
+
+static SEXP _fetch_mt_parse(void *data)
+{
+    _FETCH_MT *fm = (_FETCH_MT *) data;
+    BAM_DATA bd = fm->bd;
+    const int irange0 = _bam_file_BAM_DATA(bd)->irange0;
+
+    for (int i = 0; i < fm->n; ++i) {
+        int ret;
+        bam_batch_t *batch = bam_mtfetch_next(fm->mf, &ret);
+        if (fm->tid[i] < 0) {
+            Rf_warning("space '%s' not in BAM header",
+                       translateChar(STRING_ELT(fm->space, irange0 + i)));
+            bd->irange += 1;
+            fm->status = -1;
+            return R_NilValue;
+        }
+        for (int j = 0; j < batch->n; ++j)
+            fm->parse1(&batch->rec[j], bd);
+
+        if (NULL != fm->finish1)
+            (*fm->finish1) (bd);
+        bd->irange += 1;
+        if ((NA_INTEGER != bd->yieldSize) &&
+            (bd->iparsed - fm->initial >= bd->yieldSize))
+            break;
+    }
+    fm->status = 0;
+    return R_NilValue;
+}
+
+/* also on an R error while parsing, so the reading threads stop */
+static void _fetch_mt_free(void *data)
+{
+    bam_mtfetch_destroy(((_FETCH_MT *) data)->mf);
+}
+
+/* read ranges on bfile->n_threads handles; records are parsed on this
+   thread, range by range in 'space' order. 'tid', 'beg' and 'end' start
+   at bfile->irange0. Returns -2 when the ranges cannot be read in
+   parallel */
+static int _scan_bam_fetch_mt(BAM_DATA bd, SEXP space, const int *tid,
+                              const int *beg, const int *end,
+                              bam_fetch_f parse1, _FINISH1_FUNC finish1)
+{
+    BAM_FILE bfile = _bam_file_BAM_DATA(bd);
+    _FETCH_MT fm;
+
+    fm.bd = bd;
+    fm.space = space;
+    fm.tid = tid;
+    fm.n = LENGTH(space) - bfile->irange0;
+    fm.initial = bd->iparsed;
+    fm.status = 0;
+    fm.parse1 = parse1;
+    fm.finish1 = finish1;
+    fm.mf = bam_mtfetch_init(bfile->path, bfile->index, fm.n, tid, beg,
+                             end, bfile->n_threads);
+    if (NULL == fm.mf)
+        return -2;
+
+    R_ExecWithCleanup(_fetch_mt_parse, &fm, _fetch_mt_free, &fm);
+    if (fm.status < 0)
+        return fm.status;
+    bfile->irange0 = bd->irange;
+
+    return bd->iparsed - fm.initial;
+}
+
 /* read ranges */
 static int _scan_bam_fetch(BAM_DATA bd, SEXP space, int *start, int *end,
                            bam_fetch_f parse1, bam_fetch_mate_f parse1_mate,
                            _FINISH1_FUNC finish1)
 {
-    int tid;
     BAM_FILE bfile = _bam_file_BAM_DATA(bd);
     samfile_t *sfile = bfile->file;
     bam_index_t *bindex = bfile->index;
-    const int initial = bd->iparsed;
-
-    for (int irange = bfile->irange0; irange < LENGTH(space); ++irange) {
-        const char *spc = translateChar(STRING_ELT(space, irange));
-        const int starti =
-            start[irange] > 0 ? start[irange] - 1 : start[irange];
-        for (tid = 0; tid < sfile->header->n_targets; ++tid) {
-            if (strcmp(spc, sfile->header->target_name[tid]) == 0)
-                break;
-        }
-        if (tid == sfile->header->n_targets) {
-            Rf_warning("space '%s' not in BAM header", spc);
+    const int irange0 = bfile->irange0, n = LENGTH(space) - irange0,
+        initial = bd->iparsed;
+    int *tid = (int *) R_alloc(n > 0 ? n : 1, sizeof(int)),
+        *beg = (int *) R_alloc(n > 0 ? n : 1, sizeof(int));
+
+    _range_tids(sfile->header, space, irange0, start, tid, beg);
+    end += irange0;
+
+    if (!bd->asMates && bfile->n_threads > 1 &&
+        n > 1 && NULL != bfile->path) {
+        int status = _scan_bam_fetch_mt(bd, space, tid, beg, end, parse1,
+                                        finish1);
+        if (-2 != status)
+            return status;
+    }
+
+    /* announce all ranges, unless they are read in sweeps that announce
+       their own blocks */
+    int coalesce = 0;
+    for (int i = 0; !bd->asMates && !coalesce && i < n; ++i)
+        coalesce = _coalesce_ranges(tid, beg, end, i, n) > 1;
+    bgzf_advise(sfile->x.bam, BGZF_ADVICE_RANDOM);
+    if (!coalesce && n > 0)
+        bam_prefetch(sfile->x.bam, bindex, n, tid, beg, end);
+
+    bam_batch_t **batch = NULL;
+    int n_batch = 0, status = 0;
+    for (int i = 0; i < n && 0 == status; ) {
+        int nsweep = bd->asMates ? 1 : _coalesce_ranges(tid, beg, end, i, n);
+        if (tid[i] < 0) {
+            Rf_warning("space '%s' not in BAM header",
+                       translateChar(STRING_ELT(space, irange0 + i)));
             bd->irange += 1;
-            return -1;
+            status = -1;
+            break;
         }
-        if (bd->asMates) {
-            bam_fetch_mate(sfile->x.bam, bindex, tid, starti, end[irange], 
-                           bd, parse1_mate);
-        } else {
-            bam_fetch(sfile->x.bam, bindex, tid, starti, end[irange],
-                      bd, parse1);
+        if (1 < nsweep) {
+            if (NULL == batch) {
+                n_batch = COALESCE_MAX_RANGES;
+                batch = Calloc(n_batch, bam_batch_t *);
+                for (int j = 0; j < n_batch; ++j)
+                    batch[j] = bam_batch_init();
+            }
+            bam_fetch_regions(sfile->x.bam, bindex, nsweep, tid + i, beg + i,
+                              end + i, batch);
         }
+        for (int j = 0; j < nsweep; ++j, ++i) {
+            if (1 < nsweep) {
+                for (int k = 0; k < batch[j]->n; ++k)
+                    parse1(&batch[j]->rec[k], bd);
+            } else if (bd->asMates) {
+                bam_fetch_mate(sfile->x.bam, bindex, tid[i], beg[i], end[i],
+                               bd, parse1_mate);
+            } else {
+                bam_fetch(sfile->x.bam, bindex, tid[i], beg[i], end[i],
+                          bd, parse1);
+            }
 
-        if (NULL != finish1)
-            (*finish1) (bd);
-        bd->irange += 1;
-        if ((NA_INTEGER != bd->yieldSize) &&
-            (bd->iparsed - initial >= bd->yieldSize))
-            break;
+            if (NULL != finish1)
+                (*finish1) (bd);
+            bd->irange += 1;
+            if ((NA_INTEGER != bd->yieldSize) &&
+                (bd->iparsed - initial >= bd->yieldSize)) {
+                status = 1;
+                break;
+            }
+        }
     }
+    for (int j = 0; j < n_batch; ++j)
+        bam_batch_destroy(batch[j]);
+    if (NULL != batch)
+        Free(batch);
+    if (status < 0)
+        return status;
     bfile->irange0 = bd->irange;
         
     return bd->iparsed - initial;
@@ -465,11 +743,27 @@ SEXP _scan_bam_result_init(SEXP template_list, SEXP names, SEXP space,
     return result;
 }
 
+/* MB of records held by asMates before spilling, NA for no limit, and
+   the stem of the names of spill files in tempdir() */
+static void _max_mate_memory(BAM_DATA bd, SEXP maxMateMemory)
+{
+    double mb = REAL(maxMateMemory)[0];
+    bd->maxMateMemory = ISNA(mb) ? 0 : mb;
+    if (0 == bd->maxMateMemory || !bd->asMates)
+        return;
+    SEXP call = PROTECT(Rf_lang1(Rf_install("tempdir")));
+    SEXP dir = PROTECT(Rf_eval(call, R_BaseEnv));
+    bd->spillPrefix =
+        R_tmpnam2("Rsamtools_mates", CHAR(STRING_ELT(dir, 0)), "");
+    UNPROTECT(2);
+}
+
 SEXP _scan_bam(SEXP bfile, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
-               SEXP tagFilter, SEXP mapqFilter,
+               SEXP tagFilter, SEXP mapqFilter, SEXP filterExpr,
                SEXP reverseComplement, SEXP yieldSize,
                SEXP template_list, SEXP obeyQname, SEXP asMates,
-               SEXP qnamePrefixEnd, SEXP qnameSuffixStart)
+               SEXP qnamePrefixEnd, SEXP qnameSuffixStart,
+               SEXP maxMateMemory)
 {
     SEXP names = PROTECT(GET_ATTR(template_list, R_NamesSymbol));
     SEXP result = PROTECT(_scan_bam_result_init(template_list, names, space,
@@ -486,20 +780,40 @@ SEXP _scan_bam(SEXP bfile, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
         qname_suffix = CHAR(suffix_elt)[0];
 
     BAM_DATA bd = _init_BAM_DATA(bfile, space, keepFlags, isSimpleCigar,
-                                 tagFilter, mapqFilter,
+                                 tagFilter, mapqFilter, filterExpr,
                                  LOGICAL(reverseComplement)[0],
                                  INTEGER(yieldSize)[0],
                                  LOGICAL(obeyQname)[0], 
                                  LOGICAL(asMates)[0], 
                                  qname_prefix, qname_suffix, (void *) sbd);
+    bd->core_only = _core_only_BAM_DATA(bd, space, template_list);
+    _max_mate_memory(bd, maxMateMemory);
 
-    int status = _do_scan_bam(bd, space, _filter_and_parse1,
-                              _filter_and_parse1_mate, _finish1range_BAM_DATA);
+    int status;
+    if (_scan_bam_yield_ok(bd, space)) {
+        SEXP key = PROTECT(NEW_LIST(YIELD_N));
+        SET_VECTOR_ELT(key, YIELD_KEEPFLAGS, keepFlags);
+        SET_VECTOR_ELT(key, YIELD_SIMPLECIGAR, isSimpleCigar);
+        SET_VECTOR_ELT(key, YIELD_MAPQFILTER, mapqFilter);
+        SET_VECTOR_ELT(key, YIELD_FILTEREXPR, filterExpr);
+        SET_VECTOR_ELT(key, YIELD_YIELDSIZE, yieldSize);
+        SET_VECTOR_ELT(key, YIELD_COREONLY, ScalarInteger(bd->core_only));
+        status = _scan_bam_yield(bfile, key, bd, _filter_and_parse1,
+                                 _finish1range_BAM_DATA);
+        UNPROTECT(1);
+    } else
+        status = _do_scan_bam(bd, space, _filter_and_parse1,
+                              _filter_and_parse1_mate,
+                              _finish1range_BAM_DATA);
     if (status < 0) {
         int idx = bd->irec;
         int parse_status = bd->parse_status;
+        const char *failure = bd->failure;
         _Free_SCAN_BAM_DATA(bd->extra);
         _Free_BAM_DATA(bd);
+        if (NULL != failure)
+            Rf_error("'scanBam' failed:\n  record: %d\n  error: %s",
+                     idx, failure);
         Rf_error("'scanBam' failed:\n  record: %d\n  error: %d",
                  idx, parse_status);
     }
@@ -518,12 +832,14 @@ static int _count1(const bam1_t * bam, void *data)
 }
 
 SEXP _count_bam(SEXP bfile, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
-                SEXP tagFilter, SEXP mapqFilter)
+                SEXP tagFilter, SEXP mapqFilter, SEXP filterExpr)
 {
     SEXP result = PROTECT(NEW_LIST(2));
     BAM_DATA bd =
         _init_BAM_DATA(bfile, space, keepFlags, isSimpleCigar, tagFilter,
-                       mapqFilter, 0, NA_INTEGER, 0, 0, '\0', '\0', result);
+                       mapqFilter, filterExpr, 0, NA_INTEGER, 0, 0, '\0', '\0',
+                       result);
+    bd->core_only = _core_only_BAM_DATA(bd, space, R_NilValue);
 
     SET_VECTOR_ELT(result, 0, NEW_INTEGER(bd->nrange));
     SET_VECTOR_ELT(result, 1, NEW_NUMERIC(bd->nrange));
@@ -552,6 +868,142 @@ SEXP _count_bam(SEXP bfile, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
     return result;
 }
 
+/* counts from the index */
+
+SEXP _idxstats_bam(SEXP ext)
+{
+    BAM_FILE bfile = BAMFILE(ext);
+    bam_header_t *header = bfile->file->header;
+    if (NULL == bfile->index)
+        Rf_error("valid 'index' file required");
+
+    const int n = header->n_targets;
+    SEXP result = PROTECT(NEW_LIST(2));
+    SET_VECTOR_ELT(result, 0, NEW_NUMERIC(n + 1));
+    SET_VECTOR_ELT(result, 1, NEW_NUMERIC(n + 1));
+    double *mapped = REAL(VECTOR_ELT(result, 0)),
+        *unmapped = REAL(VECTOR_ELT(result, 1));
+    for (int i = 0; i < n; ++i) {
+        uint64_t m = 0, u = 0;
+        bam_index_stats(bfile->index, i, &m, &u);
+        mapped[i] = m;
+        unmapped[i] = u;
+    }
+    mapped[n] = 0;              /* '*': no coordinate */
+    unmapped[n] = bam_index_no_coor(bfile->index);
+
+    SEXP nms = PROTECT(NEW_CHARACTER(2));
+    SET_STRING_ELT(nms, 0, mkChar("mapped"));
+    SET_STRING_ELT(nms, 1, mkChar("unmapped"));
+    setAttrib(result, R_NamesSymbol, nms);
+    UNPROTECT(2);
+    return result;
+}
+
+/* records and nucleotides of tid:beg-end; exact for whole references,
+   from the index counts and an estimated mean query length */
+static int _count1_approximate(bamFile fp, bam_index_t *idx,
+                               bam_header_t *header, int tid, int beg,
+                               int end, double *n_rec, double *n_nuc)
+{
+    uint64_t mapped, unmapped;
+
+    if (beg > 0 || end < header->target_len[tid] ||
+        0 != bam_index_stats(idx, tid, &mapped, &unmapped))
+        return bam_estimate(fp, idx, tid, beg, end, n_rec, n_nuc);
+
+    double r_est, n_est;
+    int status = bam_estimate(fp, idx, tid, 0, header->target_len[tid],
+                              &r_est, &n_est);
+    if (status < 0)
+        return status;
+    *n_rec = mapped + unmapped;
+    *n_nuc = r_est > 0 ? n_est * *n_rec / r_est : 0;
+    return status;
+}
+
+/* integer, as countBam(); NA beyond the integer range */
+static int _count_as_integer(double n_rec)
+{
+    return n_rec < INT_MAX ? (int) (n_rec + .5) : NA_INTEGER;
+}
+
+SEXP _count_bam_approximate(SEXP ext, SEXP space)
+{
+    BAM_FILE bfile = BAMFILE(ext);
+    bamFile fp = bfile->file->x.bam;
+    bam_header_t *header = bfile->file->header;
+    bam_index_t *idx = bfile->index;
+    if (NULL == idx)
+        Rf_error("valid 'index' file required");
+
+    const int n = R_NilValue == space ? 1 : LENGTH(VECTOR_ELT(space, 0));
+    SEXP result = PROTECT(NEW_LIST(2));
+    SET_VECTOR_ELT(result, 0, NEW_INTEGER(n));
+    SET_VECTOR_ELT(result, 1, NEW_NUMERIC(n));
+    int *records = INTEGER(VECTOR_ELT(result, 0));
+    double *nucleotides = REAL(VECTOR_ELT(result, 1));
+
+    /* sampling moves the handle; restore it for scans in progress,
+       also before reporting an error */
+    int64_t offset = bam_tell(fp);
+    if (R_NilValue == space) {
+        /* once for the file; per reference for small files or indices
+           without counts */
+        double n_rec = 0, n_nuc = 0;
+        int status = bam_estimate_file(fp, idx, &n_rec, &n_nuc);
+        if (status < -1) {
+            bam_seek(fp, offset, SEEK_SET);
+            Rf_error("'countBam' failed to read file");
+        }
+        for (int tid = 0; -1 == status && tid < header->n_targets; ++tid) {
+            double r, u;
+            if (_count1_approximate(fp, idx, header, tid, 0,
+                                    header->target_len[tid], &r, &u) < 0) {
+                bam_seek(fp, offset, SEEK_SET);
+                Rf_error("'countBam' failed to read '%s'",
+                         header->target_name[tid]);
+            }
+            n_rec += r;
+            n_nuc += u;
+        }
+        /* unplaced reads: the mean query length of the placed */
+        double no_coor = bam_index_no_coor(idx);
+        records[0] = _count_as_integer(n_rec + no_coor);
+        nucleotides[0] = n_nuc + (n_rec > 0 ? no_coor * n_nuc / n_rec : 0);
+    } else {
+        SEXP seqnames = VECTOR_ELT(space, 0);
+        const int *start = INTEGER(VECTOR_ELT(space, 1)),
+            *end = INTEGER(VECTOR_ELT(space, 2));
+        bam_init_header_hash(header);
+        for (int i = 0; i < n; ++i) {
+            const char *seqname = translateChar(STRING_ELT(seqnames, i));
+            int tid = bam_get_tid(header, seqname);
+            double r, u;
+            if (tid < 0) {
+                bam_seek(fp, offset, SEEK_SET);
+                Rf_error("'%s' not in BAM header", seqname);
+            }
+            if (_count1_approximate(fp, idx, header, tid,
+                                    start[i] > 0 ? start[i] - 1 : 0, end[i],
+                                    &r, &u) < 0) {
+                bam_seek(fp, offset, SEEK_SET);
+                Rf_error("'countBam' failed to read '%s'", seqname);
+            }
+            records[i] = _count_as_integer(r);
+            nucleotides[i] = u;
+        }
+    }
+    bam_seek(fp, offset, SEEK_SET);
+
+    SEXP nms = PROTECT(NEW_CHARACTER(2));
+    SET_STRING_ELT(nms, 0, mkChar("records"));
+    SET_STRING_ELT(nms, 1, mkChar("nucleotides"));
+    setAttrib(result, R_NamesSymbol, nms);
+    UNPROTECT(2);
+    return result;
+}
+
 void scan_bam_cleanup()
 {
     /* placeholder */
@@ -590,9 +1042,10 @@ static int _prefilter1_mate(const bam_mates_t *mates, void *data)
 
 SEXP
 _prefilter_bam(SEXP bfile, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
-               SEXP tagFilter, SEXP mapqFilter, SEXP yieldSize, SEXP obeyQname,
-               SEXP asMates, 
-               SEXP qnamePrefixEnd, SEXP qnameSuffixStart)
+               SEXP tagFilter, SEXP mapqFilter, SEXP filterExpr,
+               SEXP yieldSize, SEXP obeyQname, SEXP asMates,
+               SEXP qnamePrefixEnd, SEXP qnameSuffixStart,
+               SEXP maxMateMemory)
 {
     SEXP ext = PROTECT(bambuffer(INTEGER(yieldSize)[0],
                                  LOGICAL(asMates)[0]));
@@ -605,17 +1058,23 @@ _prefilter_bam(SEXP bfile, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
     if (suffix_elt != NA_STRING)
         qname_suffix = CHAR(suffix_elt)[0];
     BAM_DATA bd = _init_BAM_DATA(bfile, space, keepFlags, isSimpleCigar,
-                                 tagFilter, mapqFilter, 0, INTEGER(yieldSize)[0],
+                                 tagFilter, mapqFilter, filterExpr, 0,
+                                 INTEGER(yieldSize)[0],
                                  LOGICAL(obeyQname)[0], 
                                  LOGICAL(asMates)[0], 
                                  qname_prefix, qname_suffix, BAMBUFFER(ext));
+    _max_mate_memory(bd, maxMateMemory);
     int status =
         _do_scan_bam(bd, space, _prefilter1, _prefilter1_mate, NULL);
     if (status < 0) {
         int idx = bd->irec;
         int parse_status = bd->parse_status;
+        const char *failure = bd->failure;
         _Free_BAM_DATA(bd);
         UNPROTECT(1);
+        if (NULL != failure)
+            Rf_error("'filterBam' prefilter failed:\n  record: %d\n  error: %s",
+                     idx, failure);
         Rf_error("'filterBam' prefilter failed:\n  record: %d\n  error: %d",
                  idx, parse_status);
     }
@@ -639,12 +1098,12 @@ static int _filter1(const bam1_t * bam, void *data)
 SEXP
 _filter_bam(SEXP bfile, SEXP space, SEXP keepFlags,
             SEXP isSimpleCigar, SEXP tagFilter, SEXP mapqFilter,
-            SEXP fout_name, SEXP fout_mode)
+            SEXP filterExpr, SEXP fout_name, SEXP fout_mode)
 {
     /* open destination */
     BAM_DATA bd =
         _init_BAM_DATA(bfile, space, keepFlags, isSimpleCigar,
-                       tagFilter, mapqFilter, 0,
+                       tagFilter, mapqFilter, filterExpr, 0,
                        NA_INTEGER, 0, 0, '\0', '\0', NULL);
     /* FIXME: this just copies the header... */
     bam_header_t *header = BAMFILE(bfile)->file->header;
@@ -21,18 +21,22 @@ void _bam_check_template_list(SEXP template_list);
 SEXP _read_bam_header(SEXP ext, SEXP what);
 SEXP _scan_bam(SEXP bfile, SEXP space, SEXP keepFlags,
                SEXP isSimpleCigar, SEXP tagFilter, SEXP mapqFilter,
-               SEXP reverseComplement, SEXP yieldSize,
+               SEXP filterExpr, SEXP reverseComplement, SEXP yieldSize,
                SEXP template_list, SEXP obeyQname, SEXP asMates,
-               SEXP qnamePrefixEnd, SEXP qnameSuffixStart);
+               SEXP qnamePrefixEnd, SEXP qnameSuffixStart,
+               SEXP maxMateMemory);
 SEXP _count_bam(SEXP bfile, SEXP space, SEXP keepFlags, SEXP isSimpleCigar,
-                SEXP tagFilter, SEXP mapqFilter);
+                SEXP tagFilter, SEXP mapqFilter, SEXP filterExpr);
+SEXP _idxstats_bam(SEXP ext);
+SEXP _count_bam_approximate(SEXP ext, SEXP space);
 SEXP _prefilter_bam(SEXP bfile, SEXP space, SEXP keepFlags,
 		    SEXP isSimpleCigar, SEXP tagFilter, SEXP mapqFilter,
-                    SEXP yieldSize, SEXP obeyQname, SEXP asMates,
-                    SEXP qnamePrefixEnd, SEXP qnameSuffixStart);
+                    SEXP filterExpr, SEXP yieldSize, SEXP obeyQname, SEXP asMates,
+                    SEXP qnamePrefixEnd, SEXP qnameSuffixStart,
+                    SEXP maxMateMemory);
 SEXP _filter_bam(SEXP bfile, SEXP space, SEXP keepFlags,
                  SEXP isSimpleCigar, SEXP tagFilter, SEXP mapqFilter,
-                 SEXP fout_name, SEXP fout_mode);
+                 SEXP filterExpr, SEXP fout_name, SEXP fout_mode);
 
 typedef void (_FINISH1_FUNC) (BAM_DATA);
 int _do_scan_bam(BAM_DATA bd, SEXP space, bam_fetch_f parse1,
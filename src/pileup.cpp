@@ -42,7 +42,7 @@ static void _finish_buffered_yieldSize_chunk(BAM_DATA bd) {
 
 static SEXP _pileup_bam(SEXP ext, SEXP space, SEXP keepFlags,
     SEXP reverseComplement, SEXP isSimpleCigar,
-    SEXP tagFilter, SEXP mapqFilter,
+    SEXP tagFilter, SEXP mapqFilter, SEXP filterExpr,
     SEXP yieldSize, SEXP obeyQname, SEXP asMates, SEXP qnamePrefixEnd,
     SEXP qnameSuffixStart, PileupBuffer& buffer)
 {
@@ -58,7 +58,7 @@ static SEXP _pileup_bam(SEXP ext, SEXP space, SEXP keepFlags,
     SEXP result = PROTECT(_pileup_bam_result_init(space));
     PileupBufferShim shim(space, result, buffer);
     BAM_DATA bd = _init_BAM_DATA(ext, space, keepFlags, isSimpleCigar,
-                                 tagFilter, mapqFilter,
+                                 tagFilter, mapqFilter, filterExpr,
                                  LOGICAL(reverseComplement)[0],
                                  INTEGER(yieldSize)[0],
                                  LOGICAL(obeyQname)[0], 
@@ -130,7 +130,7 @@ class PosCacheColl;
 extern "C" {
     SEXP c_Pileup(SEXP ext, SEXP space, SEXP keepFlags,
                   SEXP isSimpleCigar, SEXP tagFilter, SEXP mapqFilter,
-                  SEXP reverseComplement, SEXP yieldSize,
+                  SEXP filterExpr, SEXP reverseComplement, SEXP yieldSize,
                   SEXP obeyQname, SEXP asMates,
                   SEXP qnamePrefixEnd, SEXP qnameSuffixStart, 
                   SEXP schema, SEXP pileupParams)
@@ -157,6 +157,7 @@ extern "C" {
                    (PosCacheColl**)&(BAMFILE(ext)->pbuffer));
         SEXP res = PROTECT(_pileup_bam(ext, space, keepFlags,
             reverseComplement, isSimpleCigar, tagFilter, mapqFilter,
+            filterExpr,
             yieldSize, obeyQname,
             asMates, qnamePrefixEnd, qnameSuffixStart, buffer));
         UNPROTECT(2);
@@ -2,6 +2,7 @@
 #include "samtools/khash.h"
 #include "pileupbam.h"
 #include "bamfile.h"
+#include "filter_expr.h"
 #include "utilities.h"
 
 typedef enum {
@@ -19,6 +20,7 @@ typedef struct {
     /* read filter params */
     int min_map_quality;
     uint32_t keep_flag[2];
+    FILTER_EXPR filterexpr;     /* shared by all files; NULL if none */
 } BAM_ITER_T;
 
 typedef struct {
@@ -50,6 +52,7 @@ typedef struct {
     SEXP names;
     int min_base_quality, min_map_quality, min_depth, max_depth;
     uint32_t keep_flag[2];
+    FILTER_EXPR filterexpr;
     int yieldSize, yieldAll;
     YIELDBY yieldBy;
     int what;
@@ -91,6 +94,7 @@ static PILEUP_ITER_T *_iter_init(SEXP files, PILEUP_PARAM_T * param)
         iter->mfile[i]->min_map_quality = param->min_map_quality;
         iter->mfile[i]->keep_flag[0] = param->keep_flag[0];
         iter->mfile[i]->keep_flag[1] = param->keep_flag[1];
+        iter->mfile[i]->filterexpr = param->filterexpr;
         /* header hash destroyed when file closed */
         _bam_header_hash_init(iter->mfile[i]->bfile->file->header);
     }
@@ -197,23 +201,38 @@ static int _mplp_read_bam(void *data, bam1_t * b)
     BAM_ITER_T *mdata = (BAM_ITER_T *) data;
     uint32_t test_flag;
     int skip, result;
+    bam1_t v;                   /* filter on a view; copy only records kept */
 
     do {
         result = mdata->iter ?
-            bam_iter_read(mdata->fp, mdata->iter, b) : bam_read1(mdata->fp, b);
+            bam_iter_read_view(mdata->fp, mdata->iter, &v, b) :
+            bam_read1_view(mdata->fp, &v, b);
         if (0 >= result)
             break;
 
         skip = FALSE;
-        test_flag = (mdata->keep_flag[0] & ~b->core.flag) |
-            (mdata->keep_flag[1] & b->core.flag);
+        test_flag = (mdata->keep_flag[0] & ~v.core.flag) |
+            (mdata->keep_flag[1] & v.core.flag);
         if (~test_flag & 2047u)
             skip = TRUE;
-        else if (b->core.tid < 0 || (b->core.flag & BAM_FUNMAP))
+        else if (v.core.tid < 0 || (v.core.flag & BAM_FUNMAP))
             skip = TRUE;
-        else if (b->core.qual < mdata->min_map_quality)
+        else if (v.core.qual < mdata->min_map_quality)
+            skip = TRUE;
+        else if (mdata->filterexpr != NULL &&
+                 !_filter_expr_eval(mdata->filterexpr, &v))
             skip = TRUE;
     } while (skip);
+
+    if (0 < result) {
+        if (v.data != b->data)
+            bam_copy1(b, &v);
+        else {                  /* already copied to b, across blocks */
+            b->core = v.core;
+            b->data_len = v.data_len;
+            b->l_aux = v.l_aux;
+        }
+    }
     return result;
 }
 
@@ -699,6 +718,8 @@ SEXP apply_pileups(SEXP files, SEXP names, SEXP space, SEXP param,
     if (what[1])
         p.what |= WHAT_QUAL;
 
+    p.filterexpr = _filter_expr_new(_lst_elt(param, "filterExpr", "param"));
+
     /* data -- validate */
     plp_iter = _iter_init(files, &p);
 
@@ -718,6 +739,7 @@ SEXP apply_pileups(SEXP files, SEXP names, SEXP space, SEXP param,
 
     _iter_destroy(plp_iter);
     _space_iter_destroy(spc_iter);
+    _filter_expr_free(p.filterexpr);
     UNPROTECT(1);
 
     return result;
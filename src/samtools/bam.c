@@ -188,20 +188,20 @@ static void swap_endian_data(const bam1_core_t *c, int data_len, uint8_t *data)
 	}
 }
 
-int bam_read1(bamFile fp, bam1_t *b)
+// read the block length and the fixed-length fields of a record
+static int bam_read1_core(bamFile fp, bam1_core_t *c, int32_t *block_len)
 {
-	bam1_core_t *c = &b->core;
-	int32_t block_len, ret, i;
+	int32_t ret, i;
 	uint32_t x[8];
 
 	assert(BAM_CORE_SIZE == 32);
-	if ((ret = bam_read(fp, &block_len, 4)) != 4) {
+	if ((ret = bam_read(fp, block_len, 4)) != 4) {
 		if (ret == 0) return -1; // normal end-of-file
 		else return -2; // truncated
 	}
 	if (bam_read(fp, x, BAM_CORE_SIZE) != BAM_CORE_SIZE) return -3;
 	if (bam_is_be) {
-		bam_swap_endian_4p(&block_len);
+		bam_swap_endian_4p(block_len);
 		for (i = 0; i < 8; ++i) bam_swap_endian_4p(x + i);
 	}
 	c->tid = x[0]; c->pos = x[1];
@@ -209,6 +209,15 @@ int bam_read1(bamFile fp, bam1_t *b)
 	c->flag = x[3]>>16; c->n_cigar = x[3]&0xffff;
 	c->l_qseq = x[4];
 	c->mtid = x[5]; c->mpos = x[6]; c->isize = x[7];
+	return 0;
+}
+
+int bam_read1(bamFile fp, bam1_t *b)
+{
+	bam1_core_t *c = &b->core;
+	int32_t block_len, ret;
+
+	if ((ret = bam_read1_core(fp, c, &block_len)) < 0) return ret;
 	b->data_len = block_len - BAM_CORE_SIZE;
 	if (b->m_data < b->data_len) {
 		b->m_data = b->data_len;
@@ -222,6 +231,135 @@ int bam_read1(bamFile fp, bam1_t *b)
 	return 4 + block_len;
 }
 
+int bam_read1_view(bamFile fp, bam1_t *v, bam1_t *b)
+{
+	int ret;
+#ifndef BAM_LITE
+	if (!bam_is_be && !bam_no_B) { // the record is used as stored
+		bam1_core_t *c = &v->core;
+		int32_t block_len;
+		const uint8_t *data;
+		if ((ret = bam_read1_core(fp, c, &block_len)) < 0) return ret;
+		v->data_len = block_len - BAM_CORE_SIZE;
+		v->m_data = 0;
+		if ((data = (const uint8_t*)bgzf_read_view(fp, v->data_len)) != 0) {
+			v->data = (uint8_t*)data;
+		} else { // across a block boundary
+			if (b->m_data < v->data_len) {
+				b->m_data = v->data_len;
+				kroundup32(b->m_data);
+				b->data = (uint8_t*)realloc(b->data, b->m_data);
+			}
+			if (bam_read(fp, b->data, v->data_len) != v->data_len) return -4;
+			v->data = b->data;
+		}
+		v->l_aux = v->data_len - c->n_cigar * 4 - c->l_qname - c->l_qseq - (c->l_qseq+1)/2;
+		return 4 + block_len;
+	}
+#endif
+	if ((ret = bam_read1(fp, b)) >= 0) {
+		*v = *b;
+		v->m_data = 0;
+	}
+	return ret;
+}
+
+int bam_read1_core_only(bamFile fp, bam1_t *b)
+{
+	int ret;
+#ifndef BAM_LITE
+	int32_t block_len;
+	bam1_core_t *c = &b->core;
+	if ((ret = bam_read1_core(fp, c, &block_len)) < 0) return ret;
+	if (bgzf_skip(fp, block_len - BAM_CORE_SIZE) != block_len - BAM_CORE_SIZE) return -4;
+	b->data_len = b->l_aux = 0;
+	return 4 + block_len;
+#else
+	if ((ret = bam_read1(fp, b)) >= 0) b->data_len = b->l_aux = 0;
+	return ret;
+#endif
+}
+
+bam_batch_t *bam_batch_init(void)
+{
+	return (bam_batch_t*)calloc(1, sizeof(bam_batch_t));
+}
+
+void bam_batch_destroy(bam_batch_t *batch)
+{
+	if (batch == 0) return;
+	free(batch->rec);
+	free(batch->voffset);
+	free(batch->arena);
+	free(batch);
+}
+
+void bam_batch_clear(bam_batch_t *batch)
+{
+	batch->n = 0;
+	batch->l_arena = 0;
+	batch->ret = 0;
+}
+
+bam1_t *bam_batch_push(bam_batch_t *batch, const bam1_t *b)
+{
+	bam1_t *r;
+	if (batch->n == batch->m) {
+		batch->m = batch->m? batch->m << 1 : 64;
+		batch->rec = (bam1_t*)realloc(batch->rec, batch->m * sizeof(bam1_t));
+		batch->voffset = (int64_t*)realloc(batch->voffset, batch->m * sizeof(int64_t));
+	}
+	if (batch->l_arena + b->data_len > batch->m_arena) {
+		size_t off = 0;
+		int i;
+		batch->m_arena = batch->l_arena + b->data_len;
+		kroundup32(batch->m_arena);
+		batch->arena = (uint8_t*)realloc(batch->arena, batch->m_arena);
+		for (i = 0; i < batch->n; ++i) { // rebase the records already in the arena, which lie one after the other
+			batch->rec[i].data = batch->arena + off;
+			off += batch->rec[i].data_len;
+		}
+	}
+	r = &batch->rec[batch->n];
+	*r = *b;
+	r->data = batch->arena + batch->l_arena;
+	r->m_data = 0;
+	memcpy(r->data, b->data, b->data_len);
+	batch->l_arena += b->data_len;
+	batch->voffset[batch->n++] = -1;
+	return r;
+}
+
+int bam_read_batch(bamFile fp, bam_batch_t *batch, int n)
+{
+	bam1_t v, b;
+	memset(&b, 0, sizeof(bam1_t));
+	bam_batch_clear(batch);
+	while (batch->n < n && (batch->ret = bam_read1_view(fp, &v, &b)) >= 0) {
+		bam_batch_push(batch, &v);
+#ifndef BAM_LITE
+		batch->voffset[batch->n - 1] = bam_tell(fp);
+#endif
+	}
+	free(b.data);
+	return batch->n;
+}
+
+int bam_read_batch_core_only(bamFile fp, bam_batch_t *batch, int n)
+{
+	bam1_t b;
+	memset(&b, 0, sizeof(bam1_t));
+	bam_batch_clear(batch);
+	while (batch->n < n && (batch->ret = bam_read1_core_only(fp, &b)) >= 0) {
+		bam_batch_push(batch, &b);
+#ifndef BAM_LITE
+		batch->voffset[batch->n - 1] = bam_tell(fp);
+#endif
+	}
+	free(b.data);
+	return batch->n;
+}
+
 inline int bam_write1_core(bamFile fp, const bam1_core_t *c, int data_len, uint8_t *data)
 {
 	uint32_t x[8], block_len = data_len + BAM_CORE_SIZE, y;
@@ -208,6 +208,29 @@ typedef struct {
 	uint8_t *data;
 } bam1_t;
 
+/*! @typedef
+  @abstract Structure for a batch of alignments sharing one buffer.
+  @field  n       number of alignments
+  @field  m       number of alignments allocated
+  @field  rec     the alignments; rec[i].data points into arena and is not owned
+  @field  voffset virtual file offset following each alignment, when read from a file
+  @field  l_arena length of the arena in use
+  @field  m_arena size of the arena
+  @field  arena   variable-length data of all alignments, one after the other
+  @field  ret     return value of the last read, as for bam_read1()
+
+  @discussion Adding an alignment may move the arena and rec, so that
+  pointers to alignments are valid only until the next addition.
+ */
+typedef struct {
+	int n, m;
+	bam1_t *rec;
+	int64_t *voffset;
+	size_t l_arena, m_arena;
+	uint8_t *arena;
+	int ret;
+} bam_batch_t;
+
 typedef struct __bam_iter_t *bam_iter_t;
 
 #define bam1_strand(b) (((b)->core.flag&BAM_FREVERSE) != 0)
@@ -358,6 +381,8 @@ extern "C" {
 	  be destroyed in the first place.
 	 */
 	int sam_header_parse(bam_header_t *h);
+	/* build the name -> tid hash used by bam_get_tid(), if not yet built */
+	void bam_init_header_hash(bam_header_t *header);
 	int32_t bam_get_tid(const bam_header_t *header, const char *seq_name);
 
 	/*!
@@ -436,6 +461,58 @@ extern "C" {
 	 */
 	int bam_read1(bamFile fp, bam1_t *b);
 
+	/*!
+	  @abstract   Read an alignment from BAM without copying it, if possible.
+	  @param  fp  BAM file handler
+	  @param  v   view of the alignment: core is filled in and data
+	              points either into the uncompressed BGZF block or to
+	              b->data; v does not own data and must not be modified,
+	              passed to bam_destroy1() or read into with bam_read1()
+	  @param  b   alignment holding a copy of records that cross a
+	              block boundary (or, for big-endian machines and
+	              bam_no_B, of every record)
+	  @return     as bam_read1()
+
+	  @discussion The view is valid until the next read from fp.
+	 */
+	int bam_read1_view(bamFile fp, bam1_t *v, bam1_t *b);
+
+	/*!
+	  @abstract Read the fixed-length fields of an alignment, skipping
+	  its variable-length data (query name, CIGAR, sequence, quality
+	  and auxiliary fields) without copying it.
+	  @param  fp  BAM file handler
+	  @param  b   read alignment; b->data is not used and b->data_len is 0
+	  @return     as bam_read1()
+	 */
+	int bam_read1_core_only(bamFile fp, bam1_t *b);
+
+	bam_batch_t *bam_batch_init(void);
+	void bam_batch_destroy(bam_batch_t *batch);
+
+	/*! @abstract Remove all alignments from the batch, keeping its memory. */
+	void bam_batch_clear(bam_batch_t *batch);
+
+	/*!
+	  @abstract     Append a copy of an alignment to the batch
+	  @param  batch the batch
+	  @param  b     alignment to copy
+	  @return       the copy, in the batch
+	 */
+	bam1_t *bam_batch_push(bam_batch_t *batch, const bam1_t *b);
+
+	/*!
+	  @abstract     Read up to n alignments into a cleared batch
+	  @param  fp    BAM file handler
+	  @param  batch the batch; batch->ret is the return value of the last
+	                bam_read1(), negative at end-of-file (-1) or on error
+	  @param  n     maximum number of alignments to read
+	  @return       number of alignments read
+	 */
+	int bam_read_batch(bamFile fp, bam_batch_t *batch, int n);
+	/* as bam_read_batch(), reading alignments with bam_read1_core_only() */
+	int bam_read_batch_core_only(bamFile fp, bam_batch_t *batch, int n);
+
 	int bam_remove_B(bam1_t *b);
 
 	/*!
@@ -631,7 +708,8 @@ extern "C" {
 	  specified region.
 
 	  @discussion A user defined function will be called for each
-	  retrieved alignment ordered by its start position.
+	  retrieved alignment ordered by its start position. The alignment
+	  is a view (see bam_read1_view()), valid only during the call.
 
 	  @param  fp    BAM file handler
 	  @param  idx   pointer to the alignment index
@@ -645,8 +723,161 @@ extern "C" {
 
 	bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end);
 	int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b);
+	/* as bam_iter_read(), reading a view of each alignment with bam_read1_view() */
+	int bam_iter_read_view(bamFile fp, bam_iter_t iter, bam1_t *v, bam1_t *b);
+	/* as bam_read_batch(), for the alignments of an iterator */
+	int bam_iter_read_batch(bamFile fp, bam_iter_t iter, bam_batch_t *batch, int n);
 	void bam_iter_destroy(bam_iter_t iter);
 
+	/*!
+	  @abstract Announce the regions that subsequent bam_fetch() or
+	  bam_iter_read() calls will visit, in that order, so that their
+	  blocks can be read and inflated in the background.
+
+	  @discussion See bgzf_prefetch(): with read-ahead threads
+	  (bgzf_mt()) the blocks are read and inflated in the background,
+	  otherwise the kernel is asked to read them ahead. Regions with
+	  tid < 0 are skipped. Results of later queries do not depend on
+	  the plan.
+
+	  @param  fp    BAM file handler
+	  @param  idx   pointer to the alignment index
+	  @param  n     number of regions
+	  @param  tid   chromosome IDs of the regions
+	  @param  beg   start coordinates, 0-based
+	  @param  end   end coordinates, 0-based
+	  @return       0 on success; -1 if the file cannot prefetch
+	 */
+	int bam_prefetch(bamFile fp, const bam_index_t *idx, int n, const int *tid, const int *beg, const int *end);
+
+	/*!
+	  @abstract Fetch the alignments of many regions, reading each
+	  compressed block once.
+
+	  @discussion The chunks of all regions are merged into one ordered
+	  sweep, announced with bgzf_prefetch(); each alignment read is
+	  added to the batch of every region it overlaps. batch[i] then
+	  holds the alignments bam_fetch() reports for region i, in the
+	  same order. Regions with tid < 0 are empty.
+
+	  @param  fp     BAM file handler
+	  @param  idx    pointer to the alignment index
+	  @param  n      number of regions
+	  @param  tid    chromosome IDs of the regions
+	  @param  beg    start coordinates, 0-based
+	  @param  end    end coordinates, 0-based
+	  @param  batch  _n_ batches, cleared and filled region by region
+	  @return        0 on success; < -1 on error
+	 */
+	int bam_fetch_regions(bamFile fp, const bam_index_t *idx, int n, const int *tid, const int *beg, const int *end, bam_batch_t **batch);
+
+	/*!
+	  @abstract Split the alignments after a virtual offset into about
+	  _n_ parts of similar compressed size.
+
+	  @discussion Split points are taken from the linear index and the
+	  reference ends recorded in the index, so each is the virtual
+	  offset of an alignment. The last part runs to the end of the
+	  file, including unmapped alignments without coordinate.
+
+	  @param  idx    pointer to the alignment index
+	  @param  beg    virtual offset of the first alignment
+	  @param  n      number of parts
+	  @param  split  at least n-1 elements; filled with increasing
+	                 virtual offsets > beg
+	  @return        number of split points, at most n-1
+	 */
+	int bam_index_split(const bam_index_t *idx, uint64_t beg, int n, uint64_t *split);
+
+	/*!
+	  @abstract Mapped and unmapped alignments placed on a reference,
+	  as recorded in the index (samtools idxstats).
+
+	  @return   0 on success; -1 if the index has no counts for _tid_
+	 */
+	int bam_index_stats(const bam_index_t *idx, int tid, uint64_t *mapped, uint64_t *unmapped);
+
+	/*! @abstract Unmapped alignments without coordinate, as recorded in the index. */
+	uint64_t bam_index_no_coor(const bam_index_t *idx);
+
+	/*!
+	  @abstract Estimate the alignments overlapping a region, and their
+	  total query length, from a few blocks of the file.
+
+	  @discussion The linear index bounds the part of the file holding
+	  the region. Alignments per uncompressed byte, and the compression
+	  ratio, are sampled from one block at each of four linear index
+	  offsets spread over that part, and scaled to its compressed size.
+	  Regions spanning less than 256 kb of compressed data are counted
+	  exactly.
+
+	  @param  fp     BAM file handler
+	  @param  idx    pointer to the alignment index
+	  @param  tid    chromosome ID
+	  @param  beg    start coordinate, 0-based
+	  @param  end    end coordinate, 0-based
+	  @param  n_rec  estimated number of alignments
+	  @param  n_nuc  estimated sum of their query lengths
+	  @return        1 if the counts are exact, 0 if estimated; < -1 on error
+	 */
+	int bam_estimate(bamFile fp, const bam_index_t *idx, int tid, int beg, int end, double *n_rec, double *n_nuc);
+
+	/*!
+	  @abstract Estimate the placed alignments of the whole file, and
+	  their total query length.
+
+	  @discussion The alignments are counted from the index metadata;
+	  the mean query length is sampled once for the file, from one
+	  block at each of 16 linear index offsets spread over all
+	  references. Files spanning less than 256 kb of compressed data,
+	  and indices without metadata, are left to per-reference
+	  bam_estimate().
+
+	  @param  fp     BAM file handler
+	  @param  idx    pointer to the alignment index
+	  @param  n_rec  number of alignments
+	  @param  n_nuc  estimated sum of their query lengths
+	  @return        0 if estimated, 1 if exact; -1 if not estimated; < -1 on error
+	 */
+	int bam_estimate_file(bamFile fp, const bam_index_t *idx, double *n_rec, double *n_nuc);
+
+	typedef struct __bam_mtfetch_t *bam_mtfetch_t;
+
+	/*!
+	  @abstract Fetch the alignments of many regions in parallel.
+
+	  @discussion Each of _n_threads_ workers opens its own handle on
+	  _fn_ and reads whole regions, in the order given and at most a
+	  few regions per thread ahead of the caller, with the shared
+	  index. bam_mtfetch_next() returns the regions in the order given,
+	  each holding the alignments bam_fetch() would report.
+
+	  @param  fn         name of the BAM file
+	  @param  idx        pointer to the alignment index; must outlive the fetch
+	  @param  n          number of regions
+	  @param  tid        chromosome IDs of the regions; no alignments where < 0
+	  @param  beg        start coordinates, 0-based
+	  @param  end        end coordinates, 0-based
+	  @param  n_threads  number of worker threads
+	  @return            the fetch; 0 for remote files or if no thread could be started
+	 */
+	bam_mtfetch_t bam_mtfetch_init(const char *fn, const bam_index_t *idx, int n, const int *tid, const int *beg, const int *end, int n_threads);
+
+	/*!
+	  @abstract Wait for the alignments of the next region.
+
+	  @discussion The batch is owned by the fetch and is valid until the
+	  next call.
+
+	  @param  mf   the fetch
+	  @param  ret  0 on success; -1 after the last region; < -1 on error
+	  @return      the alignments of the next region; 0 after the last
+	 */
+	bam_batch_t *bam_mtfetch_next(bam_mtfetch_t mf, int *ret);
+
+	/* stop the workers, e.g., before the last region, and free the fetch */
+	void bam_mtfetch_destroy(bam_mtfetch_t mf);
+
 	/*!
 	  @abstract       Parse a region in the format: "chr2:100,000-200,000".
 	  @discussion     bam_header_t::hash will be initialized if empty.
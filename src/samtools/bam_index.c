@@ -1,5 +1,7 @@
 #include <ctype.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include "bam.h"
 #include "khash.h"
 #include "ksort.h"
@@ -681,12 +683,18 @@ void bam_iter_destroy(bam_iter_t iter)
 	if (iter) { free(iter->off); free(iter); }
 }
 
-int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b)
+// read into _b_, or into the view _b_ if _buf_ is not NULL (see bam_read1_view())
+static inline int iter_read1(bamFile fp, bam1_t *b, bam1_t *buf)
+{
+	return buf? bam_read1_view(fp, b, buf) : bam_read1(fp, b);
+}
+
+static int iter_read(bamFile fp, bam_iter_t iter, bam1_t *b, bam1_t *buf)
 {
 	int ret;
 	if (iter && iter->finished) return -1;
 	if (iter == 0 || iter->from_first) {
-		ret = bam_read1(fp, b);
+		ret = iter_read1(fp, b, buf);
 		if (ret < 0 && iter) iter->finished = 1;
 		return ret;
 	}
@@ -701,7 +709,7 @@ int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b)
 			}
 			++iter->i;
 		}
-		if ((ret = bam_read1(fp, b)) >= 0) {
+		if ((ret = iter_read1(fp, b, buf)) >= 0) {
 			iter->curr_off = bam_tell(fp);
 			if (b->core.tid != iter->tid || b->core.pos >= iter->end) { // no need to proceed
 				ret = bam_validate1(NULL, b)? -1 : -5; // determine whether end of region or error
@@ -714,15 +722,482 @@ int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b)
 	return ret;
 }
 
+int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b)
+{
+	return iter_read(fp, iter, b, 0);
+}
+
+int bam_iter_read_view(bamFile fp, bam_iter_t iter, bam1_t *v, bam1_t *b)
+{
+	return iter_read(fp, iter, v, b);
+}
+
+int bam_iter_read_batch(bamFile fp, bam_iter_t iter, bam_batch_t *batch, int n)
+{
+	bam1_t v, b;
+	memset(&b, 0, sizeof(bam1_t));
+	bam_batch_clear(batch);
+	while (batch->n < n && (batch->ret = iter_read(fp, iter, &v, &b)) >= 0) {
+		bam_batch_push(batch, &v);
+		batch->voffset[batch->n - 1] = bam_tell(fp);
+	}
+	free(b.data);
+	return batch->n;
+}
+
 int bam_fetch(bamFile fp, const bam_index_t *idx, int tid, int beg, int end, void *data, bam_fetch_f func)
 {
 	int ret;
 	bam_iter_t iter;
-	bam1_t *b;
+	bam1_t *b, v;
 	b = bam_init1();
 	iter = bam_iter_query(idx, tid, beg, end);
-	while ((ret = bam_iter_read(fp, iter, b)) >= 0) func(b, data);
+	while ((ret = bam_iter_read_view(fp, iter, &v, b)) >= 0) func(&v, data);
 	bam_iter_destroy(iter);
 	bam_destroy1(b);
 	return (ret == -1)? 0 : ret;
 }
+
+int bam_prefetch(bamFile fp, const bam_index_t *idx, int n, const int *tid, const int *beg, const int *end)
+{
+	int i, j, n_plan = 0, m_plan = 0, ret;
+	int64_t *pbeg = 0, *pend = 0;
+	if (fp->is_write) return -1;
+	for (i = 0; i < n; ++i) {
+		bam_iter_t iter;
+		if (tid[i] < 0 || tid[i] >= idx->n) continue;
+		if ((iter = bam_iter_query(idx, tid[i], beg[i], end[i])) == 0) continue;
+		for (j = 0; j < iter->n_off; ++j) {
+			// compressed addresses of the first block, and past the last block, of the chunk
+			int64_t b = iter->off[j].u >> 16, e = (iter->off[j].v >> 16) + ((iter->off[j].v & 0xffff) != 0);
+			if (n_plan && b == pend[n_plan-1]) { // continues the previous range
+				pend[n_plan-1] = e;
+				continue;
+			}
+			// a range starting before the end of the previous one is kept apart: the reader seeks back to it
+			if (n_plan == m_plan) {
+				m_plan = m_plan? m_plan<<1 : 16;
+				pbeg = (int64_t*)realloc(pbeg, m_plan * sizeof(int64_t));
+				pend = (int64_t*)realloc(pend, m_plan * sizeof(int64_t));
+			}
+			pbeg[n_plan] = b; pend[n_plan++] = e;
+		}
+		bam_iter_destroy(iter);
+	}
+	ret = n_plan? bgzf_prefetch(fp, n_plan, pbeg, pend) : 0;
+	free(pbeg); free(pend);
+	return ret;
+}
+
+/* fetch of many regions in one sweep over the union of their chunks */
+
+typedef struct {
+	int tid, beg, end, i;
+} fetch_region_t;
+
+#define region_lt(a,b) ((a).tid < (b).tid || ((a).tid == (b).tid && (a).beg < (b).beg))
+KSORT_INIT(region, fetch_region_t, region_lt)
+
+int bam_fetch_regions(bamFile fp, const bam_index_t *idx, int n, const int *tid, const int *beg, const int *end, bam_batch_t **batch)
+{
+	fetch_region_t *reg;
+	pair64_t *off = 0;
+	int64_t *pbeg, *pend;
+	int i, j, l, lo, n_reg, n_off = 0, m_off = 0, ret = 0;
+	uint64_t curr_off;
+	bam1_t v, b;
+
+	for (i = 0; i < n; ++i) bam_batch_clear(batch[i]);
+	// regions sorted by position, and all their chunks
+	reg = (fetch_region_t*)calloc(n > 0? n : 1, sizeof(fetch_region_t));
+	for (i = n_reg = 0; i < n; ++i) {
+		bam_iter_t iter;
+		if (tid[i] < 0 || tid[i] >= idx->n || end[i] < beg[i]) continue;
+		if ((iter = bam_iter_query(idx, tid[i], beg[i], end[i])) == 0) continue;
+		reg[n_reg].tid = iter->tid; reg[n_reg].beg = iter->beg; reg[n_reg].end = iter->end;
+		reg[n_reg++].i = i;
+		if (n_off + iter->n_off > m_off) {
+			m_off = n_off + iter->n_off;
+			kroundup32(m_off);
+			off = (pair64_t*)realloc(off, m_off * sizeof(pair64_t));
+		}
+		memcpy(off + n_off, iter->off, iter->n_off * sizeof(pair64_t));
+		n_off += iter->n_off;
+		bam_iter_destroy(iter);
+	}
+	if (n_off == 0) {
+		free(reg); free(off);
+		return 0;
+	}
+	ks_introsort(region, n_reg, reg);
+	// union of the chunks, as in bam_iter_query()
+	ks_introsort(off, n_off, off);
+	for (i = 1, l = 0; i < n_off; ++i)
+		if (off[l].v < off[i].v) off[++l] = off[i];
+	n_off = l + 1;
+	for (i = 1; i < n_off; ++i)
+		if (off[i-1].v >= off[i].u) off[i-1].v = off[i].u;
+	// announce the sweep
+	pbeg = (int64_t*)malloc(n_off * sizeof(int64_t));
+	pend = (int64_t*)malloc(n_off * sizeof(int64_t));
+	for (i = 0; i < n_off; ++i) {
+		pbeg[i] = off[i].u >> 16;
+		pend[i] = (off[i].v >> 16) + ((off[i].v & 0xffff) != 0);
+	}
+	bgzf_prefetch(fp, n_off, pbeg, pend);
+	free(pbeg); free(pend);
+	// read each chunk once; route each alignment to the regions it overlaps
+	memset(&b, 0, sizeof(bam1_t));
+	curr_off = 0; lo = 0;
+	for (i = 0; i < n_off && lo < n_reg; ++i) {
+		if (curr_off != off[i].u) {
+			bam_seek(fp, off[i].u, SEEK_SET);
+			curr_off = bam_tell(fp);
+		}
+		while (curr_off < off[i].v) {
+			uint32_t rbeg, rend;
+			if ((ret = bam_read1_view(fp, &v, &b)) < 0) break;
+			curr_off = bam_tell(fp);
+			if (v.core.tid < 0) continue;
+			rbeg = v.core.pos;
+			rend = v.core.n_cigar? bam_calend(&v.core, bam1_cigar(&v)) : v.core.pos + 1;
+			// regions ending before this alignment end before all later ones
+			while (lo < n_reg && (reg[lo].tid < v.core.tid ||
+					(reg[lo].tid == v.core.tid && (uint32_t)reg[lo].end <= rbeg)))
+				++lo;
+			for (j = lo; j < n_reg && reg[j].tid == v.core.tid && (uint32_t)reg[j].beg < rend; ++j)
+				if (is_overlap(reg[j].beg, reg[j].end, &v))
+					bam_batch_push(batch[reg[j].i], &v);
+		}
+		if (ret < 0) break;
+	}
+	bgzf_prefetch(fp, 0, 0, 0);
+	free(b.data); free(reg); free(off);
+	return ret == -1? 0 : ret < 0? ret : 0;
+}
+
+#define split_lt(a,b) ((a) < (b))
+KSORT_INIT(split, uint64_t, split_lt)
+
+int bam_index_split(const bam_index_t *idx, uint64_t beg, int n, uint64_t *split)
+{
+	uint64_t *off = 0, lo, hi;
+	int i, j, k, m = 0, max = 0, n_split = 0;
+	if (n < 2) return 0;
+	// candidates: linear index offsets and reference ends (pseudo-bin), all record starts
+	for (i = 0; i < idx->n; ++i) {
+		const bam_lidx_t *l = &idx->index2[i];
+		khint_t kp = kh_get(i, idx->index[i], BAM_MAX_BIN);
+		for (j = 0; j <= l->n; ++j) {
+			uint64_t o;
+			if (j < l->n) o = l->offset[j];
+			else if (kp != kh_end(idx->index[i])) o = kh_val(idx->index[i], kp).list[0].v;
+			else continue;
+			if (o <= beg) continue;
+			if (m == max) {
+				max = max? max << 1 : 1024;
+				off = (uint64_t*)realloc(off, max * 8);
+			}
+			off[m++] = o;
+		}
+	}
+	if (m == 0) return 0;
+	ks_introsort(split, m, off);
+	// balance the parts by compressed offset
+	lo = beg >> 16; hi = off[m - 1] >> 16;
+	for (k = 1, j = 0; k < n && j < m; ++k) {
+		uint64_t target = lo + (hi - lo) * k / n;
+		while (j < m && ((off[j] >> 16) < target || (n_split > 0 && off[j] <= split[n_split - 1])))
+			++j;
+		if (j < m) split[n_split++] = off[j];
+	}
+	free(off);
+	return n_split;
+}
+
+int bam_index_stats(const bam_index_t *idx, int tid, uint64_t *mapped, uint64_t *unmapped)
+{
+	khint_t k;
+	*mapped = *unmapped = 0;
+	if (tid < 0 || tid >= idx->n) return -1;
+	k = kh_get(i, idx->index[tid], BAM_MAX_BIN);
+	if (k == kh_end(idx->index[tid]) || kh_val(idx->index[tid], k).n < 2) return -1;
+	*mapped = kh_val(idx->index[tid], k).list[1].u;
+	*unmapped = kh_val(idx->index[tid], k).list[1].v;
+	return 0;
+}
+
+uint64_t bam_index_no_coor(const bam_index_t *idx)
+{
+	return idx->n_no_coor;
+}
+
+#define BAM_ESTIMATE_SAMPLES 4
+#define BAM_ESTIMATE_EXACT (4 * 0x10000) // compressed bytes, counted exactly
+
+static int estimate_exact(bamFile fp, const bam_index_t *idx, int tid, int beg, int end, double *n_rec, double *n_nuc)
+{
+	bam_iter_t iter = bam_iter_query(idx, tid, beg, end);
+	bam1_t *b = bam_init1();
+	int ret;
+	while ((ret = bam_iter_read(fp, iter, b)) >= 0) {
+		*n_rec += 1.;
+		*n_nuc += b->core.l_qseq;
+	}
+	bam_destroy1(b);
+	bam_iter_destroy(iter);
+	return ret < -1? ret : 1;
+}
+
+int bam_estimate(bamFile fp, const bam_index_t *idx, int tid, int beg, int end, double *n_rec, double *n_nuc)
+{
+	const bam_lidx_t *l;
+	uint64_t off_beg, off_end;
+	double c = 0., u = 0., u_sample = 0., rec = 0., nuc = 0., u_total;
+	int k, w0, w1, ret = 0;
+	khint_t kp;
+	bam1_t *b;
+	*n_rec = *n_nuc = 0.;
+	if (tid < 0 || tid >= idx->n || end <= beg) return 1;
+	l = &idx->index2[tid];
+	if (beg < 0) beg = 0;
+	w0 = beg >> BAM_LIDX_SHIFT;
+	w1 = ((end - 1) >> BAM_LIDX_SHIFT) + 1;
+	if (w0 >= l->n) return 1; // nothing overlaps windows past the last
+	// the records of the region lie between linear index offsets
+	while (w0 < l->n && l->offset[w0] == 0) ++w0;
+	if (w0 == l->n) return 1;
+	off_beg = l->offset[w0];
+	if (w1 < l->n) off_end = l->offset[w1];
+	else {
+		kp = kh_get(i, idx->index[tid], BAM_MAX_BIN);
+		if (kp == kh_end(idx->index[tid])) return estimate_exact(fp, idx, tid, beg, end, n_rec, n_nuc);
+		off_end = kh_val(idx->index[tid], kp).list[0].v;
+		w1 = l->n;
+	}
+	if ((off_end >> 16) - (off_beg >> 16) < BAM_ESTIMATE_EXACT)
+		return estimate_exact(fp, idx, tid, beg, end, n_rec, n_nuc);
+	// sample one block at a few linear index offsets spread over the
+	// region: records and query length per uncompressed byte, and
+	// compressed per uncompressed bytes
+	b = bam_init1();
+	for (k = 0; k < BAM_ESTIMATE_SAMPLES; ++k) {
+		int64_t addr, len;
+		bam_seek(fp, l->offset[w0 + (w1 - w0) * k / BAM_ESTIMATE_SAMPLES], SEEK_SET);
+		for (;;) {
+			addr = fp->block_address; len = fp->block_length;
+			if ((ret = bam_read1(fp, b)) < 0 || b->core.tid != tid) break;
+			u_sample += ret;
+			rec += 1.;
+			nuc += b->core.l_qseq;
+			if (fp->block_address != addr && len > 0) {
+				c += fp->block_address - addr;
+				u += len;
+				break;
+			}
+		}
+		if (ret < -1) break;
+	}
+	bam_destroy1(b);
+	if (ret < -1) return ret;
+	if (c == 0. || u_sample == 0.)
+		return estimate_exact(fp, idx, tid, beg, end, n_rec, n_nuc);
+	u_total = (double)((off_end >> 16) - (off_beg >> 16)) * u / c + (double)(off_end & 0xffff) - (double)(off_beg & 0xffff);
+	// the windows may extend past the region; alignments overlapping
+	// the region start up to one query length before it
+	{
+		double qlen = nuc / rec, wbeg = (double)w0 * (1 << BAM_LIDX_SHIFT), wend = (double)w1 * (1 << BAM_LIDX_SHIFT);
+		double f = ((end < wend? end : wend) - (beg > wbeg? beg : wbeg) + qlen) / (wend - wbeg + qlen);
+		if (f < 1.) u_total *= f;
+	}
+	*n_rec = rec * u_total / u_sample;
+	*n_nuc = nuc * u_total / u_sample;
+	return 0;
+}
+
+#define BAM_ESTIMATE_FILE_SAMPLES 16
+
+int bam_estimate_file(bamFile fp, const bam_index_t *idx, double *n_rec, double *n_nuc)
+{
+	uint64_t mapped, unmapped, span = 0;
+	double total = 0., rec = 0., nuc = 0.;
+	int tid, k, n_window = 0, ret = 0;
+	bam1_t *b;
+	*n_rec = *n_nuc = 0.;
+	// alignments from the index metadata, and the compressed size they span
+	for (tid = 0; tid < idx->n; ++tid) {
+		khint_t kp;
+		const pair64_t *meta;
+		if (bam_index_stats(idx, tid, &mapped, &unmapped) != 0) {
+			if (kh_size(idx->index[tid]) == 0) continue; // no alignments, so no metadata
+			return -1;
+		}
+		total += (double)(mapped + unmapped);
+		n_window += idx->index2[tid].n;
+		kp = kh_get(i, idx->index[tid], BAM_MAX_BIN);
+		meta = kh_val(idx->index[tid], kp).list;
+		span += (meta[0].v >> 16) - (meta[0].u >> 16);
+	}
+	if (total == 0.) return 1;
+	if (span < BAM_ESTIMATE_EXACT) return -1;
+	// mean query length of the alignments in one block at each of a few
+	// linear index offsets spread over all references
+	b = bam_init1();
+	for (k = 0; k < BAM_ESTIMATE_FILE_SAMPLES; ++k) {
+		int w = (int)((int64_t)n_window * k / BAM_ESTIMATE_FILE_SAMPLES), t = 0;
+		int64_t addr;
+		while (t < idx->n && w >= idx->index2[t].n) w -= idx->index2[t++].n;
+		while (t < idx->n && (w >= idx->index2[t].n || idx->index2[t].offset[w] == 0)) { // skip empty windows
+			if (++w >= idx->index2[t].n) { w = 0; ++t; }
+		}
+		if (t == idx->n) break;
+		bam_seek(fp, idx->index2[t].offset[w], SEEK_SET);
+		addr = fp->block_address;
+		while ((ret = bam_read1(fp, b)) >= 0 && b->core.tid >= 0) {
+			rec += 1.;
+			nuc += b->core.l_qseq;
+			if (fp->block_address != addr) break;
+		}
+		if (ret < -1) break;
+	}
+	bam_destroy1(b);
+	if (ret < -1) return ret;
+	if (rec == 0.) return -1;
+	*n_rec = total;
+	*n_nuc = total * nuc / rec;
+	return 0;
+}
+
+/* parallel fetch of many regions: workers with their own file handles
+   claim regions in order, at most 'window' ahead of the consumer */
+
+typedef struct {
+	int tid, beg, end, done, ret;
+	bam_batch_t *batch;
+} mtfetch_region_t;
+
+typedef struct {
+	bam_mtfetch_t mf;
+	bamFile fp;
+	pthread_t tid;
+} mtfetch_worker_t;
+
+struct __bam_mtfetch_t {
+	const bam_index_t *idx;
+	int n, next, consumed, window, stop;
+	mtfetch_region_t *reg;
+	int n_threads;
+	mtfetch_worker_t *w;
+	pthread_mutex_t lock;
+	pthread_cond_t ready, space;
+};
+
+static void *mtfetch_worker(void *data)
+{
+	bam_mtfetch_t mf = ((mtfetch_worker_t*)data)->mf;
+	bamFile fp = ((mtfetch_worker_t*)data)->fp;
+	pthread_mutex_lock(&mf->lock);
+	for (;;) {
+		mtfetch_region_t *r;
+		int i;
+		while (!mf->stop && mf->next < mf->n && mf->next >= mf->consumed + mf->window)
+			pthread_cond_wait(&mf->space, &mf->lock);
+		if (mf->stop || mf->next >= mf->n) break;
+		i = mf->next++;
+		pthread_mutex_unlock(&mf->lock);
+		r = &mf->reg[i];
+		r->batch = bam_batch_init();
+		if (r->tid >= 0 && r->tid < mf->idx->n) {
+			bam_iter_t iter = bam_iter_query(mf->idx, r->tid, r->beg, r->end);
+			bam_iter_read_batch(fp, iter, r->batch, INT_MAX);
+			r->ret = r->batch->ret == -1? 0 : r->batch->ret;
+			bam_iter_destroy(iter);
+		}
+		pthread_mutex_lock(&mf->lock);
+		r->done = 1;
+		pthread_cond_broadcast(&mf->ready);
+	}
+	pthread_mutex_unlock(&mf->lock);
+	return 0;
+}
+
+bam_mtfetch_t bam_mtfetch_init(const char *fn, const bam_index_t *idx, int n, const int *tid, const int *beg, const int *end, int n_threads)
+{
+	bam_mtfetch_t mf;
+	int i;
+	// remote files report errors through the R-facing fprintf; keep them on the calling thread
+	if (strstr(fn, "ftp://") == fn || strstr(fn, "http://") == fn) return 0;
+	if (n_threads < 1) n_threads = 1;
+	if (n_threads > n) n_threads = n > 0? n : 1;
+	mf = (bam_mtfetch_t)calloc(1, sizeof(struct __bam_mtfetch_t));
+	mf->idx = idx;
+	mf->n = n;
+	mf->window = n_threads * 4;
+	mf->reg = (mtfetch_region_t*)calloc(n > 0? n : 1, sizeof(mtfetch_region_t));
+	for (i = 0; i < n; ++i) {
+		mf->reg[i].tid = tid[i]; mf->reg[i].beg = beg[i]; mf->reg[i].end = end[i];
+	}
+	pthread_mutex_init(&mf->lock, 0);
+	pthread_cond_init(&mf->ready, 0);
+	pthread_cond_init(&mf->space, 0);
+	// handles are opened here, so that workers never report errors
+	mf->w = (mtfetch_worker_t*)calloc(n_threads, sizeof(mtfetch_worker_t));
+	for (i = 0; i < n_threads; ++i) {
+		mtfetch_worker_t *w = &mf->w[i];
+		w->mf = mf;
+		if ((w->fp = bam_open(fn, "r")) == 0) break;
+		if (pthread_create(&w->tid, 0, mtfetch_worker, w) != 0) {
+			bam_close(w->fp); w->fp = 0;
+			break;
+		}
+		++mf->n_threads;
+	}
+	if (mf->n_threads == 0) { // no thread could be started
+		bam_mtfetch_destroy(mf);
+		return 0;
+	}
+	return mf;
+}
+
+bam_batch_t *bam_mtfetch_next(bam_mtfetch_t mf, int *ret)
+{
+	mtfetch_region_t *r;
+	pthread_mutex_lock(&mf->lock);
+	if (mf->consumed > 0) { // the caller is done with the previous region
+		bam_batch_destroy(mf->reg[mf->consumed - 1].batch);
+		mf->reg[mf->consumed - 1].batch = 0;
+	}
+	if (mf->consumed == mf->n) {
+		pthread_mutex_unlock(&mf->lock);
+		*ret = -1;
+		return 0;
+	}
+	r = &mf->reg[mf->consumed];
+	while (!r->done) pthread_cond_wait(&mf->ready, &mf->lock);
+	++mf->consumed;
+	pthread_cond_broadcast(&mf->space);
+	pthread_mutex_unlock(&mf->lock);
+	*ret = r->ret;
+	return r->batch;
+}
+
+void bam_mtfetch_destroy(bam_mtfetch_t mf)
+{
+	int i;
+	if (mf == 0) return;
+	pthread_mutex_lock(&mf->lock);
+	mf->stop = 1;
+	pthread_cond_broadcast(&mf->space);
+	pthread_mutex_unlock(&mf->lock);
+	for (i = 0; i < mf->n_threads; ++i) {
+		pthread_join(mf->w[i].tid, 0);
+		bam_close(mf->w[i].fp);
+	}
+	for (i = 0; i < mf->n; ++i)
+		if (mf->reg[i].batch) bam_batch_destroy(mf->reg[i].batch);
+	pthread_mutex_destroy(&mf->lock);
+	pthread_cond_destroy(&mf->ready);
+	pthread_cond_destroy(&mf->space);
+	free(mf->w); free(mf->reg);
+	free(mf);
+}
@@ -32,6 +32,17 @@
 #include <sys/types.h>
 #include "bgzf.h"
 
+#ifndef _WIN32
+#define BGZF_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef BGZF_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
 #ifdef _USE_KNETFILE
 #include "knetfile.h"
 typedef knetFile *_bgzf_file_t;
@@ -73,14 +84,44 @@ typedef FILE *_bgzf_file_t;
 */
 static const uint8_t g_magic[19] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\0\0";
 
+// the empty block that ends a BGZF file, written as is whatever the codec
+static const uint8_t g_eof_block[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+
 #ifdef BGZF_CACHE
-typedef struct {
-	int size;
-	uint8_t *block;
-	int64_t end_offset;
-} cache_t;
+#include <sys/stat.h>
 #include "khash.h"
-KHASH_MAP_INIT_INT64(cache, cache_t)
+
+/* One inflated block in the shared cache. Entries are kept on a doubly
+ * linked list in order of use; the least recently used is evicted
+ * first. */
+typedef struct cache_ent_t {
+	uint64_t key; // file id << 48 | compressed block address
+	int64_t end_offset;
+	int size;
+	struct cache_ent_t *prev, *next;
+	uint8_t block[];
+} cache_ent_t;
+
+KHASH_MAP_INIT_INT64(cache, cache_ent_t*)
+KHASH_MAP_INIT_STR(cfile, int)
+
+#define CACHE_ADDR_BITS 48
+#define CACHE_MAX_FILES 0xffff
+
+/* The cache is shared by all handles of the process; a handle takes
+ * part through the id of the file it reads, so handles opened on the
+ * same file see each other's blocks. */
+typedef struct {
+	pthread_mutex_t lock;
+	int64_t capacity, used;
+	uint64_t hits, misses, evictions;
+	cache_ent_t lru; // sentinel; lru.next is the most recently used
+	khash_t(cache) *h;
+	khash_t(cfile) *files; // file identity => file id
+	int last_id; // ids are handed out once, never reused
+} bgzf_cache_t;
+
+static bgzf_cache_t g_cache = { PTHREAD_MUTEX_INITIALIZER };
 #endif
 
 static inline void packInt16(uint8_t *buffer, uint16_t value)
@@ -102,6 +143,11 @@ static inline void packInt32(uint8_t *buffer, uint32_t value)
 	buffer[3] = value >> 24;
 }
 
+static void cache_attach(BGZF *fp, const char *path);
+static void cache_forget(const char *path);
+static void cache_forget_fd(int fd);
+static void map_attach(BGZF *fp);
+
 static BGZF *bgzf_read_init()
 {
 	BGZF *fp;
@@ -109,9 +155,6 @@ static BGZF *bgzf_read_init()
 	fp->is_write = 0;
 	fp->uncompressed_block = malloc(BGZF_MAX_BLOCK_SIZE);
 	fp->compressed_block = malloc(BGZF_MAX_BLOCK_SIZE);
-#ifdef BGZF_CACHE
-	fp->cache = kh_init(cache);
-#endif
 	return fp;
 }
 
@@ -158,8 +201,11 @@ BGZF *bgzf_open(const char *path, const char *mode)
 		if (fpr == 0) return 0;
 		fp = bgzf_read_init();
 		fp->fp = fpr;
+		map_attach(fp);
+		cache_attach(fp, path);
 	} else if (strchr(mode, 'w') || strchr(mode, 'W')) {
 		FILE *fpw;
+		cache_forget(path);
         /* Rsamtools: windows binary read / write to avoid cr */
 		int fd, oflag = O_WRONLY | O_CREAT | O_TRUNC;
 #ifdef _WIN32
@@ -183,8 +229,11 @@ BGZF *bgzf_dopen(int fd, const char *mode)
 		if ((fpr = _bgzf_dopen(fd, "r")) == 0) return 0;
 		fp = bgzf_read_init();
 		fp->fp = fpr;
+		map_attach(fp);
+		cache_attach(fp, 0);
 	} else if (strchr(mode, 'w') || strchr(mode, 'W')) {
 		FILE *fpw;
+		cache_forget_fd(fd);
 		if ((fpw = fdopen(fd, "w")) == 0) return 0;
 		fp = bgzf_write_init(mode2level(mode));
 		fp->fp = fpw;
@@ -192,22 +241,161 @@ BGZF *bgzf_dopen(int fd, const char *mode)
 	return fp;
 }
 
-static int bgzf_compress(void *_dst, int *dlen, void *src, int slen, int level)
+/* Codecs. A codec deflates or inflates the body of a BGZF block as one
+ * buffer. "zlib" is always available. "libdeflate", when built with
+ * BGZF_LIBDEFLATE, uses the whole-buffer routines of libdeflate, which
+ * are considerably faster than zlib streams on blocks of this size. The
+ * output of any codec is read by all others. */
+
+typedef struct {
+	const char *name;
+	// deflate _slen_ bytes of _src_ into at most *dlen bytes of _dst_; *dlen is set to the compressed size
+	int (*compress)(uint8_t *dst, int *dlen, const uint8_t *src, int slen, int level);
+	// inflate _slen_ bytes of _src_ into at most *dlen bytes of _dst_; *dlen is set to the inflated size
+	int (*uncompress)(uint8_t *dst, int *dlen, const uint8_t *src, int slen);
+} bgzf_codec_t;
+
+static int zlib_compress(uint8_t *dst, int *dlen, const uint8_t *src, int slen, int level)
 {
-	uint32_t crc;
 	z_stream zs;
-	uint8_t *dst = (uint8_t*)_dst;
-
-	// compress the body
 	zs.zalloc = NULL; zs.zfree = NULL;
-	zs.next_in  = src;
+	zs.next_in  = (Bytef*)src;
 	zs.avail_in = slen;
-	zs.next_out = dst + BLOCK_HEADER_LENGTH;
-	zs.avail_out = *dlen - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
+	zs.next_out = dst;
+	zs.avail_out = *dlen;
 	if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1; // -15 to disable zlib header/footer
-	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) return -1;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&zs);
+		return -1;
+	}
 	if (deflateEnd(&zs) != Z_OK) return -1;
-	*dlen = zs.total_out + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
+	*dlen = zs.total_out;
+	return 0;
+}
+
+static int zlib_uncompress(uint8_t *dst, int *dlen, const uint8_t *src, int slen)
+{
+	z_stream zs;
+	zs.zalloc = NULL;
+	zs.zfree = NULL;
+	zs.next_in = (Bytef*)src;
+	zs.avail_in = slen; // never past the block; _src_ may point into a mapped file
+	zs.next_out = dst;
+	zs.avail_out = *dlen;
+	if (inflateInit2(&zs, -15) != Z_OK) return -1;
+	if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		inflateEnd(&zs);
+		return -1;
+	}
+	if (inflateEnd(&zs) != Z_OK) return -1;
+	*dlen = zs.total_out;
+	return 0;
+}
+
+#ifdef BGZF_LIBDEFLATE
+// per-thread libdeflate state, freed when the thread exits
+typedef struct {
+	struct libdeflate_compressor *ldc;
+	struct libdeflate_decompressor *ldd;
+	int ldc_level;
+} codec_state_t;
+
+static pthread_key_t g_codec_key;
+static pthread_once_t g_codec_once = PTHREAD_ONCE_INIT;
+
+static void codec_state_free(void *data)
+{
+	codec_state_t *st = (codec_state_t*)data;
+	if (st->ldc) libdeflate_free_compressor(st->ldc);
+	if (st->ldd) libdeflate_free_decompressor(st->ldd);
+	free(st);
+}
+
+static void codec_key_init(void)
+{
+	pthread_key_create(&g_codec_key, codec_state_free);
+}
+
+static codec_state_t *codec_state(void)
+{
+	codec_state_t *st;
+	pthread_once(&g_codec_once, codec_key_init);
+	if ((st = (codec_state_t*)pthread_getspecific(g_codec_key)) == 0) {
+		st = calloc(1, sizeof(codec_state_t));
+		pthread_setspecific(g_codec_key, st);
+	}
+	return st;
+}
+
+static int libdeflate_compress(uint8_t *dst, int *dlen, const uint8_t *src, int slen, int level)
+{
+	codec_state_t *st = codec_state();
+	size_t n;
+	if (level < 0) level = 6; // zlib's default
+	if (level == 0) return zlib_compress(dst, dlen, src, slen, level); // stored blocks
+	if (st->ldc && st->ldc_level != level) {
+		libdeflate_free_compressor(st->ldc);
+		st->ldc = 0;
+	}
+	if (st->ldc == 0) {
+		if ((st->ldc = libdeflate_alloc_compressor(level)) == 0) return -1;
+		st->ldc_level = level;
+	}
+	if ((n = libdeflate_deflate_compress(st->ldc, src, slen, dst, *dlen)) == 0) return -1;
+	*dlen = n;
+	return 0;
+}
+
+static int libdeflate_uncompress(uint8_t *dst, int *dlen, const uint8_t *src, int slen)
+{
+	codec_state_t *st = codec_state();
+	size_t n;
+	if (st->ldd == 0 && (st->ldd = libdeflate_alloc_decompressor()) == 0) return -1;
+	if (libdeflate_deflate_decompress(st->ldd, src, slen, dst, *dlen, &n) != LIBDEFLATE_SUCCESS) return -1;
+	*dlen = n;
+	return 0;
+}
+#endif
+
+static const bgzf_codec_t g_codecs[] = {
+#ifdef BGZF_LIBDEFLATE
+	{ "libdeflate", libdeflate_compress, libdeflate_uncompress },
+#endif
+	{ "zlib", zlib_compress, zlib_uncompress }
+};
+#define N_CODECS ((int)(sizeof(g_codecs) / sizeof(bgzf_codec_t)))
+
+static const bgzf_codec_t *g_codec = &g_codecs[0]; // the fastest available
+
+const char *bgzf_codec(const char *name)
+{
+	int i;
+	if (name == 0) return g_codec->name;
+	for (i = 0; i < N_CODECS; ++i)
+		if (strcmp(name, g_codecs[i].name) == 0) {
+			g_codec = &g_codecs[i];
+			return g_codec->name;
+		}
+	return 0;
+}
+
+int bgzf_codec_list(const char **names, int n)
+{
+	int i;
+	for (i = 0; i < n && i < N_CODECS; ++i)
+		names[i] = g_codecs[i].name;
+	return N_CODECS;
+}
+
+static int bgzf_compress(void *_dst, int *dlen, void *src, int slen, int level)
+{
+	uint32_t crc;
+	uint8_t *dst = (uint8_t*)_dst;
+	int clen = *dlen - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
+
+	// compress the body
+	if (g_codec->compress(dst + BLOCK_HEADER_LENGTH, &clen, src, slen, level) != 0) return -1;
+	*dlen = clen + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
 	// write the header
 	memcpy(dst, g_magic, BLOCK_HEADER_LENGTH); // the last two bytes are a place holder for the length of the block
 	packInt16(&dst[16], *dlen - 1); // write the compressed length; -1 to fit 2 bytes
@@ -230,31 +418,22 @@ static int deflate_block(BGZF *fp, int block_length)
 	return comp_size;
 }
 
+// Inflate the complete BGZF block _src_ (header included) of _slen_ bytes into _dst_
+static int bgzf_uncompress(void *dst, int *dlen, const void *src, int slen)
+{
+	const uint8_t *body = (const uint8_t*)src + BLOCK_HEADER_LENGTH;
+	return g_codec->uncompress(dst, dlen, body, slen - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH);
+}
+
 // Inflate the block in fp->compressed_block into fp->uncompressed_block
 static int inflate_block(BGZF* fp, int block_length)
 {
-	z_stream zs;
-	zs.zalloc = NULL;
-	zs.zfree = NULL;
-	zs.next_in = fp->compressed_block + 18;
-	zs.avail_in = block_length - 16;
-	zs.next_out = fp->uncompressed_block;
-	zs.avail_out = BGZF_MAX_BLOCK_SIZE;
-
-	if (inflateInit2(&zs, -15) != Z_OK) {
-		fp->errcode |= BGZF_ERR_ZLIB;
-		return -1;
-	}
-	if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
-		inflateEnd(&zs);
+	int dlen = BGZF_MAX_BLOCK_SIZE;
+	if (bgzf_uncompress(fp->uncompressed_block, &dlen, fp->compressed_block, block_length) != 0) {
 		fp->errcode |= BGZF_ERR_ZLIB;
 		return -1;
 	}
-	if (inflateEnd(&zs) != Z_OK) {
-		fp->errcode |= BGZF_ERR_ZLIB;
-		return -1;
-	}
-	return zs.total_out;
+	return dlen;
 }
 
 static int check_header(const uint8_t *header)
@@ -265,63 +444,342 @@ static int check_header(const uint8_t *header)
 			&& unpackInt16((uint8_t*)&header[14]) == 2);
 }
 
+/* Memory-mapped input. Local files opened for reading are mapped
+ * read-only; blocks are inflated straight from the mapped pages instead
+ * of being copied into fp->compressed_block first. Touching a page past
+ * the end of a file truncated after mapping raises SIGBUS; the file size
+ * is checked again at each seek and end-of-file check, and blocks past a
+ * shrunken end read as truncated. */
+
+typedef struct {
+	const uint8_t *base;
+	int64_t len;  // bytes mapped
+	int64_t size; // bytes still backed by the file, at most len
+	int64_t pos;
+	int fd;
+} bgzf_map_t;
+
+#ifdef BGZF_MMAP
+static void map_attach(BGZF *fp)
+{
+	struct stat st;
+	bgzf_map_t *map;
+	void *base;
+	int fd;
+#ifdef _USE_KNETFILE
+	knetFile *kf = (knetFile*)fp->fp;
+	if (kf->type != KNF_TYPE_LOCAL) return;
+	fd = kf->fd;
+#else
+	fd = fileno((FILE*)fp->fp);
+#endif
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return;
+	if ((uint64_t)st.st_size > (size_t)-1 >> 1) return; // too large for the address space
+	base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) return; // fall back to read()
+	map = malloc(sizeof(bgzf_map_t));
+	map->base = (const uint8_t*)base;
+	map->len = map->size = st.st_size;
+	map->pos = _bgzf_tell((_bgzf_file_t)fp->fp);
+	map->fd = fd;
+	fp->map = map;
+}
+
+static void map_detach(BGZF *fp)
+{
+	bgzf_map_t *map = (bgzf_map_t*)fp->map;
+	munmap((void*)map->base, map->len);
+	free(map);
+	fp->map = 0;
+}
+#else
+static void map_attach(BGZF *fp) {}
+static void map_detach(BGZF *fp) {}
+#endif
+
+// Stop the mapping at the end of the file, which may have shrunk; at seeks, not per block
+static void map_recheck(bgzf_map_t *map)
+{
+#ifdef BGZF_MMAP
+	struct stat st;
+	if (fstat(map->fd, &st) != 0) map->size = 0;
+	else if (st.st_size < map->size) map->size = st.st_size;
+#endif
+}
+
+/* The compressed block at map->pos; 0 at end-of-file (*errcode == 0) or
+ * on a truncated or corrupt block */
+static const uint8_t *map_next_block(bgzf_map_t *map, int *block_length, int *errcode)
+{
+	const uint8_t *block = map->base + map->pos;
+	*errcode = 0;
+	if (map->pos >= map->len) return 0;
+	if (map->size - map->pos < BLOCK_HEADER_LENGTH || !check_header(block)) {
+		*errcode = map->size - map->pos < BLOCK_HEADER_LENGTH && map->size < map->len?
+			BGZF_ERR_IO : BGZF_ERR_HEADER;
+		return 0;
+	}
+	*block_length = unpackInt16(&block[16]) + 1;
+	if (map->size - map->pos < *block_length) {
+		*errcode = BGZF_ERR_IO;
+		return 0;
+	}
+	map->pos += *block_length;
+	return block;
+}
+
+/* read-ahead worker pool; see the multi-threading section below */
+typedef struct mtread_t mtread_t;
+static int mt_read_block(BGZF *fp, int *size);
+static int64_t mt_read_tell(mtread_t *mt);
+static int mt_read_seek(mtread_t *mt, int64_t addr);
+static int mt_read_queued(mtread_t *mt);
+static void mt_read_plan(mtread_t *mt, int n, const int64_t *beg, const int64_t *end);
+
+// Compressed address of the next block to be handed to the reader
+static inline int64_t bgzf_raw_tell(BGZF *fp)
+{
+	if (!fp->is_write && fp->mt) return mt_read_tell((mtread_t*)fp->mt);
+	if (fp->map) return ((bgzf_map_t*)fp->map)->pos;
+	return _bgzf_tell((_bgzf_file_t)fp->fp);
+}
+
+// Position the file at the compressed address _addr_
+static inline int bgzf_raw_seek(BGZF *fp, int64_t addr)
+{
+	if (!fp->is_write && fp->mt) return mt_read_seek((mtread_t*)fp->mt, addr);
+	if (fp->map) {
+		if (addr < 0) return -1;
+		map_recheck((bgzf_map_t*)fp->map);
+		((bgzf_map_t*)fp->map)->pos = addr;
+		return 0;
+	}
+	return _bgzf_seek((_bgzf_file_t)fp->fp, addr, SEEK_SET) < 0? -1 : 0;
+}
+
 #ifdef BGZF_CACHE
-static void free_cache(BGZF *fp)
+static inline void cache_unlink(cache_ent_t *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static inline void cache_push(bgzf_cache_t *c, cache_ent_t *e)
+{
+	e->prev = &c->lru;
+	e->next = c->lru.next;
+	c->lru.next->prev = e;
+	c->lru.next = e;
+}
+
+// Drop the least recently used block; called with the lock held
+static void cache_evict(bgzf_cache_t *c)
+{
+	cache_ent_t *e = c->lru.prev;
+	cache_unlink(e);
+	kh_del(cache, c->h, kh_get(cache, c->h, e->key));
+	c->used -= sizeof(cache_ent_t) + e->size;
+	free(e);
+}
+
+// Shrink the cache to at most _size_ bytes; called with the lock held
+static void cache_shrink(bgzf_cache_t *c, int64_t size, int count)
+{
+	while (c->used > size && c->lru.prev != &c->lru) {
+		cache_evict(c);
+		if (count) ++c->evictions;
+	}
+}
+
+// A printable identity of the file behind _fp_: device, inode, size and modification time for local files, the URL otherwise
+static char *cache_file_name(BGZF *fp, const char *path)
+{
+	struct stat st;
+	char *name;
+	int fd;
+#ifdef _USE_KNETFILE
+	knetFile *kf = (knetFile*)fp->fp;
+	fd = kf->type == KNF_TYPE_LOCAL? kf->fd : -1;
+#else
+	fd = fileno((FILE*)fp->fp);
+#endif
+	if (fd < 0) { // remote files are assumed not to change during a session
+		if (path == 0) return 0;
+		name = malloc(strlen(path) + 1);
+		return strcpy(name, path);
+	}
+	if (fstat(fd, &st) != 0) return 0;
+#ifdef _WIN32
+	if (path == 0) return 0; // no inode numbers; files are told apart by name
+	name = malloc(strlen(path) + 48);
+	sprintf(name, "%s:%lld:%lld", path, (long long)st.st_size, (long long)st.st_mtime);
+#else
+	name = malloc(96);
+	sprintf(name, "%llu:%llu:%lld:%lld", (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+			(long long)st.st_size, (long long)st.st_mtime);
+#endif
+	return name;
+}
+
+// Give a newly opened reader the id of its file, registering the file if it is new
+static void cache_attach(BGZF *fp, const char *path)
 {
+	int absent;
 	khint_t k;
-	khash_t(cache) *h = (khash_t(cache)*)fp->cache;
-	if (fp->is_write) return;
-	for (k = kh_begin(h); k < kh_end(h); ++k)
-		if (kh_exist(h, k)) free(kh_val(h, k).block);
-	kh_destroy(cache, h);
+	char *name = cache_file_name(fp, path);
+	if (name == 0) return;
+	pthread_mutex_lock(&g_cache.lock);
+	if (g_cache.files == 0) g_cache.files = kh_init(cfile);
+	k = kh_put(cfile, g_cache.files, name, &absent);
+	if (!absent) free(name);
+	else if (g_cache.last_id >= CACHE_MAX_FILES) { // out of ids; read without the cache
+		kh_del(cfile, g_cache.files, k);
+		free(name);
+		pthread_mutex_unlock(&g_cache.lock);
+		return;
+	} else kh_val(g_cache.files, k) = ++g_cache.last_id;
+	fp->cache_id = kh_val(g_cache.files, k);
+	fp->cache = &g_cache;
+	pthread_mutex_unlock(&g_cache.lock);
+}
+
+// Forget every identity of the file behind _st_, about to be overwritten, so that blocks cached from its old content are never served
+static void cache_forget_stat(const struct stat *st, const char *path)
+{
+	char *prefix;
+	size_t len;
+	khint_t k;
+#ifdef _WIN32
+	if (path == 0) return; // readers without a path are not cached
+	prefix = malloc(strlen(path) + 2);
+	len = sprintf(prefix, "%s:", path);
+#else
+	prefix = malloc(48);
+	len = sprintf(prefix, "%llu:%llu:", (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+#endif
+	pthread_mutex_lock(&g_cache.lock);
+	if (g_cache.files) {
+		for (k = kh_begin(g_cache.files); k != kh_end(g_cache.files); ++k) {
+			if (!kh_exist(g_cache.files, k) || strncmp(kh_key(g_cache.files, k), prefix, len) != 0) continue;
+			// the id is retired: last_id never hands it out again, and its blocks age out
+			free((char*)kh_key(g_cache.files, k));
+			kh_del(cfile, g_cache.files, k);
+		}
+	}
+	pthread_mutex_unlock(&g_cache.lock);
+	free(prefix);
+}
+
+static void cache_forget(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) == 0) cache_forget_stat(&st, path);
+}
+
+static void cache_forget_fd(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) == 0) cache_forget_stat(&st, 0);
 }
 
 static int load_block_from_cache(BGZF *fp, int64_t block_address)
 {
 	khint_t k;
-	cache_t *p;
-	khash_t(cache) *h = (khash_t(cache)*)fp->cache;
-	k = kh_get(cache, h, block_address);
-	if (k == kh_end(h)) return 0;
-	p = &kh_val(h, k);
+	cache_ent_t *e;
+	int64_t end_offset;
+	bgzf_cache_t *c = (bgzf_cache_t*)fp->cache;
+	uint64_t key = (uint64_t)fp->cache_id << CACHE_ADDR_BITS | block_address;
+	if (c->capacity == 0) return 0; // read without the lock; a stale value costs one lookup
+	pthread_mutex_lock(&c->lock);
+	if (c->h == 0 || (k = kh_get(cache, c->h, key)) == kh_end(c->h)) {
+		++c->misses;
+		pthread_mutex_unlock(&c->lock);
+		return 0;
+	}
+	++c->hits;
+	e = kh_val(c->h, k);
+	cache_unlink(e);
+	cache_push(c, e);
 	if (fp->block_length != 0) fp->block_offset = 0;
 	fp->block_address = block_address;
-	fp->block_length = p->size;
-	memcpy(fp->uncompressed_block, p->block, BGZF_MAX_BLOCK_SIZE);
-	_bgzf_seek((_bgzf_file_t)fp->fp, p->end_offset, SEEK_SET);
-	return p->size;
+	fp->block_length = e->size;
+	memcpy(fp->uncompressed_block, e->block, e->size);
+	end_offset = e->end_offset;
+	pthread_mutex_unlock(&c->lock);
+	bgzf_raw_seek(fp, end_offset);
+	return fp->block_length;
 }
 
 static void cache_block(BGZF *fp, int size)
 {
 	int ret;
 	khint_t k;
-	cache_t *p;
-	khash_t(cache) *h = (khash_t(cache)*)fp->cache;
-	if (BGZF_MAX_BLOCK_SIZE >= fp->cache_size) return;
-	if ((kh_size(h) + 1) * BGZF_MAX_BLOCK_SIZE > fp->cache_size) {
-		/* A better way would be to remove the oldest block in the
-		 * cache, but here we remove a random one for simplicity. This
-		 * should not have a big impact on performance. */
-		for (k = kh_begin(h); k < kh_end(h); ++k)
-			if (kh_exist(h, k)) break;
-		if (k < kh_end(h)) {
-			free(kh_val(h, k).block);
-			kh_del(cache, h, k);
-		}
+	cache_ent_t *e;
+	bgzf_cache_t *c = (bgzf_cache_t*)fp->cache;
+	int64_t cost = sizeof(cache_ent_t) + fp->block_length;
+	uint64_t key = (uint64_t)fp->cache_id << CACHE_ADDR_BITS | fp->block_address;
+	if (c == 0 || fp->block_length == 0 || c->capacity == 0) return;
+	pthread_mutex_lock(&c->lock);
+	if (cost > c->capacity) {
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	if (c->h == 0) {
+		c->h = kh_init(cache);
+		c->lru.prev = c->lru.next = &c->lru;
 	}
-	k = kh_put(cache, h, fp->block_address, &ret);
-	if (ret == 0) return; // if this happens, a bug!
-	p = &kh_val(h, k);
-	p->size = fp->block_length;
-	p->end_offset = fp->block_address + size;
-	p->block = malloc(BGZF_MAX_BLOCK_SIZE);
-	memcpy(kh_val(h, k).block, fp->uncompressed_block, BGZF_MAX_BLOCK_SIZE);
+	if (kh_get(cache, c->h, key) == kh_end(c->h)) { // else another handle on the same file got here first
+		cache_shrink(c, c->capacity - cost, 1);
+		e = (cache_ent_t*)malloc(cost);
+		e->key = key;
+		e->size = fp->block_length;
+		e->end_offset = fp->block_address + size;
+		memcpy(e->block, fp->uncompressed_block, e->size);
+		k = kh_put(cache, c->h, key, &ret);
+		kh_val(c->h, k) = e;
+		cache_push(c, e);
+		c->used += cost;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void bgzf_cache_resize(int64_t size)
+{
+	pthread_mutex_lock(&g_cache.lock);
+	g_cache.capacity = size < 0? 0 : size;
+	if (g_cache.h) cache_shrink(&g_cache, g_cache.capacity, 1);
+	pthread_mutex_unlock(&g_cache.lock);
+}
+
+void bgzf_cache_clear(void)
+{
+	pthread_mutex_lock(&g_cache.lock);
+	if (g_cache.h) cache_shrink(&g_cache, 0, 0);
+	g_cache.hits = g_cache.misses = g_cache.evictions = 0;
+	pthread_mutex_unlock(&g_cache.lock);
+}
+
+void bgzf_cache_stats(bgzf_cache_stats_t *stats)
+{
+	pthread_mutex_lock(&g_cache.lock);
+	stats->capacity = g_cache.capacity;
+	stats->used = g_cache.used;
+	stats->n_blocks = g_cache.h? kh_size(g_cache.h) : 0;
+	stats->n_files = g_cache.files? kh_size(g_cache.files) : 0;
+	stats->hits = g_cache.hits;
+	stats->misses = g_cache.misses;
+	stats->evictions = g_cache.evictions;
+	pthread_mutex_unlock(&g_cache.lock);
 }
 #else
-static void free_cache(BGZF *fp) {}
+static void cache_attach(BGZF *fp, const char *path) {}
+static void cache_forget(const char *path) {}
+static void cache_forget_fd(int fd) {}
 static int load_block_from_cache(BGZF *fp, int64_t block_address) {return 0;}
 static void cache_block(BGZF *fp, int size) {}
+void bgzf_cache_resize(int64_t size) {}
+void bgzf_cache_clear(void) {}
+void bgzf_cache_stats(bgzf_cache_stats_t *stats) { memset(stats, 0, sizeof(bgzf_cache_stats_t)); }
 #endif
 
 int bgzf_read_block(BGZF *fp)
@@ -329,8 +787,30 @@ int bgzf_read_block(BGZF *fp)
 	uint8_t header[BLOCK_HEADER_LENGTH], *compressed_block;
 	int count, size = 0, block_length, remaining;
 	int64_t block_address;
-	block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
-	if (fp->cache_size && load_block_from_cache(fp, block_address)) return 0;
+	block_address = bgzf_raw_tell(fp);
+	if (fp->cache && !(fp->mt && mt_read_queued((mtread_t*)fp->mt)) // prefer a block already read ahead
+		&& load_block_from_cache(fp, block_address)) return 0;
+	if (fp->mt) {
+		if ((count = mt_read_block(fp, &size)) <= 0) return count;
+		cache_block(fp, size);
+		return 0;
+	}
+	if (fp->map) {
+		int errcode;
+		const uint8_t *src = map_next_block((bgzf_map_t*)fp->map, &block_length, &errcode);
+		if (src == 0) {
+			fp->block_length = 0;
+			fp->errcode |= errcode;
+			return errcode? -1 : 0;
+		}
+		size = block_length;
+		count = BGZF_MAX_BLOCK_SIZE;
+		if (bgzf_uncompress(fp->uncompressed_block, &count, src, block_length) != 0) {
+			fp->errcode |= BGZF_ERR_ZLIB;
+			return -1;
+		}
+		goto inflated;
+	}
 	count = _bgzf_read(fp->fp, header, sizeof(header));
 	if (count == 0) { // no data read
 		fp->block_length = 0;
@@ -352,6 +832,7 @@ int bgzf_read_block(BGZF *fp)
 	}
 	size += count;
 	if ((count = inflate_block(fp, block_length)) < 0) return -1;
+inflated:
 	if (fp->block_length != 0) fp->block_offset = 0; // Do not reset offset if this read follows a seek.
 	fp->block_address = block_address;
 	fp->block_length = count;
@@ -381,12 +862,54 @@ ssize_t bgzf_read(BGZF *fp, void *data, ssize_t length)
 		bytes_read += copy_length;
 	}
 	if (fp->block_offset == fp->block_length) {
-		fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+		fp->block_address = bgzf_raw_tell(fp);
 		fp->block_offset = fp->block_length = 0;
 	}
 	return bytes_read;
 }
 
+const void *bgzf_read_view(BGZF *fp, int length)
+{
+	const uint8_t *view;
+	assert(fp->is_write == 0);
+	if (length <= 0) return 0;
+	if (fp->block_length - fp->block_offset <= 0) {
+		if (bgzf_read_block(fp) != 0) return 0;
+		if (fp->block_length - fp->block_offset <= 0) return 0; // end-of-file
+	}
+	if (fp->block_length - fp->block_offset < length) return 0;
+	view = (const uint8_t*)fp->uncompressed_block + fp->block_offset;
+	fp->block_offset += length;
+	if (fp->block_offset == fp->block_length) {
+		fp->block_address = bgzf_raw_tell(fp);
+		fp->block_offset = fp->block_length = 0;
+	}
+	return view;
+}
+
+ssize_t bgzf_skip(BGZF *fp, ssize_t length)
+{
+	ssize_t bytes_skipped = 0;
+	if (length <= 0) return 0;
+	assert(fp->is_write == 0);
+	while (bytes_skipped < length) {
+		int skip_length, available = fp->block_length - fp->block_offset;
+		if (available <= 0) {
+			if (bgzf_read_block(fp) != 0) return -1;
+			available = fp->block_length - fp->block_offset;
+			if (available <= 0) break;
+		}
+		skip_length = length - bytes_skipped < available? length - bytes_skipped : available;
+		fp->block_offset += skip_length;
+		bytes_skipped += skip_length;
+	}
+	if (fp->block_offset == fp->block_length) {
+		fp->block_address = bgzf_raw_tell(fp);
+		fp->block_offset = fp->block_length = 0;
+	}
+	return bytes_skipped;
+}
+
 /***** BEGIN: multi-threading *****/
 
 typedef struct {
@@ -436,12 +959,324 @@ static void *mt_worker(void *data)
 	return 0;
 }
 
+/* Reading: a pool of threads reads compressed blocks ahead of the
+ * consumer into a ring of slots, in file order and under the pool lock,
+ * then inflates them concurrently. bgzf_read_block() takes finished
+ * blocks from the head of the ring, so blocks are delivered in order.
+ *
+ * By default the workers read the file sequentially. A prefetch plan
+ * (bgzf_prefetch()) restricts them to a list of address ranges, e.g.,
+ * the chunks of an index query, so the blocks a range query will ask for
+ * are read and inflated before it seeks to them. The plan is only a
+ * guess: the consumer asks for blocks by address, and read-ahead blocks
+ * it skips over are discarded. */
+
+enum { SLOT_READ = 1, SLOT_DONE, SLOT_EOF, SLOT_ERR };
+
+typedef struct {
+	int64_t addr;
+	int state, errcode, clen, ulen;
+	void *cblk, *ublk;
+	const void *src; // compressed block: cblk, or a view into the mapped file
+} mtslot_t;
+
+struct mtread_t {
+	int n_threads, n_slots, head, n_queued, n_busy, eof, done;
+	int64_t next_addr; // address the workers read next
+	int64_t expect; // address of the block the consumer reads next
+	int64_t fpos; // position of fp, which may lag next_addr after a jump in the plan
+	int n_plan, i_plan;
+	int64_t *plan_beg, *plan_end; // blocks starting in [beg, end) are read ahead, range by range
+	mtslot_t *slot;
+	_bgzf_file_t fp;
+	bgzf_map_t *map; // when set, blocks are inflated from the mapping and fp is not read
+	pthread_t *tid;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cv, done_cv;
+};
+
+// Read the compressed block at mt->next_addr into _s_; called with the lock held
+static int mt_read_compressed(mtread_t *mt, mtslot_t *s)
+{
+	uint8_t *cblk = (uint8_t*)s->cblk;
+	int count, remaining;
+	if (mt->map) {
+		mt->map->pos = mt->next_addr;
+		s->src = map_next_block(mt->map, &s->clen, &s->errcode);
+		return s->src? SLOT_READ : s->errcode? SLOT_ERR : SLOT_EOF;
+	}
+	s->src = cblk;
+	if (mt->fpos != mt->next_addr) {
+		if (_bgzf_seek(mt->fp, mt->next_addr, SEEK_SET) < 0) {
+			s->errcode = BGZF_ERR_IO;
+			return SLOT_ERR;
+		}
+		mt->fpos = mt->next_addr;
+	}
+	count = _bgzf_read(mt->fp, cblk, BLOCK_HEADER_LENGTH);
+	if (count > 0) mt->fpos += count;
+	if (count == 0) return SLOT_EOF;
+	if (count != BLOCK_HEADER_LENGTH || !check_header(cblk)) {
+		s->errcode = BGZF_ERR_HEADER;
+		return SLOT_ERR;
+	}
+	s->clen = unpackInt16(&cblk[16]) + 1;
+	remaining = s->clen - BLOCK_HEADER_LENGTH;
+	count = _bgzf_read(mt->fp, &cblk[BLOCK_HEADER_LENGTH], remaining);
+	if (count > 0) mt->fpos += count;
+	if (count != remaining) {
+		s->errcode = BGZF_ERR_IO;
+		return SLOT_ERR;
+	}
+	return SLOT_READ;
+}
+
+/* The address to read after the block at _addr_, which ends at _next_;
+ * -1 once the plan is exhausted. Called with the lock held. */
+static int64_t mt_plan_next(mtread_t *mt, int64_t addr, int64_t next)
+{
+	if (mt->n_plan == 0) return next;
+	if (next < mt->plan_end[mt->i_plan]) return next;
+	while (++mt->i_plan < mt->n_plan) {
+		int64_t beg = mt->plan_beg[mt->i_plan];
+		if (beg != addr) return beg;
+		// the range starts in the block just read
+		if (next < mt->plan_end[mt->i_plan]) return next;
+	}
+	mt->n_plan = mt->i_plan = 0;
+	return -1;
+}
+
+static void *mt_read_worker(void *data)
+{
+	mtread_t *mt = (mtread_t*)data;
+	pthread_mutex_lock(&mt->lock);
+	for (;;) {
+		mtslot_t *s;
+		while (!mt->done && (mt->eof || mt->n_queued == mt->n_slots))
+			pthread_cond_wait(&mt->work_cv, &mt->lock);
+		if (mt->done) break;
+		s = &mt->slot[(mt->head + mt->n_queued) % mt->n_slots];
+		++mt->n_queued;
+		s->addr = mt->next_addr;
+		s->errcode = 0;
+		s->state = mt_read_compressed(mt, s);
+		if (s->state == SLOT_READ) {
+			int ret;
+			mt->next_addr = mt_plan_next(mt, s->addr, s->addr + s->clen);
+			if (mt->next_addr < 0) { // end of the plan; idle until the consumer asks for more
+				mt->next_addr = s->addr + s->clen;
+				mt->eof = 1;
+			}
+			++mt->n_busy;
+			pthread_mutex_unlock(&mt->lock);
+			s->ulen = BGZF_MAX_BLOCK_SIZE;
+			ret = bgzf_uncompress(s->ublk, &s->ulen, s->src, s->clen);
+			pthread_mutex_lock(&mt->lock);
+			--mt->n_busy;
+			if (ret == 0) s->state = SLOT_DONE;
+			else {
+				s->state = SLOT_ERR;
+				s->errcode = BGZF_ERR_ZLIB;
+			}
+		}
+		if (s->state == SLOT_EOF || s->state == SLOT_ERR) mt->eof = 1;
+		pthread_cond_broadcast(&mt->done_cv);
+	}
+	pthread_mutex_unlock(&mt->lock);
+	return 0;
+}
+
+static int mt_read_init(BGZF *fp, int n_threads, int n_slots)
+{
+	int i;
+	mtread_t *mt;
+	pthread_attr_t attr;
+#ifdef _USE_KNETFILE
+	// remote files report errors through the R-facing fprintf; keep them on the calling thread
+	if (((knetFile*)fp->fp)->type != KNF_TYPE_LOCAL) return -1;
+#endif
+	mt = calloc(1, sizeof(mtread_t));
+	mt->n_threads = n_threads;
+	mt->n_slots = n_slots;
+	mt->slot = calloc(n_slots, sizeof(mtslot_t));
+	for (i = 0; i < n_slots; ++i) {
+		mt->slot[i].cblk = malloc(BGZF_MAX_BLOCK_SIZE);
+		mt->slot[i].ublk = malloc(BGZF_MAX_BLOCK_SIZE);
+	}
+	mt->fp = (_bgzf_file_t)fp->fp;
+	mt->map = (bgzf_map_t*)fp->map;
+	mt->fpos = _bgzf_tell(mt->fp);
+	mt->next_addr = mt->expect = mt->map? mt->map->pos : mt->fpos;
+	mt->tid = calloc(n_threads, sizeof(pthread_t));
+	pthread_mutex_init(&mt->lock, 0);
+	pthread_cond_init(&mt->work_cv, 0);
+	pthread_cond_init(&mt->done_cv, 0);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	for (i = 0; i < n_threads; ++i)
+		pthread_create(&mt->tid[i], &attr, mt_read_worker, mt);
+	pthread_attr_destroy(&attr);
+	fp->mt = mt;
+	return 0;
+}
+
+static void mt_read_destroy(mtread_t *mt)
+{
+	int i;
+	pthread_mutex_lock(&mt->lock);
+	mt->done = 1;
+	pthread_cond_broadcast(&mt->work_cv);
+	pthread_mutex_unlock(&mt->lock);
+	for (i = 0; i < mt->n_threads; ++i) pthread_join(mt->tid[i], 0);
+	for (i = 0; i < mt->n_slots; ++i) {
+		free(mt->slot[i].cblk);
+		free(mt->slot[i].ublk);
+	}
+	free(mt->slot); free(mt->tid);
+	free(mt->plan_beg); free(mt->plan_end);
+	pthread_cond_destroy(&mt->done_cv);
+	pthread_cond_destroy(&mt->work_cv);
+	pthread_mutex_destroy(&mt->lock);
+	free(mt);
+}
+
+static int64_t mt_read_tell(mtread_t *mt)
+{
+	int64_t addr;
+	pthread_mutex_lock(&mt->lock);
+	addr = mt->expect;
+	pthread_mutex_unlock(&mt->lock);
+	return addr;
+}
+
+// Whether the block the consumer reads next has already been read ahead
+static int mt_read_queued(mtread_t *mt)
+{
+	int ret;
+	pthread_mutex_lock(&mt->lock);
+	ret = mt->n_queued && mt->slot[mt->head].addr == mt->expect;
+	pthread_mutex_unlock(&mt->lock);
+	return ret;
+}
+
+// Drop the head slot; called with the lock held, and only once the slot is no longer being inflated
+static inline void mt_read_pop(mtread_t *mt)
+{
+	mt->head = (mt->head + 1) % mt->n_slots;
+	--mt->n_queued;
+	pthread_cond_broadcast(&mt->work_cv);
+}
+
+/* Discard read-ahead blocks until the head is the block at mt->expect;
+ * restart the workers there unless they are about to read it. Called
+ * with the lock held. */
+static void mt_read_sync(mtread_t *mt)
+{
+	int64_t addr = mt->expect;
+	while (mt->n_queued) {
+		mtslot_t *s = &mt->slot[mt->head];
+		while (s->state == SLOT_READ)
+			pthread_cond_wait(&mt->done_cv, &mt->lock);
+		if (s->addr == addr) return;
+		mt_read_pop(mt);
+	}
+	// nothing in flight: all queued slots have been drained
+	if (!mt->eof && mt->next_addr == addr) return;
+	if (mt->n_plan) { // stay on the plan if _addr_ is part of it; ranges may repeat, so look ahead first
+		int i, k;
+		for (k = 0; k < mt->n_plan; ++k) {
+			i = (mt->i_plan + k) % mt->n_plan;
+			if (mt->plan_beg[i] <= addr && addr < mt->plan_end[i]) break;
+		}
+		if (k < mt->n_plan) mt->i_plan = i;
+		else mt->n_plan = mt->i_plan = 0;
+	}
+	mt->next_addr = addr;
+	mt->eof = 0;
+	pthread_cond_broadcast(&mt->work_cv);
+}
+
+static int mt_read_seek(mtread_t *mt, int64_t addr)
+{
+	if (addr < 0) return -1;
+	pthread_mutex_lock(&mt->lock);
+	if (mt->map) map_recheck(mt->map); // the workers read it with the lock held
+	mt->expect = addr;
+	mt_read_sync(mt);
+	pthread_mutex_unlock(&mt->lock);
+	return 0;
+}
+
+// Replace the prefetch plan; the workers start on it once the blocks in flight are done
+static void mt_read_plan(mtread_t *mt, int n, const int64_t *beg, const int64_t *end)
+{
+	int i;
+	pthread_mutex_lock(&mt->lock);
+	while (mt->n_queued) { // a worker may be inflating a slot
+		while (mt->slot[mt->head].state == SLOT_READ)
+			pthread_cond_wait(&mt->done_cv, &mt->lock);
+		mt_read_pop(mt);
+	}
+	mt->plan_beg = realloc(mt->plan_beg, n * sizeof(int64_t));
+	mt->plan_end = realloc(mt->plan_end, n * sizeof(int64_t));
+	for (i = 0; i < n; ++i) {
+		mt->plan_beg[i] = beg[i];
+		mt->plan_end[i] = end[i];
+	}
+	mt->n_plan = n;
+	mt->i_plan = 0;
+	if (n) mt->next_addr = beg[0];
+	else mt->next_addr = mt->expect;
+	mt->eof = 0;
+	pthread_cond_broadcast(&mt->work_cv);
+	pthread_mutex_unlock(&mt->lock);
+}
+
+// Hand the next inflated block to _fp_; returns 1 on success, 0 at end-of-file and -1 on error
+static int mt_read_block(BGZF *fp, int *size)
+{
+	mtread_t *mt = (mtread_t*)fp->mt;
+	mtslot_t *s;
+	void *tmp;
+	int ret = 1;
+	pthread_mutex_lock(&mt->lock);
+	mt_read_sync(mt);
+	while (!(mt->n_queued && mt->slot[mt->head].state != SLOT_READ))
+		pthread_cond_wait(&mt->done_cv, &mt->lock);
+	s = &mt->slot[mt->head];
+	switch (s->state) {
+	case SLOT_DONE:
+		tmp = fp->uncompressed_block; fp->uncompressed_block = s->ublk; s->ublk = tmp;
+		if (fp->block_length != 0) fp->block_offset = 0; // Do not reset offset if this read follows a seek.
+		fp->block_address = s->addr;
+		fp->block_length = s->ulen;
+		*size = s->clen;
+		mt->expect = s->addr + s->clen;
+		mt_read_pop(mt);
+		break;
+	case SLOT_EOF:
+		fp->block_length = 0;
+		mt_read_pop(mt);
+		ret = 0;
+		break;
+	default: // the error slot stays at the head until the next seek
+		fp->errcode |= s->errcode;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&mt->lock);
+	return ret;
+}
+
 int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks)
 {
 	int i;
 	mtaux_t *mt;
 	pthread_attr_t attr;
-	if (!fp->is_write || fp->mt || n_threads <= 1) return -1;
+	if (fp->mt) return -1;
+	if (!fp->is_write)
+		return n_threads < 1? -1 : mt_read_init(fp, n_threads, n_threads * n_sub_blks);
+	if (n_threads <= 1) return -1;
 	mt = calloc(1, sizeof(mtaux_t));
 	mt->n_threads = n_threads;
 	mt->n_blks = n_threads * n_sub_blks;
@@ -589,43 +1424,136 @@ ssize_t bgzf_write(BGZF *fp, const void *data, ssize_t length)
 
 int bgzf_close(BGZF* fp)
 {
-	int ret, count, block_length;
+	int ret;
 	if (fp == 0) return -1;
 	if (fp->is_write) {
 		if (bgzf_flush(fp) != 0) return -1;
-		fp->compress_level = -1;
-		block_length = deflate_block(fp, 0); // write an empty block
-		count = fwrite(fp->compressed_block, 1, block_length, fp->fp);
+		if (fwrite(g_eof_block, 1, sizeof g_eof_block, fp->fp) != sizeof g_eof_block) { // write an empty block
+			fp->errcode |= BGZF_ERR_IO;
+			return -1;
+		}
 		if (fflush(fp->fp) != 0) {
 			fp->errcode |= BGZF_ERR_IO;
 			return -1;
 		}
 		if (fp->mt) mt_destroy(fp->mt);
+	} else {
+		if (fp->mt) mt_read_destroy(fp->mt);
+		if (fp->map) map_detach(fp);
 	}
 	ret = fp->is_write? fclose(fp->fp) : _bgzf_close(fp->fp);
 	if (ret != 0) return -1;
 	free(fp->uncompressed_block);
 	free(fp->compressed_block);
-	free_cache(fp);
 	free(fp);
 	return 0;
 }
 
 void bgzf_set_cache_size(BGZF *fp, int cache_size)
 {
-	if (fp) fp->cache_size = cache_size;
+#ifdef BGZF_CACHE
+	if (fp == 0 || fp->is_write) return;
+	if (cache_size <= 0) fp->cache = 0;
+	else if (fp->cache_id) {
+		fp->cache = &g_cache;
+		bgzf_cache_resize(cache_size);
+	}
+#endif
+}
+
+#define BGZF_PREFETCH_HINT_MAX (64 * 1024 * 1024) // bytes hinted to the kernel per bgzf_prefetch()
+
+int bgzf_prefetch(BGZF *fp, int n, const int64_t *beg, const int64_t *end)
+{
+	int i;
+	int64_t total = 0;
+	if (fp->is_write) return -1;
+	if (fp->mt) {
+		mt_read_plan((mtread_t*)fp->mt, n, beg, end);
+		return 0;
+	}
+#ifdef BGZF_MMAP
+	// no worker threads: ask the kernel to start reading the ranges
+	for (i = 0; i < n && total < BGZF_PREFETCH_HINT_MAX; ++i) {
+		int64_t len = end[i] - beg[i] + BGZF_MAX_BLOCK_SIZE; // the last block starts before end[i]
+		if (fp->map) {
+			bgzf_map_t *map = (bgzf_map_t*)fp->map;
+			int64_t page = sysconf(_SC_PAGESIZE), off = beg[i] / page * page;
+			if (off >= map->size) continue;
+			if (off + len + page > map->size) len = map->size - off;
+			else len += page;
+			posix_madvise((void*)(map->base + off), len, POSIX_MADV_WILLNEED);
+		} else {
+#if defined(POSIX_FADV_WILLNEED) && defined(_USE_KNETFILE)
+			knetFile *kf = (knetFile*)fp->fp;
+			if (kf->type != KNF_TYPE_LOCAL) return -1;
+			posix_fadvise(kf->fd, beg[i], len, POSIX_FADV_WILLNEED);
+#elif defined(POSIX_FADV_WILLNEED)
+			posix_fadvise(fileno((FILE*)fp->fp), beg[i], len, POSIX_FADV_WILLNEED);
+#else
+			return -1;
+#endif
+		}
+		total += len;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int bgzf_advise(BGZF *fp, int advice)
+{
+#ifdef BGZF_MMAP
+	if (fp->is_write) return -1;
+	if (fp->map) {
+		bgzf_map_t *map = (bgzf_map_t*)fp->map;
+		int adv = advice == BGZF_ADVICE_SEQUENTIAL? POSIX_MADV_SEQUENTIAL :
+			advice == BGZF_ADVICE_RANDOM? POSIX_MADV_RANDOM : POSIX_MADV_NORMAL;
+		return posix_madvise((void*)map->base, map->size, adv) == 0? 0 : -1;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	{
+		int adv = advice == BGZF_ADVICE_SEQUENTIAL? POSIX_FADV_SEQUENTIAL :
+			advice == BGZF_ADVICE_RANDOM? POSIX_FADV_RANDOM : POSIX_FADV_NORMAL;
+#ifdef _USE_KNETFILE
+		knetFile *kf = (knetFile*)fp->fp;
+		if (kf->type != KNF_TYPE_LOCAL) return -1;
+		return posix_fadvise(kf->fd, 0, 0, adv) == 0? 0 : -1;
+#else
+		return posix_fadvise(fileno((FILE*)fp->fp), 0, 0, adv) == 0? 0 : -1;
+#endif
+	}
+#endif
+#endif
+	return -1;
 }
 
 int bgzf_check_EOF(BGZF *fp)
 {
-	static uint8_t magic[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+	const uint8_t *magic = g_eof_block;
 	uint8_t buf[28];
 	off_t offset;
+	int ret = 0;
+	mtread_t *mt = fp->is_write? 0 : (mtread_t*)fp->mt;
+	if (fp->map) {
+		bgzf_map_t *map = (bgzf_map_t*)fp->map;
+		if (mt) pthread_mutex_lock(&mt->lock);
+		map_recheck(map);
+		ret = map->size == map->len && map->len >= 28
+			&& memcmp(magic, map->base + map->len - 28, 28) == 0;
+		if (mt) pthread_mutex_unlock(&mt->lock);
+		return ret;
+	}
+	if (mt) pthread_mutex_lock(&mt->lock); // the read-ahead workers share the file position
 	offset = _bgzf_tell((_bgzf_file_t)fp->fp);
-	if (_bgzf_seek(fp->fp, -28, SEEK_END) < 0) return 0;
-	_bgzf_read(fp->fp, buf, 28);
-	_bgzf_seek(fp->fp, offset, SEEK_SET);
-	return (memcmp(magic, buf, 28) == 0)? 1 : 0;
+	if (_bgzf_seek(fp->fp, -28, SEEK_END) >= 0) {
+		_bgzf_read(fp->fp, buf, 28);
+		_bgzf_seek(fp->fp, offset, SEEK_SET);
+		ret = (memcmp(magic, buf, 28) == 0)? 1 : 0;
+	}
+	if (mt) pthread_mutex_unlock(&mt->lock);
+	return ret;
 }
 
 int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
@@ -639,7 +1567,11 @@ int64_t bgzf_seek(BGZF* fp, int64_t pos, int where)
 	}
 	block_offset = pos & 0xFFFF;
 	block_address = pos >> 16;
-	if (_bgzf_seek(fp->fp, block_address, SEEK_SET) < 0) {
+	if (fp->block_length > 0 && block_address == fp->block_address) { // within the block already loaded
+		fp->block_offset = block_offset;
+		return 0;
+	}
+	if (bgzf_raw_seek(fp, block_address) < 0) {
 		fp->errcode |= BGZF_ERR_IO;
 		return -1;
 	}
@@ -670,7 +1602,7 @@ int bgzf_getc(BGZF *fp)
 	}
 	c = ((unsigned char*)fp->uncompressed_block)[fp->block_offset++];
     if (fp->block_offset == fp->block_length) {
-        fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+        fp->block_address = bgzf_raw_tell(fp);
         fp->block_offset = 0;
         fp->block_length = 0;
     }
@@ -684,13 +1616,15 @@ int bgzf_getc(BGZF *fp)
 int bgzf_getline(BGZF *fp, int delim, kstring_t *str)
 {
 	int l, state = 0;
-	unsigned char *buf = (unsigned char*)fp->uncompressed_block;
+	unsigned char *buf;
 	str->l = 0;
 	do {
 		if (fp->block_offset >= fp->block_length) {
 			if (bgzf_read_block(fp) != 0) { state = -2; break; }
 			if (fp->block_length == 0) { state = -1; break; }
 		}
+		// read-ahead swaps in a new uncompressed block on each read
+		buf = (unsigned char*)fp->uncompressed_block;
 		for (l = fp->block_offset; l < fp->block_length && buf[l] != delim; ++l);
 		if (l < fp->block_length) state = 1;
 		l -= fp->block_offset;
@@ -703,7 +1637,7 @@ int bgzf_getline(BGZF *fp, int delim, kstring_t *str)
 		str->l += l;
 		fp->block_offset += l + 1;
 		if (fp->block_offset >= fp->block_length) {
-			fp->block_address = _bgzf_tell((_bgzf_file_t)fp->fp);
+			fp->block_address = bgzf_raw_tell(fp);
 			fp->block_offset = 0;
 			fp->block_length = 0;
 		} 
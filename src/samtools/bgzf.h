@@ -41,15 +41,20 @@
 #define BGZF_ERR_IO     4
 #define BGZF_ERR_MISUSE 8
 
+#define BGZF_ADVICE_NORMAL     0
+#define BGZF_ADVICE_SEQUENTIAL 1
+#define BGZF_ADVICE_RANDOM     2
+
 typedef struct {
 	int errcode:16, is_write:2, compress_level:14;
-	int cache_size;
+	int cache_id; // id of the file in the shared block cache; 0 if unknown
     int block_length, block_offset;
     int64_t block_address;
     void *uncompressed_block, *compressed_block;
-	void *cache; // a pointer to a hash table
+	void *cache; // the shared block cache; 0 if not in use
 	void *fp; // actual file handler; FILE* on writing; FILE* or knetFile* on reading
 	void *mt; // only used for multi-threading
+	void *map; // read-only mapping of a local input file; 0 if reading through fp
 } BGZF;
 
 #ifndef KSTRING_T
@@ -82,6 +87,12 @@ extern "C" {
 
 	/**
 	 * Open the specified file for reading or writing.
+	 *
+	 * A local regular file opened for reading is memory mapped; other
+	 * files are read with read(). The file size is checked again at each
+	 * seek and by bgzf_check_EOF(), so a mapped file that shrinks while
+	 * open reads as truncated (BGZF_ERR_IO) from then on; a file
+	 * truncated while it is read sequentially may still raise SIGBUS.
 	 */
 	BGZF* bgzf_open(const char* path, const char *mode);
 
@@ -103,6 +114,31 @@ extern "C" {
 	 */
 	ssize_t bgzf_read(BGZF *fp, void *data, ssize_t length);
 
+	/**
+	 * Consume the next _length_ bytes without copying them, if they lie
+	 * in one block. The block is loaded first if the current one is used
+	 * up. The data must not be modified and is valid until the next read
+	 * from _fp_.
+	 *
+	 * @param fp     BGZF file handler
+	 * @param length number of bytes to consume
+	 * @return       pointer to the bytes in the uncompressed block; NULL,
+	 *               with nothing consumed, if they cross a block boundary,
+	 *               at end-of-file or on error (bgzf_read() tells which)
+	 */
+	const void *bgzf_read_view(BGZF *fp, int length);
+
+	/**
+	 * Skip the next _length_ bytes, loading blocks as needed but copying
+	 * nothing.
+	 *
+	 * @param fp     BGZF file handler
+	 * @param length number of bytes to skip
+	 * @return       number of bytes skipped, less than _length_ at
+	 *               end-of-file; or -1 on error
+	 */
+	ssize_t bgzf_skip(BGZF *fp, ssize_t length);
+
 	/**
 	 * Write _length_ bytes from _data_ to the file.
 	 *
@@ -157,13 +193,97 @@ extern "C" {
 	 *********************/
 
 	/**
-	 * Set the cache size. Only effective when compiled with -DBGZF_CACHE.
+	 * Set the size of the block cache and let _fp_ use it. Only effective
+	 * when compiled with -DBGZF_CACHE.
+	 *
+	 * Inflated blocks are cached in a single least-recently-used cache
+	 * shared by all readers of the process; readers opened on the same
+	 * file (same device and inode, size and modification time) share
+	 * blocks. Readers use the cache by default; its size is 0 (off) until
+	 * set here or with bgzf_cache_resize().
 	 *
 	 * @param fp    BGZF file handler
-	 * @param size  size of cache in bytes; 0 to disable caching (default)
+	 * @param size  size of the shared cache in bytes; 0 to stop _fp_ from using the cache
 	 */
 	void bgzf_set_cache_size(BGZF *fp, int size);
 
+	typedef struct {
+		int64_t capacity, used; // in bytes, including per-block overhead
+		int n_blocks, n_files;
+		uint64_t hits, misses, evictions;
+	} bgzf_cache_stats_t;
+
+	/**
+	 * Set the size of the shared block cache, evicting the least recently
+	 * used blocks as needed.
+	 *
+	 * @param size  size in bytes; 0 to disable caching
+	 */
+	void bgzf_cache_resize(int64_t size);
+
+	/**
+	 * Drop all cached blocks and reset the hit, miss and eviction counts.
+	 */
+	void bgzf_cache_clear(void);
+
+	/**
+	 * Report the size, occupancy and hit, miss and eviction counts of the
+	 * shared block cache.
+	 */
+	void bgzf_cache_stats(bgzf_cache_stats_t *stats);
+
+	/**
+	 * Announce the blocks that are about to be read, e.g., the chunks of
+	 * an index query, so that they can be fetched in the background.
+	 * With bgzf_mt() worker threads, the workers read ahead and inflate
+	 * the blocks starting in [beg[i], end[i]), range by range in the
+	 * order given, instead of reading sequentially; once the plan is
+	 * used up they wait, and read ahead sequentially from the next
+	 * block the reader asks for. Without worker threads
+	 * the ranges of a local file are passed to the kernel as
+	 * will-need hints. Reads return the same data with or without a plan.
+	 *
+	 * @param fp   BGZF file handler opened for reading
+	 * @param n    number of ranges; 0 clears the plan
+	 * @param beg  compressed address of the first block of each range
+	 * @param end  upper bound (exclusive) on the addresses of the blocks of each range
+	 * @return     0 on success; -1 if the ranges cannot be prefetched
+	 */
+	int bgzf_prefetch(BGZF *fp, int n, const int64_t *beg, const int64_t *end);
+
+	/**
+	 * Select the codec that deflates and inflates BGZF blocks, for all
+	 * files: "zlib", or "libdeflate" when built with BGZF_LIBDEFLATE. The
+	 * fastest available codec is the default. Blocks written with any
+	 * codec are read by all.
+	 *
+	 * @param name  name of the codec; NULL to query the current one
+	 * @return      name of the current codec; NULL if _name_ is not available
+	 */
+	const char *bgzf_codec(const char *name);
+
+	/**
+	 * List the available codecs, fastest first.
+	 *
+	 * @param names  array receiving at most _n_ codec names
+	 * @return       number of available codecs
+	 */
+	int bgzf_codec_list(const char **names, int n);
+
+	/**
+	 * Tell the kernel how the file will be read, so that it can tune
+	 * read-ahead: BGZF_ADVICE_SEQUENTIAL for whole-file scans,
+	 * BGZF_ADVICE_RANDOM for index-driven queries, BGZF_ADVICE_NORMAL to
+	 * restore the default. Local files opened for reading are memory
+	 * mapped and the advice applies to the mapping; otherwise it is passed
+	 * to posix_fadvise() where available.
+	 *
+	 * @param fp      BGZF file handler opened for reading
+	 * @param advice  one of BGZF_ADVICE_NORMAL, _SEQUENTIAL or _RANDOM
+	 * @return        0 on success; -1 if the advice could not be given
+	 */
+	int bgzf_advise(BGZF *fp, int advice);
+
 	/**
 	 * Flush the file if the remaining buffer size is smaller than _size_ 
 	 */
@@ -192,11 +312,17 @@ extern "C" {
 	int bgzf_read_block(BGZF *fp);
 
 	/**
-	 * Enable multi-threading (only effective on writing)
+	 * Enable multi-threading. On writing, blocks are compressed in parallel.
+	 * On reading, _n_threads_ background threads read up to
+	 * n_threads*n_sub_blks blocks ahead of the current position and inflate
+	 * them in parallel; blocks are still returned in file order. Reading
+	 * threads are only started for local files.
 	 *
-	 * @param fp          BGZF file handler; must be opened for writing
-	 * @param n_threads   #threads used for writing
+	 * @param fp          BGZF file handler
+	 * @param n_threads   #threads used for writing (>1) or reading (>=1)
 	 * @param n_sub_blks  #blocks processed by each thread; a value 64-256 is recommended
+	 *                    for writing, 4-16 for reading
+	 * @return            0 on success; -1 if threads are already enabled or cannot be used
 	 */
 	int bgzf_mt(BGZF *fp, int n_threads, int n_sub_blks);
 
@@ -36,6 +36,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "razf.h"
 
 
@@ -144,14 +145,28 @@ static void load_zindex(RAZF *rz, int fd){
 	}
 }
 
+/* compression level from a mode such as "w9"; RZ_COMPRESS_LEVEL by default */
+static int mode2level(const char *mode)
+{
+	int i;
+	for (i = 0; mode[i]; ++i)
+		if (mode[i] >= '0' && mode[i] <= '9') return mode[i] - '0';
+	return RZ_COMPRESS_LEVEL;
+}
+
 #ifdef _RZ_READONLY
-static RAZF* razf_open_w(int fd)
+static RAZF* razf_open_w(int fd, int level)
 {
 	fprintf(stderr, "[razf_open_w] Writing is not available with zlib ver < 1.2.2.1\n");
 	return 0;
 }
+
+int razf_mt(RAZF *rz, int n_threads, int n_sub_blks)
+{
+	return -1;
+}
 #else
-static RAZF* razf_open_w(int fd){
+static RAZF* razf_open_w(int fd, int level){
 	RAZF *rz;
 #ifdef _WIN32
 	setmode(fd, O_BINARY);
@@ -167,7 +182,8 @@ static RAZF* razf_open_w(int fd){
 	rz->inbuf  = malloc(RZ_BUFFER_SIZE);
 	rz->outbuf = malloc(RZ_BUFFER_SIZE);
 	rz->index = calloc(sizeof(ZBlockIndex), 1);
-	deflateInit2(rz->stream, RZ_COMPRESS_LEVEL, Z_DEFLATED, WINDOW_BITS + 16, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+	rz->compress_level = level;
+	deflateInit2(rz->stream, level, Z_DEFLATED, WINDOW_BITS + 16, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY);
 	rz->stream->avail_out = RZ_BUFFER_SIZE;
 	rz->stream->next_out  = rz->outbuf;
 	rz->header = calloc(sizeof(gz_header), 1);
@@ -286,9 +302,12 @@ static void _razf_buffered_write(RAZF *rz, const void *data, int size){
 	}
 }
 
+static int mt_write(RAZF *rz, const void *data, int size);
+
 int razf_write(RAZF* rz, const void *data, int size){
 	int ori_size, n;
 	int64_t next_block;
+	if(rz->mt) return mt_write(rz, data, size);
 	ori_size = size;
 	next_block = ((rz->in / RZ_BLOCK_SIZE) + 1) * RZ_BLOCK_SIZE;
 	while(rz->in + rz->buf_len + size >= next_block){
@@ -303,6 +322,207 @@ int razf_write(RAZF* rz, const void *data, int size){
 	_razf_buffered_write(rz, data, size);
 	return ori_size;
 }
+
+/***** BEGIN: multi-threading *****/
+
+/* Blocks are collected n_blks at a time and deflated concurrently, each
+ * with a fresh raw deflate stream ending in a full flush (or, for the
+ * last block, Z_FINISH), which is what the serial writer produces at
+ * block boundaries. The master thread then writes them in order and
+ * keeps the index, CRC and gzip trailer. */
+
+typedef struct {
+	struct rz_mtaux_t *mt;
+	z_stream zs;
+	int i, seen;
+} rz_worker_t;
+
+typedef struct rz_mtaux_t {
+	int n_threads, n_blks, curr, finish, batch, n_done, done, errcode;
+	uint8_t **blk, **cblk;
+	int *len, *clen, cap;
+	uint32_t *crc, crc_all;
+	rz_worker_t *w;
+	pthread_t *tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cv, done_cv;
+} rz_mtaux_t;
+
+static int rz_fd(RAZF *rz)
+{
+#ifdef _USE_KNETFILE
+	return rz->x.fpw;
+#else
+	return rz->filedes;
+#endif
+}
+
+static void mt_deflate(rz_worker_t *w)
+{
+	rz_mtaux_t *mt = w->mt;
+	int i;
+	for (i = w->i; i < mt->curr; i += mt->n_threads) {
+		int flush = (mt->finish && i == mt->curr - 1)? Z_FINISH : Z_FULL_FLUSH, ret;
+		deflateReset(&w->zs);
+		w->zs.next_in = mt->blk[i];
+		w->zs.avail_in = mt->len[i];
+		w->zs.next_out = mt->cblk[i];
+		w->zs.avail_out = mt->cap;
+		ret = deflate(&w->zs, flush);
+		if (ret != (flush == Z_FINISH? Z_STREAM_END : Z_OK) || w->zs.avail_in != 0)
+			mt->errcode = 1;
+		mt->clen[i] = mt->cap - w->zs.avail_out;
+		mt->crc[i] = crc32(crc32(0L, Z_NULL, 0), mt->blk[i], mt->len[i]);
+	}
+}
+
+static void *mt_worker(void *data)
+{
+	rz_worker_t *w = (rz_worker_t*)data;
+	rz_mtaux_t *mt = w->mt;
+	pthread_mutex_lock(&mt->lock);
+	for (;;) {
+		while (!mt->done && w->seen == mt->batch)
+			pthread_cond_wait(&mt->cv, &mt->lock);
+		if (mt->done) break;
+		w->seen = mt->batch;
+		pthread_mutex_unlock(&mt->lock);
+		mt_deflate(w);
+		pthread_mutex_lock(&mt->lock);
+		if (++mt->n_done == mt->n_threads - 1)
+			pthread_cond_signal(&mt->done_cv);
+	}
+	pthread_mutex_unlock(&mt->lock);
+	return 0;
+}
+
+// deflate the collected blocks and write them out; the last one ends the stream if _finish_
+static int mt_flush(RAZF *rz, int finish)
+{
+	rz_mtaux_t *mt = (rz_mtaux_t*)rz->mt;
+	int i;
+	pthread_mutex_lock(&mt->lock);
+	mt->finish = finish;
+	mt->n_done = 0;
+	++mt->batch;
+	pthread_cond_broadcast(&mt->cv);
+	pthread_mutex_unlock(&mt->lock);
+	mt_deflate(&mt->w[0]); // the master thread is worker 0
+	pthread_mutex_lock(&mt->lock);
+	while (mt->n_done < mt->n_threads - 1)
+		pthread_cond_wait(&mt->done_cv, &mt->lock);
+	pthread_mutex_unlock(&mt->lock);
+	for (i = 0; i < mt->curr; ++i) {
+		if (write(rz_fd(rz), mt->cblk[i], mt->clen[i]) != mt->clen[i])
+			mt->errcode = 1;
+		mt->crc_all = crc32_combine(mt->crc_all, mt->crc[i], mt->len[i]);
+		rz->in += mt->len[i];
+		rz->out += mt->clen[i];
+		if (!(finish && i == mt->curr - 1)) add_zindex(rz, rz->in, rz->out);
+		mt->len[i] = 0;
+	}
+	mt->curr = 0;
+	return mt->errcode? -1 : 0;
+}
+
+static int mt_write(RAZF *rz, const void *data, int size)
+{
+	rz_mtaux_t *mt = (rz_mtaux_t*)rz->mt;
+	const uint8_t *input = (const uint8_t*)data;
+	int remaining = size;
+	while (remaining > 0) {
+		int n = RZ_BLOCK_SIZE - mt->len[mt->curr];
+		if (n > remaining) n = remaining;
+		memcpy(mt->blk[mt->curr] + mt->len[mt->curr], input, n);
+		mt->len[mt->curr] += n;
+		input += n;
+		remaining -= n;
+		if (mt->len[mt->curr] == RZ_BLOCK_SIZE && ++mt->curr == mt->n_blks)
+			if (mt_flush(rz, 0) != 0) return -1;
+	}
+	return size;
+}
+
+// finish the stream: the pending blocks, then the gzip trailer
+static int mt_finish(RAZF *rz)
+{
+	rz_mtaux_t *mt = (rz_mtaux_t*)rz->mt;
+	uint8_t trailer[8];
+	int i, ret;
+	++mt->curr; // the partial, possibly empty, last block
+	ret = mt_flush(rz, 1);
+	for (i = 0; i < 4; ++i) {
+		trailer[i] = (mt->crc_all >> (8 * i)) & 0xff;
+		trailer[i + 4] = ((uint64_t)rz->in >> (8 * i)) & 0xff;
+	}
+	if (write(rz_fd(rz), trailer, 8) != 8) ret = -1;
+	rz->out += 8;
+	return ret;
+}
+
+static void mt_destroy(rz_mtaux_t *mt)
+{
+	int i;
+	pthread_mutex_lock(&mt->lock);
+	mt->done = 1;
+	pthread_cond_broadcast(&mt->cv);
+	pthread_mutex_unlock(&mt->lock);
+	for (i = 1; i < mt->n_threads; ++i) pthread_join(mt->tid[i], 0);
+	for (i = 0; i < mt->n_threads; ++i) deflateEnd(&mt->w[i].zs);
+	for (i = 0; i < mt->n_blks; ++i) {
+		free(mt->blk[i]);
+		free(mt->cblk[i]);
+	}
+	free(mt->blk); free(mt->cblk); free(mt->len); free(mt->clen); free(mt->crc);
+	free(mt->w); free(mt->tid);
+	pthread_cond_destroy(&mt->cv);
+	pthread_cond_destroy(&mt->done_cv);
+	pthread_mutex_destroy(&mt->lock);
+	free(mt);
+}
+
+int razf_mt(RAZF *rz, int n_threads, int n_sub_blks)
+{
+	rz_mtaux_t *mt;
+	uint8_t header[19] = { 0x1f, 0x8b, Z_DEFLATED, 0x04, 0, 0, 0, 0, 0, 0x03, 7, 0,
+						   'R', 'A', 'Z', 'F', 1, RZ_BLOCK_SIZE >> 8, RZ_BLOCK_SIZE & 0xff };
+	int i, level = rz->compress_level;
+	if (rz->mode != 'w' || rz->mt || rz->in != 0 || n_threads < 1 || n_sub_blks < 1) return -1;
+	// the same gzip header as razf_open_w() asks of zlib, including its extra flags
+	header[8] = level == 9? 2 : (level >= 0 && level < 2)? 4 : 0;
+	if (write(rz_fd(rz), header, sizeof header) != sizeof header) return -1;
+	rz->out = sizeof header;
+	mt = calloc(1, sizeof(rz_mtaux_t));
+	mt->n_threads = n_threads;
+	mt->n_blks = n_threads * n_sub_blks;
+	mt->cap = deflateBound(rz->stream, RZ_BLOCK_SIZE) + 64; // room for the flush marker
+	mt->blk = calloc(mt->n_blks, sizeof(uint8_t*));
+	mt->cblk = calloc(mt->n_blks, sizeof(uint8_t*));
+	for (i = 0; i < mt->n_blks; ++i) {
+		mt->blk[i] = malloc(RZ_BLOCK_SIZE);
+		mt->cblk[i] = malloc(mt->cap);
+	}
+	mt->len = calloc(mt->n_blks, sizeof(int));
+	mt->clen = calloc(mt->n_blks, sizeof(int));
+	mt->crc = calloc(mt->n_blks, sizeof(uint32_t));
+	mt->crc_all = crc32(0L, Z_NULL, 0);
+	mt->w = calloc(n_threads, sizeof(rz_worker_t));
+	mt->tid = calloc(n_threads, sizeof(pthread_t)); // tid[0] is not used; the master is worker 0
+	pthread_mutex_init(&mt->lock, 0);
+	pthread_cond_init(&mt->cv, 0);
+	pthread_cond_init(&mt->done_cv, 0);
+	for (i = 0; i < n_threads; ++i) {
+		mt->w[i].mt = mt;
+		mt->w[i].i = i;
+		deflateInit2(&mt->w[i].zs, level, Z_DEFLATED, -WINDOW_BITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+	}
+	for (i = 1; i < n_threads; ++i)
+		pthread_create(&mt->tid[i], 0, mt_worker, &mt->w[i]);
+	rz->mt = mt;
+	return 0;
+}
+
+/***** END: multi-threading *****/
 #endif
 
 /* gzip flag byte */
@@ -467,7 +687,7 @@ static RAZF* razf_open_r(int fd, int _load_index){
 #ifdef _USE_KNETFILE
 RAZF* razf_dopen(int fd, const char *mode){
     if (strstr(mode, "r")) fprintf(stderr,"[razf_dopen] implement me\n");
-    else if(strstr(mode, "w")) return razf_open_w(fd);
+    else if(strstr(mode, "w")) return razf_open_w(fd, mode2level(mode));
 	return NULL;
 }
 
@@ -479,14 +699,14 @@ RAZF* razf_dopen2(int fd, const char *mode)
 #else
 RAZF* razf_dopen(int fd, const char *mode){
 	if(strstr(mode, "r")) return razf_open_r(fd, 1);
-	else if(strstr(mode, "w")) return razf_open_w(fd);
+	else if(strstr(mode, "w")) return razf_open_w(fd, mode2level(mode));
 	else return NULL;
 }
 
 RAZF* razf_dopen2(int fd, const char *mode)
 {
 	if(strstr(mode, "r")) return razf_open_r(fd, 0);
-	else if(strstr(mode, "w")) return razf_open_w(fd);
+	else if(strstr(mode, "w")) return razf_open_w(fd, mode2level(mode));
 	else return NULL;
 }
 #endif
@@ -517,7 +737,7 @@ static inline RAZF* _razf_open(const char *filename, const char *mode, int _load
 		fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 #endif
 		if(fd < 0) return NULL;
-		rz = razf_open_w(fd);
+		rz = razf_open_w(fd, mode2level(mode));
 	} else return NULL;
 	return rz;
 }
@@ -800,10 +1020,18 @@ int64_t razf_seek2(RAZF *rz, uint64_t voffset, int where)
 void razf_close(RAZF *rz){
 	if(rz->mode == 'w'){
 #ifndef _RZ_READONLY
-		razf_end_flush(rz);
-		deflateEnd(rz->stream);
-		razf_flush(rz);                  /* MTM */
-		add_zindex(rz, rz->in, rz->out); /* MTM */
+		if(rz->mt){
+			mt_finish(rz);
+			mt_destroy((rz_mtaux_t*)rz->mt);
+			rz->mt = NULL;
+			deflateEnd(rz->stream);
+			add_zindex(rz, rz->in, rz->out);
+		} else {
+			razf_end_flush(rz);
+			deflateEnd(rz->stream);
+			razf_flush(rz);                  /* MTM */
+			add_zindex(rz, rz->in, rz->out); /* MTM */
+		}
 #ifdef _USE_KNETFILE
 		save_zindex(rz, rz->x.fpw);
 		if(is_big_endian()){
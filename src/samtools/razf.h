@@ -107,6 +107,8 @@ typedef struct RandomAccessZFile  {
 	/* Indice where the source is seekable */
 	int load_index;
 	/* set has_index to 0 in mode 'w', then index will be discarded */
+	int compress_level;
+	void *mt; /* multi-threaded block compression, see razf_mt() */
 } RAZF;
 
 #ifdef __cplusplus
@@ -120,6 +122,16 @@ extern "C" {
 	int64_t razf_seek(RAZF* rz, int64_t pos, int where);
 	void razf_close(RAZF* rz);
 
+	/*
+	 * Compress blocks of a RAZF opened for writing with _n_threads_
+	 * threads, _n_sub_blks_ blocks per thread at a time. Must be called
+	 * before the first razf_write(). The output is a valid RAZF file,
+	 * written with a fresh deflate stream for each block.
+	 *
+	 * @return 0 on success and -1 otherwise
+	 */
+	int razf_mt(RAZF *rz, int n_threads, int n_sub_blks);
+
 #define razf_tell(rz) ((rz)->out)
 
 	RAZF* razf_open2(const char *filename, const char *mode);
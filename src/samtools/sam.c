@@ -138,6 +138,18 @@ int samread(samfile_t *fp, bam1_t *b)
 	else return sam_read1(fp->x.tamr, fp->header, b);
 }
 
+int samread_view(samfile_t *fp, bam1_t *v, bam1_t *b)
+{
+	int ret;
+	if (fp == 0 || !(fp->type & TYPE_READ)) return -1; // not open for reading
+	if (fp->type & TYPE_BAM) return bam_read1_view(fp->x.bam, v, b);
+	if ((ret = sam_read1(fp->x.tamr, fp->header, b)) >= 0) {
+		*v = *b;
+		v->m_data = 0;
+	}
+	return ret;
+}
+
 int samwrite(samfile_t *fp, const bam1_t *b)
 {
 	if (fp == 0 || (fp->type & TYPE_READ)) return -1; // not open for writing
@@ -72,6 +72,15 @@ extern "C" {
 	 */
 	int samread(samfile_t *fp, bam1_t *b);
 
+	/*!
+	  @abstract     Read one alignment as a view, see bam_read1_view()
+	  @param  fp    file handler
+	  @param  v     view of the alignment, valid until the next read
+	  @param  b     alignment holding copies when a view is not possible
+	  @return       bytes read
+	 */
+	int samread_view(samfile_t *fp, bam1_t *v, bam1_t *b);
+
 	/*!
 	  @abstract     Write one alignment
 	  @param  fp    file handler
@@ -1,18 +1,261 @@
+#include <limits.h>
+#include <string.h>
 #include "scan_bam_data.h"
 #include "utilities.h"
 
-/* _SCAN_BAM_DATA */
+/* _CHUNKS */
 
-SCAN_BAM_DATA _init_SCAN_BAM_DATA(SEXP result)
+static void _init_CHUNKS(_CHUNKS *c, size_t eltsize, const void *fill)
 {
-    SCAN_BAM_DATA sbd = Calloc(1, _SCAN_BAM_DATA);
-    sbd->cigarhash = kh_init(str);
-    sbd->result = result;
-    sbd->mates_flag = NA_LOGICAL;
-    sbd->partition_id = 0;
-    return sbd;
+    memset(c, 0, sizeof(_CHUNKS));
+    c->eltsize = eltsize;
+    memcpy(c->fill, fill, eltsize);
+}
+
+/* room for 'len' elements; 0 releases the chunks */
+void _grow_CHUNKS(_CHUNKS *c, int len)
+{
+    if (0 == len) {
+        for (int i = 0; i < c->n; ++i)
+            Free(c->chunk[i]);
+        Free(c->chunk);
+        c->n = c->size = 0;
+        return;
+    }
+    int n = (len + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+    if (n > c->size) {
+        int size = c->size ? c->size : 16;
+        while (n > size)
+            size *= 2;
+        c->chunk = Realloc(c->chunk, size, char *);
+        c->size = size;
+    }
+    for (; c->n < n; ++c->n) {
+        char *chunk = Calloc(CHUNK_SIZE * c->eltsize, char);
+        for (int j = 0; j < CHUNK_SIZE; ++j)
+            memcpy(chunk + j * c->eltsize, c->fill, c->eltsize);
+        c->chunk[c->n] = chunk;
+    }
 }
 
+/* the first 'len' elements, contiguous in 'dest' */
+static void _copy_CHUNKS(_CHUNKS *c, void *dest, int len)
+{
+    char *d = (char *) dest;
+    for (int i = 0; len > 0; ++i) {
+        int n = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+        if (i < c->n)
+            memcpy(d, c->chunk[i], n * c->eltsize);
+        else                    /* never grown: new elements */
+            for (int j = 0; j < n; ++j)
+                memcpy(d + j * c->eltsize, c->fill, c->eltsize);
+        d += n * c->eltsize;
+        len -= n;
+    }
+}
+
+static SEXP _as_integer_CHUNKS(_CHUNKS *c, int len)
+{
+    SEXP s = NEW_INTEGER(len);
+    _copy_CHUNKS(c, INTEGER(s), len);
+    _grow_CHUNKS(c, 0);
+    return s;
+}
+
+/* _CHAR_ARENA */
+
+static void _init_CHAR_ARENA(_CHAR_ARENA *arena)
+{
+    const int na = -1;
+    arena->bytes = NULL;
+    arena->n = arena->size = 0;
+    _init_CHUNKS(&arena->width, sizeof(int), &na);
+}
+
+static void _grow_CHAR_ARENA(_CHAR_ARENA *arena, int len)
+{
+    _grow_CHUNKS(&arena->width, len);
+    if (len == 0) {
+        Free(arena->bytes);
+        arena->n = arena->size = 0;
+    }
+}
+
+static void _Free_CHAR_ARENA(_CHAR_ARENA *arena)
+{
+    _grow_CHAR_ARENA(arena, 0);
+}
+
+/* space for 'width' bytes of element 'idx', appended to the arena */
+char *_reserve_CHAR_ARENA(_CHAR_ARENA *arena, int idx, int width)
+{
+    if (arena->n + width > arena->size) {
+        size_t size = arena->size ? arena->size : 65536;
+        while (arena->n + width > size)
+            size *= 2;
+        arena->bytes = Realloc(arena->bytes, size, char);
+        arena->size = size;
+    }
+    char *buf = arena->bytes + arena->n;
+    arena->n += width;
+    CHUNKS_ELT(&arena->width, int, idx) = width;
+    return buf;
+}
+
+static SEXP _as_character_CHAR_ARENA(_CHAR_ARENA *arena, int len)
+{
+    SEXP s = PROTECT(NEW_CHARACTER(len));
+    const char *buf = arena->bytes;
+    for (int j = 0; j < len; ++j) {
+        int width = j < arena->width.n * CHUNK_SIZE ?
+            CHUNKS_ELT(&arena->width, int, j) : -1;
+        if (width < 0) {
+            SET_STRING_ELT(s, j, NA_STRING);
+            continue;
+        }
+        SET_STRING_ELT(s, j, mkCharLen(buf, width));
+        buf += width;
+    }
+    UNPROTECT(1);
+    return s;
+}
+
+static SEXP _as_width_CHAR_ARENA(_CHAR_ARENA *arena, int len)
+{
+    SEXP width = NEW_INTEGER(len);
+    _copy_CHUNKS(&arena->width, INTEGER(width), len);
+    return width;
+}
+
+/* _TAG_COLUMN */
+
+/* the 'n' requested tag columns, created on first use */
+_TAG_COLUMN *_tags_SCAN_BAM_DATA(SCAN_BAM_DATA sbd, int n)
+{
+    if (NULL == sbd->tags) {
+        sbd->tags = Calloc(n, _TAG_COLUMN);
+        sbd->n_tags = n;
+        for (int i = 0; i < n; ++i) {
+            sbd->tags[i].type = NILSXP;
+            _init_CHAR_ARENA(&sbd->tags[i].bytes);
+        }
+    }
+    return sbd->tags;
+}
+
+/* a column of R type 'type', NA until set */
+void _init_TAG_COLUMN(_TAG_COLUMN *col, SEXPTYPE type)
+{
+    const int na_int = NA_INTEGER;
+    const double na_real = NA_REAL;
+    const Rbyte zero = 0x0;
+
+    col->type = type;
+    switch (type) {
+    case INTSXP:
+        _init_CHUNKS(&col->values, sizeof(int), &na_int);
+        break;
+    case REALSXP:
+        _init_CHUNKS(&col->values, sizeof(double), &na_real);
+        break;
+    case RAWSXP:
+        _init_CHUNKS(&col->values, sizeof(Rbyte), &zero);
+        break;
+    default:                    /* in 'bytes' */
+        break;
+    }
+}
+
+static void _reset_TAG_COLUMNS(SCAN_BAM_DATA sbd)
+{
+    for (int i = 0; i < sbd->n_tags; ++i) {
+        _grow_CHUNKS(&sbd->tags[i].values, 0);
+        _Free_CHAR_ARENA(&sbd->tags[i].bytes);
+        sbd->tags[i].type = NILSXP;
+    }
+}
+
+/* 'B' array value as an integer or numeric vector */
+static SEXP _bamtag_array(const uint8_t *aux)
+{
+    const char subtype = aux[1];
+    const uint8_t *s = aux + 6;
+    int32_t n;
+    SEXP ans;
+
+    memcpy(&n, aux + 2, 4);
+    if ('f' == subtype) {
+        float f;
+        ans = NEW_NUMERIC(n);
+        for (int j = 0; j < n; ++j, s += 4) {
+            memcpy(&f, s, 4);
+            REAL(ans)[j] = f;
+        }
+        return ans;
+    }
+
+    ans = NEW_INTEGER(n);
+    int *v = INTEGER(ans);
+    for (int j = 0; j < n; ++j) {
+        switch (subtype) {
+        case 'c': v[j] = (int8_t) s[j]; break;
+        case 'C': v[j] = s[j]; break;
+        case 's': { int16_t x; memcpy(&x, s + 2 * j, 2); v[j] = x; break; }
+        case 'S': { uint16_t x; memcpy(&x, s + 2 * j, 2); v[j] = x; break; }
+        case 'i': { int32_t x; memcpy(&x, s + 4 * j, 4); v[j] = x; break; }
+        case 'I': {
+            uint32_t x; memcpy(&x, s + 4 * j, 4);
+            v[j] = x > INT_MAX ? NA_INTEGER : (int) x;
+            break;
+        }
+        default:
+            error("unknown tag array type '%c'", subtype);
+        }
+    }
+    return ans;
+}
+
+static SEXP _as_SEXP_TAG_COLUMN(_TAG_COLUMN *col, int len)
+{
+    SEXP s = R_NilValue;
+    switch (col->type) {
+    case INTSXP:
+        s = NEW_INTEGER(len);
+        _copy_CHUNKS(&col->values, INTEGER(s), len);
+        break;
+    case REALSXP:
+        s = NEW_NUMERIC(len);
+        _copy_CHUNKS(&col->values, REAL(s), len);
+        break;
+    case RAWSXP:
+        s = NEW_RAW(len);
+        _copy_CHUNKS(&col->values, RAW(s), len);
+        break;
+    case STRSXP:
+        s = _as_character_CHAR_ARENA(&col->bytes, len);
+        break;
+    case VECSXP: {
+        s = PROTECT(NEW_LIST(len));
+        const uint8_t *aux = (const uint8_t *) col->bytes.bytes;
+        for (int j = 0; j < len && j < col->bytes.width.n * CHUNK_SIZE;
+             ++j) {
+            int width = CHUNKS_ELT(&col->bytes.width, int, j);
+            if (width < 0)
+                continue;
+            SET_VECTOR_ELT(s, j, _bamtag_array(aux));
+            aux += width;
+        }
+        UNPROTECT(1);
+        break;
+    }
+    default:
+        break;
+    }
+    return s;
+}
+
+/* _SCAN_BAM_DATA */
+
 static void _Free_strhash(khash_t(str) * h)
 {
     khiter_t k;
@@ -25,41 +268,46 @@ static void _Free_strhash(khash_t(str) * h)
     kh_destroy(str, h);
 }
 
-void _Free_SCAN_BAM_DATA(SCAN_BAM_DATA sbd)
+SCAN_BAM_DATA _init_SCAN_BAM_DATA(SEXP result)
 {
-    _Free_strhash(sbd->cigarhash);
-    Free(sbd);
+    SCAN_BAM_DATA sbd = Calloc(1, _SCAN_BAM_DATA);
+    const int na = NA_INTEGER;
+    const char *null = NULL;
+    _CHUNKS *cols[] = {
+        &sbd->flag, &sbd->rname, &sbd->strand, &sbd->pos, &sbd->qwidth,
+        &sbd->mapq, &sbd->mrnm, &sbd->mpos, &sbd->isize, &sbd->partition,
+        &sbd->mates
+    };
+    for (size_t i = 0; i < sizeof(cols) / sizeof(cols[0]); ++i)
+        _init_CHUNKS(cols[i], sizeof(int), &na);
+    _init_CHUNKS(&sbd->cigar, sizeof(const char *), &null);
+    _init_CHAR_ARENA(&sbd->qname);
+    _init_CHAR_ARENA(&sbd->seq);
+    _init_CHAR_ARENA(&sbd->qual);
+    sbd->cigarhash = kh_init(str);
+    sbd->result = result;
+    sbd->mates_flag = NA_LOGICAL;
+    sbd->partition_id = 0;
+    return sbd;
 }
 
-static void _grow_SCAN_BAM_DATA_tags(SEXP tags, int len)
+void _Free_SCAN_BAM_DATA(SCAN_BAM_DATA sbd)
 {
-    int i, j;
-
-    for (i = 0; i < LENGTH(tags); ++i) {
-        SEXP elt = VECTOR_ELT(tags, i);
-        int len0 = LENGTH(elt);
-        elt = Rf_lengthgets(elt, len);
-        SET_VECTOR_ELT(tags, i, elt);
-        switch (TYPEOF(elt)) {
-        case INTSXP:
-            for (j = len0; j < len; ++j)
-                INTEGER(elt)[j] = NA_INTEGER;
-            break;
-        case REALSXP:
-            for (j = len0; j < len; ++j)
-                REAL(elt)[j] = NA_REAL;
-            break;
-        case STRSXP:
-            for (j = len0; j < len; ++j)
-                SET_STRING_ELT(elt, j, NA_STRING);
-            break;
-        case RAWSXP:
-            for (j = len0; j < len; ++j)
-                RAW(elt)[j] = 0x0;
-        default:
-            break;
-        }
-    }
+    _Free_strhash(sbd->cigarhash);
+    _aux_index_free(sbd->tagindex);
+    _CHUNKS *cols[] = {
+        &sbd->flag, &sbd->rname, &sbd->strand, &sbd->pos, &sbd->qwidth,
+        &sbd->mapq, &sbd->mrnm, &sbd->mpos, &sbd->isize, &sbd->partition,
+        &sbd->mates, &sbd->cigar
+    };
+    for (size_t i = 0; i < sizeof(cols) / sizeof(cols[0]); ++i)
+        _grow_CHUNKS(cols[i], 0);
+    _Free_CHAR_ARENA(&sbd->qname);
+    _Free_CHAR_ARENA(&sbd->seq);
+    _Free_CHAR_ARENA(&sbd->qual);
+    _reset_TAG_COLUMNS(sbd);
+    Free(sbd->tags);
+    Free(sbd);
 }
 
 int _grow_SCAN_BAM_DATA(BAM_DATA bd, int len)
@@ -75,53 +323,54 @@ int _grow_SCAN_BAM_DATA(BAM_DATA bd, int len)
             continue;
         switch (i) {
         case FLAG_IDX:
-            sbd->flag = _Rs_Realloc(sbd->flag, len, int);
+            _grow_CHUNKS(&sbd->flag, len);
             break;
         case RNAME_IDX:
-            sbd->rname = _Rs_Realloc(sbd->rname, len, int);
+            _grow_CHUNKS(&sbd->rname, len);
             break;
         case STRAND_IDX:
-            sbd->strand = _Rs_Realloc(sbd->strand, len, int);
+            _grow_CHUNKS(&sbd->strand, len);
             break;
         case POS_IDX:
-            sbd->pos = _Rs_Realloc(sbd->pos, len, int);
+            _grow_CHUNKS(&sbd->pos, len);
             break;
         case QWIDTH_IDX:
-            sbd->qwidth = _Rs_Realloc(sbd->qwidth, len, int);
+            _grow_CHUNKS(&sbd->qwidth, len);
             break;
         case MAPQ_IDX:
-            sbd->mapq = _Rs_Realloc(sbd->mapq, len, int);
+            _grow_CHUNKS(&sbd->mapq, len);
             break;
         case MRNM_IDX:
-            sbd->mrnm = _Rs_Realloc(sbd->mrnm, len, int);
+            _grow_CHUNKS(&sbd->mrnm, len);
             break;
         case MPOS_IDX:
-            sbd->mpos = _Rs_Realloc(sbd->mpos, len, int);
+            _grow_CHUNKS(&sbd->mpos, len);
             break;
         case ISIZE_IDX:
-            sbd->isize = _Rs_Realloc(sbd->isize, len, int);
+            _grow_CHUNKS(&sbd->isize, len);
             break;
         case QNAME_IDX:
-            sbd->qname = _Rs_Realloc(sbd->qname, len, char *);
+            _grow_CHAR_ARENA(&sbd->qname, len);
             break;
         case CIGAR_IDX:
-            sbd->cigar = _Rs_Realloc(sbd->cigar, len, const char *);
+            _grow_CHUNKS(&sbd->cigar, len);
             break;
         case SEQ_IDX:
-            sbd->seq = _Rs_Realloc(sbd->seq, len, const char *);
+            _grow_CHAR_ARENA(&sbd->seq, len);
             break;
         case QUAL_IDX:
-            sbd->qual = _Rs_Realloc(sbd->qual, len, const char *);
+            _grow_CHAR_ARENA(&sbd->qual, len);
             break;
         case TAG_IDX:
-            if (R_NilValue != s)
-                _grow_SCAN_BAM_DATA_tags(s, len);
+            /* tag columns grow as their tags are seen */
+            if (0 == len)
+                _reset_TAG_COLUMNS(sbd);
             break;
         case PARTITION_IDX:
-            sbd->partition = _Rs_Realloc(sbd->partition, len, int);
+            _grow_CHUNKS(&sbd->partition, len);
             break;
         case MATES_IDX:
-            sbd->mates = _Rs_Realloc(sbd->mates, len, int);
+            _grow_CHUNKS(&sbd->mates, len);
             break;
         default:
             Rf_error("[Rsamtools internal] unhandled _grow_SCAN_BAM_DATA");
@@ -138,7 +387,7 @@ SEXP _get_or_grow_SCAN_BAM_DATA(BAM_DATA bd, int len)
     if (len < 0) {
         if (sbd->icnt < sbd->ncnt)
             return VECTOR_ELT(sbd->result, bd->irange);
-        len = sbd->ncnt + bd->BLOCKSIZE;
+        len = sbd->ncnt + CHUNK_SIZE;
     }
 
     sbd->ncnt = _grow_SCAN_BAM_DATA(bd, len);
@@ -158,112 +407,87 @@ void _finish1range_SCAN_BAM_DATA(SCAN_BAM_DATA sbd, bam_header_t *header,
             continue;
         switch (i) {
         case FLAG_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
-            SET_VECTOR_ELT(r, i, s);
-            memcpy(INTEGER(s), sbd->flag, sbd->icnt * sizeof(int));
-            Free(sbd->flag);
+            SET_VECTOR_ELT(r, i, _as_integer_CHUNKS(&sbd->flag, sbd->icnt));
             break;
         case RNAME_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
+            s = _as_integer_CHUNKS(&sbd->rname, sbd->icnt);
             SET_VECTOR_ELT(r, i, s);
-            memcpy(INTEGER(s), sbd->rname, sbd->icnt * sizeof(int));
             _as_factor(s, (const char **) header->target_name,
                        header->n_targets);
-            Free(sbd->rname);
             break;
         case STRAND_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
+            s = _as_integer_CHUNKS(&sbd->strand, sbd->icnt);
             SET_VECTOR_ELT(r, i, s);
-            memcpy(INTEGER(s), sbd->strand, sbd->icnt * sizeof(int));
             _as_strand(s);
-            Free(sbd->strand);
             break;
         case POS_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
-            SET_VECTOR_ELT(r, i, s);
-            memcpy(INTEGER(s), sbd->pos, sbd->icnt * sizeof(int));
-            Free(sbd->pos);
+            SET_VECTOR_ELT(r, i, _as_integer_CHUNKS(&sbd->pos, sbd->icnt));
             break;
         case QWIDTH_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
-            SET_VECTOR_ELT(r, i, s);
-            memcpy(INTEGER(s), sbd->qwidth, sbd->icnt * sizeof(int));
-            Free(sbd->qwidth);
+            SET_VECTOR_ELT(r, i, _as_integer_CHUNKS(&sbd->qwidth, sbd->icnt));
             break;
         case MAPQ_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
-            SET_VECTOR_ELT(r, i, s);
-            memcpy(INTEGER(s), sbd->mapq, sbd->icnt * sizeof(int));
-            Free(sbd->mapq);
+            SET_VECTOR_ELT(r, i, _as_integer_CHUNKS(&sbd->mapq, sbd->icnt));
             break;
         case MRNM_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
+            s = _as_integer_CHUNKS(&sbd->mrnm, sbd->icnt);
             SET_VECTOR_ELT(r, i, s);
-            memcpy(INTEGER(s), sbd->mrnm, sbd->icnt * sizeof(int));
             _as_factor(s, (const char **) header->target_name,
                        header->n_targets);
-            Free(sbd->mrnm);
             break;
         case MPOS_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
-            SET_VECTOR_ELT(r, i, s);
-            memcpy(INTEGER(s), sbd->mpos, sbd->icnt * sizeof(int));
-            Free(sbd->mpos);
+            SET_VECTOR_ELT(r, i, _as_integer_CHUNKS(&sbd->mpos, sbd->icnt));
             break;
         case ISIZE_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
-            SET_VECTOR_ELT(r, i, s);
-            memcpy(INTEGER(s), sbd->isize, sbd->icnt * sizeof(int));
-            Free(sbd->isize);
+            SET_VECTOR_ELT(r, i, _as_integer_CHUNKS(&sbd->isize, sbd->icnt));
             break;
         case QNAME_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
+            s = _as_character_CHAR_ARENA(&sbd->qname, sbd->icnt);
             SET_VECTOR_ELT(r, i, s);
-            for (j = 0; j < sbd->icnt; ++j) {
-                SET_STRING_ELT(s, j, mkChar(sbd->qname[j]));
-                Free(sbd->qname[j]);
-            }
-            Free(sbd->qname);
+            _Free_CHAR_ARENA(&sbd->qname);
             break;
         case CIGAR_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
+            s = NEW_CHARACTER(sbd->icnt);
             SET_VECTOR_ELT(r, i, s);
-            for (j = 0; j < sbd->icnt; ++j)
-                if (NULL == sbd->cigar[j])
+            for (j = 0; j < sbd->icnt; ++j) {
+                const char *cigar = CHUNKS_ELT(&sbd->cigar, const char *, j);
+                if (NULL == cigar)
                     SET_STRING_ELT(s, j, NA_STRING);
                 else
-                    SET_STRING_ELT(s, j, mkChar(sbd->cigar[j]));
-            Free(sbd->cigar);
+                    SET_STRING_ELT(s, j, mkChar(cigar));
+            }
+            _grow_CHUNKS(&sbd->cigar, 0);
             break;
         case SEQ_IDX:
-            s = _as_XStringSet(sbd->seq, sbd->icnt, "DNAString");
+            s = PROTECT(_as_width_CHAR_ARENA(&sbd->seq, sbd->icnt));
+            s = _as_XStringSet(sbd->seq.bytes, s, "DNAString");
             SET_VECTOR_ELT(r, i, s);
-            for (j = 0; j < sbd->icnt; ++j)
-                Free(sbd->seq[j]);
-            Free(sbd->seq);
+            UNPROTECT(1);
+            _Free_CHAR_ARENA(&sbd->seq);
             break;
         case QUAL_IDX:
-            s = _as_PhredQuality(sbd->qual, sbd->icnt);
+            s = PROTECT(_as_width_CHAR_ARENA(&sbd->qual, sbd->icnt));
+            s = _as_PhredQuality(sbd->qual.bytes, s);
             SET_VECTOR_ELT(r, i, s);
-            for (j = 0; j < sbd->icnt; ++j)
-                Free(sbd->qual[j]);
-            Free(sbd->qual);
+            UNPROTECT(1);
+            _Free_CHAR_ARENA(&sbd->qual);
             break;
         case TAG_IDX:
-            _grow_SCAN_BAM_DATA_tags(s, sbd->icnt);
+            for (j = 0; j < sbd->n_tags; ++j)
+                if (NILSXP != sbd->tags[j].type)
+                    SET_VECTOR_ELT(s, j,
+                                   _as_SEXP_TAG_COLUMN(&sbd->tags[j],
+                                                       sbd->icnt));
+            _reset_TAG_COLUMNS(sbd);
             break;
         case PARTITION_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
+            s = _as_integer_CHUNKS(&sbd->partition, sbd->icnt);
             SET_VECTOR_ELT(r, i, s);
-            memcpy(INTEGER(s), sbd->partition, Rf_length(s) * sizeof(int));
-            Free(sbd->partition);
             break;
         case MATES_IDX:
-            s = Rf_lengthgets(s, sbd->icnt);
+            s = _as_integer_CHUNKS(&sbd->mates, sbd->icnt);
             SET_VECTOR_ELT(r, i, s);
-            memcpy(INTEGER(s), sbd->mates, sbd->icnt * sizeof(int));
             _as_factor(s, mates_lvls, 3);
-            Free(sbd->mates);
             break;
         default:
             Rf_error("[Rsamtools internal] unhandled _finish1range_BAM_DATA");
@@ -4,15 +4,48 @@
 #include "samtools/khash.h"
 #include "Rdefines.h"
 #include "bam_data.h"
+#include "aux_index.h"
 
 KHASH_SET_INIT_STR(str)
 
+/* a column of one yield, in chunks of CHUNK_SIZE elements; growing
+   adds chunks, and elements are copied once, into the result */
+#define CHUNK_SHIFT 16
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+
+typedef struct {
+    char **chunk;
+    int n, size;                /* chunks allocated; chunk slots */
+    size_t eltsize;
+    char fill[sizeof(double)];  /* value of new elements */
+} _CHUNKS;
+
+#define CHUNKS_ELT(c, type, idx)                                        \
+    (((type *) (c)->chunk[(idx) >> CHUNK_SHIFT])[(idx) & (CHUNK_SIZE - 1)])
+
+/* variable-width strings of one yield, stored back to back; width -1
+   is NA */
+typedef struct {
+    char *bytes;
+    size_t n, size;
+    _CHUNKS width;
+} _CHAR_ARENA;
+
+/* values of one requested tag */
+typedef struct {
+    SEXPTYPE type;              /* NILSXP until the tag is seen */
+    _CHUNKS values;             /* integer, numeric, raw */
+    _CHAR_ARENA bytes;          /* character; 'B' arrays as encoded */
+} _TAG_COLUMN;
+
 typedef struct {
-    int *flag, *rname, *strand, *pos, *qwidth, *mapq, *mrnm, *mpos, *isize,
-        *partition, *mates;
-    char **qname;
-    const char **cigar, **seq, **qual;
+    _CHUNKS flag, rname, strand, pos, qwidth, mapq, mrnm, mpos, isize,
+        partition, mates, cigar;
+    _CHAR_ARENA qname, seq, qual;
     khash_t(str) *cigarhash;
+    AUX_INDEX tagindex;         /* requested tags */
+    _TAG_COLUMN *tags;
+    int n_tags;
     int icnt, ncnt,
         mates_flag, partition_id; /* set prior to parsing 1 bam record */
     SEXP result;
@@ -27,5 +60,9 @@ void _finish1range_SCAN_BAM_DATA(SCAN_BAM_DATA sbd, bam_header_t *header,
 SEXP _scan_bam_result_init(SEXP template_list, SEXP names, SEXP space,
                            BAM_FILE bfile);
 SEXP _get_or_grow_SCAN_BAM_DATA(BAM_DATA bd, int len);
+char *_reserve_CHAR_ARENA(_CHAR_ARENA *arena, int idx, int width);
+void _grow_CHUNKS(_CHUNKS *c, int len);
+_TAG_COLUMN *_tags_SCAN_BAM_DATA(SCAN_BAM_DATA sbd, int n);
+void _init_TAG_COLUMN(_TAG_COLUMN *col, SEXPTYPE type);
 
 #endif
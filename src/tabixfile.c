@@ -32,12 +32,13 @@ SEXP tabixfile_init()
     return R_NilValue;
 }
 
-SEXP tabixfile_open(SEXP filename, SEXP indexname)
+SEXP tabixfile_open(SEXP filename, SEXP indexname, SEXP nThreads)
 {
     if (!IS_CHARACTER(filename) || 1L != Rf_length(filename))
         Rf_error("'filename' must be character(1)");
     if (!IS_CHARACTER(indexname) || 1L != Rf_length(indexname))
         Rf_error("'indexname' must be character(1)");
+    int n_threads = _checkthreads(nThreads);
 
     _TABIX_FILE *tfile = Calloc(1, _TABIX_FILE);
     tfile->tabix = ti_open(translateChar(STRING_ELT(filename, 0)),
@@ -47,6 +48,8 @@ SEXP tabixfile_open(SEXP filename, SEXP indexname)
         Rf_error("failed to open file");
     }
     tfile->iter = NULL;
+    if (n_threads > 1)
+        bgzf_mt(tfile->tabix->fp, n_threads, 4);
 
     SEXP ext = PROTECT(R_MakeExternalPtr(tfile, TABIXFILE_TAG, filename));
     R_RegisterCFinalizerEx(ext, _tabixfile_finalizer, TRUE);
@@ -18,7 +18,7 @@ SCAN_FUN tabix_as_character;
 SCAN_FUN tabix_count;
 
 SEXP tabixfile_init();
-SEXP tabixfile_open(SEXP filename, SEXP indexname);
+SEXP tabixfile_open(SEXP filename, SEXP indexname, SEXP nThreads);
 SEXP tabixfile_close(SEXP ext);
 SEXP tabixfile_isopen(SEXP ext);
 
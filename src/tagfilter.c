@@ -1,8 +1,39 @@
 #include "tagfilter.h"
+#include "samtools/khash.h"
+
+KHASH_SET_INIT_INT(tagfilt_i)
+KHASH_SET_INIT_STR(tagfilt_s)
+
+/* errors do not return, so the filter is checked before anything is
+   allocated */
+void _tagFilter_check(SEXP tl) {
+    SEXP nmssxp = Rf_getAttrib(tl, R_NamesSymbol);
+    for(int i = 0; i < LENGTH(nmssxp); ++i) {
+        const char *tagname = CHAR(STRING_ELT(nmssxp, i));
+        if(strlen(tagname) != 2)
+            Rf_error("tag '%s' must be two letters", tagname);
+        SEXP sxp_elt = VECTOR_ELT(tl, i);
+        if(LENGTH(sxp_elt) < 1)
+            Rf_error("elements of tag filter list must have non-zero length");
+        switch(TYPEOF(sxp_elt)) {
+        case INTSXP:
+        case STRSXP:
+            break;
+        case REALSXP: /* scanBamTagRange() */
+            if(LENGTH(sxp_elt) != 2)
+                Rf_error("tag filter range must be numeric(2)");
+            break;
+        default:
+            Rf_error("unpermitted tag filter input type '%s'",
+                     Rf_type2char((SEXPTYPE) TYPEOF(sxp_elt)));
+        }
+    }
+}
 
 C_TAGFILTER _tagFilter_as_C_types(SEXP tl) {
     if(LENGTH(tl) == 0)
         return NULL;
+    _tagFilter_check(tl);
     C_TAGFILTER tagfilt = Calloc(1, _C_TAGFILTER);
     SEXP nmssxp = Rf_getAttrib(tl, R_NamesSymbol);
     /* convert tagnames */
@@ -19,38 +50,57 @@ C_TAGFILTER _tagFilter_as_C_types(SEXP tl) {
     for(int i = 0; i < len; ++i) {
         SEXP sxp_elt = VECTOR_ELT(tl, i);
         int elt_len = LENGTH(sxp_elt);
-        if(elt_len < 1)
-            Rf_error("elements of tag filter list must have non-zero length");
+        TAGFILTER_ELT elt = &tagfilt->elts[i];
+        int ret;
         switch(TYPEOF(sxp_elt)) {
         case INTSXP: /* INTEGER */
-            tagfilt->elts[i].len = elt_len;
-            tagfilt->elts[i].type = TAGFILT_T_INT;
-            tagfilt->elts[i].ptr = (int*) INTEGER(sxp_elt);
+            elt->len = elt_len;
+            elt->type = TAGFILT_T_INT;
+            elt->ptr = (int*) INTEGER(sxp_elt);
+            elt->set = kh_init(tagfilt_i);
+            for(int j = 0; j < elt_len; ++j)
+                kh_put(tagfilt_i, (khash_t(tagfilt_i)*) elt->set,
+                       INTEGER(sxp_elt)[j], &ret);
             break;
         case STRSXP: /* CHAR */
-            tagfilt->elts[i].len = elt_len;
-            tagfilt->elts[i].type = TAGFILT_T_STRING;
-            tagfilt->elts[i].ptr = (const char**) Calloc(elt_len, char*);
+            elt->len = elt_len;
+            elt->type = TAGFILT_T_STRING;
+            elt->ptr = (const char**) Calloc(elt_len, char*);
+            elt->set = kh_init(tagfilt_s);
             for(int j = 0; j < elt_len; ++j) {
-                ((const char**) tagfilt->elts[i].ptr)[j] =
-                    CHAR(STRING_ELT(sxp_elt, j));
+                const char *val = CHAR(STRING_ELT(sxp_elt, j));
+                ((const char**) elt->ptr)[j] = val;
+                kh_put(tagfilt_s, (khash_t(tagfilt_s)*) elt->set, val, &ret);
             }
+            elt->single_char = strlen(((const char**) elt->ptr)[0]) == 1;
+            break;
+        case REALSXP: /* scanBamTagRange() */
+            elt->len = elt_len;
+            elt->type = TAGFILT_T_RANGE;
+            elt->range[0] = REAL(sxp_elt)[0];
+            elt->range[1] = REAL(sxp_elt)[1];
             break;
         default:
-            Rf_error("unpermitted tag filter input type '%s'",
-                     Rf_type2char((SEXPTYPE) TYPEOF(sxp_elt)));
+            break;
         }
     }
+    tagfilt->auxindex = _aux_index_new(tagfilt->tagnames, len);
     return tagfilt;
 }
 
 void _Free_C_TAGFILTER(C_TAGFILTER ctf) {
     if(ctf) {
         Free(ctf->tagnames);
+        _aux_index_free(ctf->auxindex);
         if(ctf->elts) {
             for(int i = 0; i < ctf->len; ++i) {
-                if(ctf->elts[i].type == TAGFILT_T_STRING)
+                if(ctf->elts[i].type == TAGFILT_T_STRING) {
                     Free(ctf->elts[i].ptr);
+                    kh_destroy(tagfilt_s,
+                               (khash_t(tagfilt_s)*) ctf->elts[i].set);
+                } else if(ctf->elts[i].type == TAGFILT_T_INT)
+                    kh_destroy(tagfilt_i,
+                               (khash_t(tagfilt_i)*) ctf->elts[i].set);
             }
             Free(ctf->elts);
         }
@@ -59,7 +109,8 @@ void _Free_C_TAGFILTER(C_TAGFILTER ctf) {
 }
 
 static const char* const TagFilterType_str[]  = { "INTERNAL_ERROR: UNSET",
-                                           "integer()", "character()" };
+                                           "integer()", "character()",
+                                           "scanBamTagRange()" };
 
 static const char auxtype[] = "cCsSiIfdAZHB";
 static const char inttype[] = "cCsSiI";
@@ -95,24 +146,74 @@ static void _typeunsupported_error(const char *tagname, uint8_t *aux,
     Rf_error(msg, tagname, printable_typename, tagname, tagtypechar, val_as_string, irec);
 }
 
+/* integer 'B' array element j */
+static int _aux_array_int(const uint8_t *aux, int j)
+{
+    const uint8_t *s = aux + 6;
+    switch(aux[1]) {
+    case 'c': return (int8_t) s[j];
+    case 'C': return s[j];
+    case 's': { int16_t x; memcpy(&x, s + 2 * j, 2); return x; }
+    case 'S': { uint16_t x; memcpy(&x, s + 2 * j, 2); return x; }
+    case 'i': { int32_t x; memcpy(&x, s + 4 * j, 4); return x; }
+    default:  { uint32_t x; memcpy(&x, s + 4 * j, 4); return (int) x; }
+    }
+}
+
+static void _aux_array_as_string(const uint8_t *aux, char *buf, int size)
+{
+    int32_t n;
+    int len;
+    memcpy(&n, aux + 2, 4);
+    len = snprintf(buf, size, "%c", aux[1]);
+    for(int j = 0; j < n && len < size; ++j) {
+        if('f' == aux[1]) {
+            float f;
+            memcpy(&f, aux + 6 + 4 * j, 4);
+            len += snprintf(buf + len, size - len, ",%f", f);
+        } else {
+            len += snprintf(buf + len, size - len, ",%d",
+                            _aux_array_int(aux, j));
+        }
+    }
+}
+
+static int _tagfilter_int(const TAGFILTER_ELT elt, int value)
+{
+    if(elt->type == TAGFILT_T_RANGE)
+        return elt->range[0] <= value && value <= elt->range[1];
+    khash_t(tagfilt_i) *set = (khash_t(tagfilt_i)*) elt->set;
+    return kh_get(tagfilt_i, set, value) != kh_end(set);
+}
+
+static int _tagfilter_string(const TAGFILTER_ELT elt, const char *value)
+{
+    khash_t(tagfilt_s) *set = (khash_t(tagfilt_s)*) elt->set;
+    return kh_get(tagfilt_s, set, value) != kh_end(set);
+}
+
+static int _tagfilter_real(const TAGFILTER_ELT elt, double value)
+{
+    return elt->range[0] <= value && value <= elt->range[1];
+}
+
 int _tagfilter(const bam1_t * bam, C_TAGFILTER tagfilter, int irec)
 {
     int len = tagfilter->len;
+    /* one pass over the aux data finds every filtered tag */
+    if(_aux_index_find(tagfilter->auxindex, bam) <
+       tagfilter->auxindex->n_unique)
+        return 0;
     for(int i = 0; i < len; ++i) {
         const char* tagname = tagfilter->tagnames[i];
-        void *list_elt = tagfilter->elts[i].ptr;
-        uint8_t *aux = bam_aux_get(bam, tagname);
-        if(aux == NULL)
-            return 0;
-
-        int idx;
-        /* one bamf* for each case in switch */
-        int bamfi;
-        float bamff;
-        double bamfd;
-        char bamfA;
-        char* bamfZ;
+        const TAGFILTER_ELT elt = &tagfilter->elts[i];
+        uint8_t *aux = _aux_index_get(tagfilter->auxindex, i);
+        int32_t n_array;
+        int j, pass;
+        char bamfA[2] = { '\0', '\0' };
         char val_as_string[51];
+
+        /* errors format the value; matches only compare it */
         switch(aux[0]) {
         case 'c':
         case 'C':
@@ -120,67 +221,69 @@ int _tagfilter(const bam1_t * bam, C_TAGFILTER tagfilter, int irec)
         case 'S':
         case 'i':
         case 'I': /* INTEGER */
-            bamfi = bam_aux2i(aux);
-            if(tagfilter->elts[i].type != TAGFILT_T_INT) {
-                snprintf(val_as_string, 51, "%d", bamfi);
-                _typemismatch_error(tagname, aux, tagfilter->elts[i].type,
+            if(elt->type == TAGFILT_T_STRING) {
+                snprintf(val_as_string, 51, "%d", bam_aux2i(aux));
+                _typemismatch_error(tagname, aux, elt->type,
                                     val_as_string, irec);
             }
-            for(idx = 0; idx < tagfilter->elts[i].len; ++idx) {
-                if(bamfi == ((int*) list_elt)[idx])
-                    break;
-            }
-            if(idx == tagfilter->elts[i].len)
+            if(!_tagfilter_int(elt, bam_aux2i(aux)))
                 return 0;
             break;
         case 'f': /* REAL */
-            bamff = bam_aux2f(aux);
-            snprintf(val_as_string, 51, "%f", bamff);
-            _typeunsupported_error(tagname, aux, val_as_string, irec);
-            break;
-        case 'd': /* REAL */
-            bamfd = bam_aux2d(aux);
-            snprintf(val_as_string, 51, "%f", bamfd);
-            _typeunsupported_error(tagname, aux, val_as_string, irec);
+        case 'd':
+            if(elt->type != TAGFILT_T_RANGE) {
+                snprintf(val_as_string, 51, "%f", aux[0] == 'f' ?
+                         (double) bam_aux2f(aux) : bam_aux2d(aux));
+                _typeunsupported_error(tagname, aux, val_as_string, irec);
+            }
+            if(!_tagfilter_real(elt, aux[0] == 'f' ?
+                                (double) bam_aux2f(aux) : bam_aux2d(aux)))
+                return 0;
             break;
         case 'A': /* STRSXP */
-            bamfA = bam_aux2A(aux);
-            if(tagfilter->elts[i].type != TAGFILT_T_STRING ||
-               strlen(*((const char**) list_elt)) != 1) {
-                snprintf(val_as_string, 51, "%c", bamfA);
-                _typemismatch_error(tagname, aux, tagfilter->elts[i].type,
-                                    val_as_string, irec);
-            }
-            for(idx = 0; idx < tagfilter->elts[i].len; ++idx) {
-                if(bamfA == *((const char**) list_elt)[idx])
-                    break;
-            }
-            if(idx == tagfilter->elts[i].len)
+            bamfA[0] = bam_aux2A(aux);
+            if(elt->type != TAGFILT_T_STRING || !elt->single_char)
+                _typemismatch_error(tagname, aux, elt->type, bamfA, irec);
+            if(!_tagfilter_string(elt, bamfA))
                 return 0;
             break;
         case 'Z': /* STRSXP */
-            bamfZ = bam_aux2Z(aux);
-            if(tagfilter->elts[i].type != TAGFILT_T_STRING) {
-                snprintf(val_as_string, 51, "%s", bamfZ);
-                _typemismatch_error(tagname, aux, tagfilter->elts[i].type,
+            if(elt->type != TAGFILT_T_STRING) {
+                snprintf(val_as_string, 51, "%s", bam_aux2Z(aux));
+                _typemismatch_error(tagname, aux, elt->type,
                                     val_as_string, irec);
             }
-            for(idx = 0; idx < tagfilter->elts[i].len; ++idx) {
-                if(!strcmp(bamfZ, ((const char**) list_elt)[idx]))
-                    break;
-            }
-            if(idx == tagfilter->elts[i].len)
+            if(!_tagfilter_string(elt, bam_aux2Z(aux)))
                 return 0;
             break;
         case 'H': /* RAWSXP */
             /* Can actually use bam_aux2Z(aux) to get a
              * null-terminated char array */
-            bamfZ = bam_aux2Z(aux);
-            snprintf(val_as_string, 51, "%s", bamfZ);
+            snprintf(val_as_string, 51, "%s", bam_aux2Z(aux));
             _typeunsupported_error(tagname, aux, val_as_string, irec);
             break;
-        case 'B':
-            _typeunsupported_error(tagname, aux, "[unknown]", irec);
+        case 'B': /* array: any element passes */
+            if(elt->type == TAGFILT_T_STRING ||
+               ('f' == aux[1] && elt->type != TAGFILT_T_RANGE)) {
+                _aux_array_as_string(aux, val_as_string, 51);
+                if('f' == aux[1])
+                    _typeunsupported_error(tagname, aux, val_as_string,
+                                           irec);
+                _typemismatch_error(tagname, aux, elt->type,
+                                    val_as_string, irec);
+            }
+            memcpy(&n_array, aux + 2, 4);
+            pass = 0;
+            for(j = 0; j < n_array && !pass; ++j) {
+                if('f' == aux[1]) {
+                    float f;
+                    memcpy(&f, aux + 6 + 4 * j, 4);
+                    pass = _tagfilter_real(elt, f);
+                } else
+                    pass = _tagfilter_int(elt, _aux_array_int(aux, j));
+            }
+            if(!pass)
+                return 0;
             break;
         default:
             Rf_error("unknown tag type '%c', record %d", aux[0], irec);
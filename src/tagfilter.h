@@ -3,23 +3,28 @@
 
 #include "samtools/sam.h"
 #include <Rdefines.h>
+#include "aux_index.h"
 
 typedef enum { TAGFILT_T_UNSET = 0, TAGFILT_T_INT,
-               TAGFILT_T_STRING } TagFilterType;
+               TAGFILT_T_STRING, TAGFILT_T_RANGE } TagFilterType;
 
 typedef struct {
     int len;
     TagFilterType type;
     void* ptr;
-    
+    void* set;          /* hash set of the INT or STRING values */
+    double range[2];    /* RANGE: inclusive lower and upper bound */
+    int single_char;    /* STRING: first value is one character */
 } _TAGFILTER_ELT, *TAGFILTER_ELT;
 
 typedef struct {
     int len;
     const char **tagnames;
     _TAGFILTER_ELT *elts;
+    AUX_INDEX auxindex;
 } _C_TAGFILTER, *C_TAGFILTER;
 
+void _tagFilter_check(SEXP tl);
 C_TAGFILTER _tagFilter_as_C_types(SEXP tl);
 void _Free_C_TAGFILTER(C_TAGFILTER ctf);
 
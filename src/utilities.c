@@ -1,5 +1,11 @@
+#include <string.h>
 #include <Rdefines.h>
 #include <R_ext/RS.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "utilities.h"
 #include "IRanges_interface.h"
 #include "XVector_interface.h"
@@ -96,7 +102,8 @@ void _as_factor(SEXP vec, const char **lvls, const int n_lvls)
     UNPROTECT(1);
 }
 
-SEXP _as_XStringSet(const char **key, int len, const char *baseclass)
+/* 'bytes' holds the elements back to back, element i 'width[i]' long */
+SEXP _as_XStringSet(const char *bytes, SEXP width, const char *baseclass)
 {
     char classname[40];         /* longest string should be "DNAStringSet" */
 
@@ -114,31 +121,45 @@ SEXP _as_XStringSet(const char **key, int len, const char *baseclass)
         lkup_length = LENGTH(lkup);
     }
 
-    SEXP width, ans;
-    int i;
-    PROTECT(width = NEW_INTEGER(len));
-    for (i = 0; i < len; ++i)
-        INTEGER(width)[i] = strlen(key[i]);
-    PROTECT(ans = alloc_XRawList(classname, baseclass, width));
-
-    XVectorList_holder holder;
-    Chars_holder dest;
-    holder = hold_XVectorList(ans);
-    for (i = 0; i < len; ++i) {
-        const char *seq = key[i];
-        dest = get_elt_from_XRawList_holder(&holder, i);
-        Ocopy_bytes_to_i1i2_with_lkup(0, dest.length - 1, (char *) dest.ptr,
-                                      dest.length, seq, strlen(seq), lkup0,
-                                      lkup_length);
+    const int len = LENGTH(width);
+    SEXP ans = PROTECT(alloc_XRawList(classname, baseclass, width));
+    if (len == 0) {
+        UNPROTECT(1);
+        return ans;
     }
 
-    UNPROTECT(2);
+    XVectorList_holder holder = hold_XVectorList(ans);
+    Chars_holder first = get_elt_from_XRawList_holder(&holder, 0),
+        last = get_elt_from_XRawList_holder(&holder, len - 1);
+    size_t total = 0;
+    for (int i = 0; i < len; ++i)
+        total += INTEGER(width)[i];
+
+    if (last.ptr + last.length == first.ptr + total) {
+        /* elements are contiguous: one copy */
+        if (total > 0)
+            Ocopy_bytes_to_i1i2_with_lkup(0, total - 1, (char *) first.ptr,
+                                          total, bytes, total, lkup0,
+                                          lkup_length);
+    } else {
+        for (int i = 0; i < len; ++i) {
+            Chars_holder dest = get_elt_from_XRawList_holder(&holder, i);
+            if (dest.length > 0)
+                Ocopy_bytes_to_i1i2_with_lkup(0, dest.length - 1,
+                                              (char *) dest.ptr, dest.length,
+                                              bytes, dest.length, lkup0,
+                                              lkup_length);
+            bytes += dest.length;
+        }
+    }
+
+    UNPROTECT(1);
     return ans;
 }
 
-SEXP _as_PhredQuality(const char **key, int len)
+SEXP _as_PhredQuality(const char *bytes, SEXP width)
 {
-    SEXP xstringset = PROTECT(_as_XStringSet(key, len, "BString"));
+    SEXP xstringset = PROTECT(_as_XStringSet(bytes, width, "BString"));
 
     SEXP s, t, nmspc, result;
     nmspc = PROTECT(_get_namespace("Rsamtools"));
@@ -151,52 +172,139 @@ SEXP _as_PhredQuality(const char **key, int len)
 
 void _reverse(char *buf, int len)
 {
-    int i;
     char tmp;
-    for (i = 0; i < floor(len / 2); ++i) {
-        tmp = buf[len - i - 1];
-        buf[len - i - 1] = buf[i];
+    for (int i = 0, j = len - 1; i < j; ++i, --j) {
+        tmp = buf[j];
+        buf[j] = buf[i];
         buf[i] = tmp;
     }
 }
 
+static char _complement_map[256];
+
+static void _complement_map_init()
+{
+    static int init = 0;
+    if (init)
+        return;
+    for (int i = 0; i < 256; ++i)
+        _complement_map[i] = (char) i;
+    const char *from = "ACGTacgtMRYKmrykVHDBvhdb",
+        *to = "TGCAtgcaKYRMkyrmBDHVbdhv";
+    for (int i = 0; from[i] != '\0'; ++i)
+        _complement_map[(unsigned char) from[i]] = to[i];
+    init = 1;
+}
+
 void _reverseComplement(char *buf, int len)
 {
-    static const int MAX_MAP = 256;
-    static char map[256];
+    const char *map = _complement_map;
+    char tmp;
+    _complement_map_init();
+    for (int i = 0, j = len - 1; i <= j; ++i, --j) {
+        tmp = map[(unsigned char) buf[j]];
+        buf[j] = map[(unsigned char) buf[i]];
+        buf[i] = tmp;
+    }
+}
+
+/* BAM 4-bit sequence and quality decoding
+ *
+ * Each byte of a BAM sequence holds two bases; _seq_pair[byte] is their
+ * letters and _seq_pair_rc[byte] their complements in reverse order, so
+ * one lookup writes two bases. With SSSE3 (e.g., -mssse3), 16 bytes are
+ * decoded at a time with a byte shuffle; qualities use SSE2. */
+
+static const char _seq_key[] = "-ACMGRSVTWYHKDBN";
+static const char _seq_key_rc[] = "-TGKCYSBAWRDMHVN";
+static char _seq_pair[256][2], _seq_pair_rc[256][2];
+
+static void _seq_pair_init()
+{
     static int init = 0;
-    if (init == 0) {
-        init = 1;
-        for (int i = 0; i < MAX_MAP; ++i)
-            map[i] = (char) i;
-        map['A'] = 'T';
-        map['C'] = 'G';
-        map['G'] = 'C';
-        map['T'] = 'A';
-        map['a'] = 't';
-        map['c'] = 'g';
-        map['g'] = 'c';
-        map['t'] = 'a';
-        map['M'] = 'K';
-        map['R'] = 'Y';
-        map['Y'] = 'R';
-        map['K'] = 'M';
-        map['m'] = 'k';
-        map['r'] = 'y';
-        map['y'] = 'r';
-        map['k'] = 'm';
-        map['V'] = 'B';
-        map['H'] = 'D';
-        map['D'] = 'H';
-        map['B'] = 'V';
-        map['v'] = 'b';
-        map['h'] = 'd';
-        map['d'] = 'h';
-        map['b'] = 'v';
+    if (init)
+        return;
+    for (int i = 0; i < 256; ++i) {
+        _seq_pair[i][0] = _seq_key[i >> 4];
+        _seq_pair[i][1] = _seq_key[i & 0xf];
+        _seq_pair_rc[i][0] = _seq_key_rc[i & 0xf];
+        _seq_pair_rc[i][1] = _seq_key_rc[i >> 4];
+    }
+    init = 1;
+}
+
+void _bam_seq_decode(char *buf, const unsigned char *seq, int len,
+                     int reverseComplement)
+{
+    const int npair = len / 2;
+    int i = 0;
+
+    _seq_pair_init();
+    if (!reverseComplement) {
+#ifdef __SSSE3__
+        const __m128i key = _mm_loadu_si128((const __m128i *) _seq_key),
+            mask = _mm_set1_epi8(0xf);
+        for (; i + 16 <= npair; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (seq + i)),
+                hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask),
+                lo = _mm_and_si128(x, mask);
+            _mm_storeu_si128((__m128i *) (buf + 2 * i),
+                _mm_shuffle_epi8(key, _mm_unpacklo_epi8(hi, lo)));
+            _mm_storeu_si128((__m128i *) (buf + 2 * i + 16),
+                _mm_shuffle_epi8(key, _mm_unpackhi_epi8(hi, lo)));
+        }
+#endif
+        for (; i < npair; ++i)
+            memcpy(buf + 2 * i, _seq_pair[seq[i]], 2);
+        if (len & 1)
+            buf[len - 1] = _seq_key[seq[npair] >> 4];
+    } else {
+        /* byte i holds bases 2i, 2i + 1, written to len - 1 - 2i and
+           len - 2 - 2i */
+#ifdef __SSSE3__
+        const __m128i key = _mm_loadu_si128((const __m128i *) _seq_key_rc),
+            mask = _mm_set1_epi8(0xf),
+            rev = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                               8, 9, 10, 11, 12, 13, 14, 15);
+        for (; i + 16 <= npair; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (seq + i)),
+                hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask),
+                lo = _mm_and_si128(x, mask);
+            char *out = buf + len - 2 * i - 32;
+            _mm_storeu_si128((__m128i *) (out + 16),
+                _mm_shuffle_epi8(key, _mm_shuffle_epi8(
+                    _mm_unpacklo_epi8(hi, lo), rev)));
+            _mm_storeu_si128((__m128i *) out,
+                _mm_shuffle_epi8(key, _mm_shuffle_epi8(
+                    _mm_unpackhi_epi8(hi, lo), rev)));
+        }
+#endif
+        for (; i < npair; ++i)
+            memcpy(buf + len - 2 - 2 * i, _seq_pair_rc[seq[i]], 2);
+        if (len & 1)
+            buf[0] = _seq_key_rc[seq[npair] >> 4];
+    }
+}
+
+void _bam_qual_decode(char *buf, const unsigned char *qual, int len,
+                      int reverse)
+{
+    int i = 0;
+    if (!reverse) {
+#ifdef __SSE2__
+        const __m128i offset = _mm_set1_epi8(33);
+        for (; i + 16 <= len; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (qual + i));
+            _mm_storeu_si128((__m128i *) (buf + i),
+                             _mm_add_epi8(x, offset));
+        }
+#endif
+        for (; i < len; ++i)
+            buf[i] = qual[i] + 33;
+    } else {
+        for (; i < len; ++i)
+            buf[len - 1 - i] = qual[i] + 33;
     }
-    _reverse(buf, len);
-    for (int i = 0; i < len; ++i)
-        buf[i] = map[(int) buf[i]];
 }
 
 char *_rtrim(char *s)
@@ -228,6 +336,14 @@ void _checknames(SEXP filename, SEXP indexname, SEXP filemode)
         Rf_error("'filemode' must be character(1)");
 }
 
+int _checkthreads(SEXP nThreads)
+{
+    if (!IS_INTEGER(nThreads) || LENGTH(nThreads) != 1 ||
+        INTEGER(nThreads)[0] == NA_INTEGER || INTEGER(nThreads)[0] < 1)
+        Rf_error("'nThreads' must be integer(1) >= 1");
+    return INTEGER(nThreads)[0];
+}
+
 void _checkparams(SEXP space, SEXP keepFlags, SEXP isSimpleCigar)
 {
     const int MAX_CHRLEN = 1 << 29;	/* See samtools/bam_index.c */
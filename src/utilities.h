@@ -21,10 +21,14 @@ void _as_factor(SEXP vec, const char **lvls, const int n_lvls);
 void _as_strand(SEXP vec);
 void _as_nucleotide(SEXP vec);
 void _as_seqlevels(SEXP vec, SEXP lvls);
-SEXP _as_XStringSet(const char **key, int len, const char *baseclass);
-SEXP _as_PhredQuality(const char **key, int len);
+SEXP _as_XStringSet(const char *bytes, SEXP width, const char *baseclass);
+SEXP _as_PhredQuality(const char *bytes, SEXP width);
 void _reverse(char *buf, int len);
 void _reverseComplement(char *buf, int len);
+void _bam_seq_decode(char *buf, const unsigned char *seq, int len,
+                     int reverseComplement);
+void _bam_qual_decode(char *buf, const unsigned char *qual, int len,
+                      int reverse);
 char *_rtrim(char *);
 
 /* common checks */
@@ -32,6 +36,7 @@ char *_rtrim(char *);
 void _checkext(SEXP ext, SEXP tag, const char *lbl);
 void _checknames(SEXP filename, SEXP indexname, SEXP filemode);
 void _checkparams(SEXP space, SEXP keepFlags, SEXP isSimpleCigar);
+int _checkthreads(SEXP nThreads);
 
 /* pairing */
 
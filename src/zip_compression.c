@@ -2,6 +2,7 @@
 #include <errno.h>
 #include <zlib.h>
 #include "zip_compression.h"
+#include "utilities.h"
 #include "bgzf.h"
 #include "razf.h"
 
@@ -37,23 +38,36 @@ void _zip_open(SEXP file, SEXP dest, int *infd, int *outfd)
     }
 }
 
-SEXP bgzip(SEXP file, SEXP dest)
+static int _zip_level(SEXP level)
+{
+    if (!IS_INTEGER(level) || LENGTH(level) != 1 ||
+        INTEGER(level)[0] == NA_INTEGER ||
+        INTEGER(level)[0] < 0 || INTEGER(level)[0] > 9)
+        Rf_error("'level' must be integer(1) between 0 and 9");
+    return INTEGER(level)[0];
+}
+
+SEXP bgzip(SEXP file, SEXP dest, SEXP nThreads, SEXP level)
 {
     static const int BUF_SIZE = 64 * 1024;
     void *buffer;
-    int infd, outfd, cnt;
+    int infd, outfd, cnt, n = _checkthreads(nThreads);
+    char mode[3] = "w";
     gzFile in;
     BGZF *outp;
 
+    mode[1] = '0' + _zip_level(level);
     buffer = R_alloc(BUF_SIZE, sizeof(void *));
 
     _zip_open(file, dest, &infd, &outfd);
     in = gzdopen(infd, "rb");
     if (NULL == in)
         _zip_error("opening input 'file'", NULL, infd, outfd);
-    outp = bgzf_dopen(outfd, "w");
+    outp = bgzf_dopen(outfd, mode);
     if (NULL == outp)
         _zip_error("opening output 'dest'", NULL, infd, outfd);
+    if (n > 1)
+        bgzf_mt(outp, n, 256);
 
     while (0 < (cnt = gzread(in, buffer, BUF_SIZE)))
         if (0 > bgzf_write(outp, buffer, cnt))
@@ -70,21 +84,26 @@ SEXP bgzip(SEXP file, SEXP dest)
     return dest;
 }
 
-SEXP razip(SEXP file, SEXP dest)
+SEXP razip(SEXP file, SEXP dest, SEXP nThreads, SEXP level)
 {
     static const int WINDOW_SIZE = 4096;
     void *buffer;
-    int infd, outfd, cnt;
+    int infd, outfd, cnt, n = _checkthreads(nThreads);
+    char mode[3] = "w";
     gzFile in;
     RAZF *outp;
 
+    mode[1] = '0' + _zip_level(level);
+
     _zip_open(file, dest, &infd, &outfd);
     in = gzdopen(infd, "rb");
     if (NULL == in)
         _zip_error("opening input 'file'", NULL, infd, outfd);
-    outp = razf_dopen(outfd, "w");
+    outp = razf_dopen(outfd, mode);
     if (NULL == outp)
         _zip_error("opening output 'dest'", NULL, infd, outfd);
+    if (n > 1)
+        razf_mt(outp, n, 4);
 
     buffer = R_alloc(WINDOW_SIZE, sizeof(const int));
     while (0 < (cnt = gzread(in, buffer, WINDOW_SIZE)))
@@ -3,7 +3,7 @@
 
 #include <Rdefines.h>
 
-SEXP bgzip(SEXP from, SEXP dest);
-SEXP razip(SEXP from, SEXP dest);
+SEXP bgzip(SEXP from, SEXP dest, SEXP nThreads, SEXP level);
+SEXP razip(SEXP from, SEXP dest, SEXP nThreads, SEXP level);
 
 #endif